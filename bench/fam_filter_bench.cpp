@@ -0,0 +1,152 @@
+
+/***************************************************************************
+ *  fam_filter_bench.cpp - Benchmark compiled FAM filters against regexec
+ *
+ *  Created: Sun Oct 18 14:05:51 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Generates a storm of file names and relative paths, like editors,
+ * version control and build tools produce them, and filters it once
+ * with regexec() over a list of compiled regular expressions, as
+ * FileAlterationMonitor did before, and once with FamPathFilter. Both
+ * must accept the same events. The time is reported in nanoseconds per
+ * event for each filter set.
+ *
+ * Usage: fam_filter_bench [events [runs]]
+ * Defaults are 1000000 events and 5 runs, the best run is reported.
+ */
+
+#include <lua_utils/fam_filter.h>
+
+#include <regex.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace fawkes;
+
+/* Filter sets, each a list of regular expressions all of which must match. */
+static const char *filter_sets[][3] = {
+  { "^[^.].*\\.lua$", NULL, NULL },			// LuaContext restart filter
+  { "^[^.].*init\\.lua$", NULL, NULL },
+  { "\\.lua$", "^skill_", NULL },
+  { "^[a-z_]+\\.lua$", NULL, NULL },			// not simplified, regexec
+};
+static const unsigned int num_filter_sets = sizeof(filter_sets) / sizeof(filter_sets[0]);
+
+static const char *name_forms[] = {
+  "%s%u.lua", ".#%s%u.lua", "%s%u.lua~", ".%s%u.lua.swp", "%s%u.luac",
+  "%s%u.lua.tmp", "init.lua", "%s%u_init.lua", "%s%u", "4913", "%s%u.lua"
+};
+static const unsigned int num_name_forms = sizeof(name_forms) / sizeof(name_forms[0]);
+
+static double
+now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000. + ts.tv_nsec;
+}
+
+static void
+make_storm(unsigned int num_events, std::vector<std::string> &names,
+	   std::vector<std::string> &paths)
+{
+  static const char *stems[] = { "skill_goto", "agent", "motion", "skill_grab", "util" };
+  char name[64], dir[64];
+  srand(42);
+  for (unsigned int i = 0; i < num_events; ++i) {
+    unsigned int r = rand();
+    snprintf(name, sizeof(name), name_forms[r % num_name_forms], stems[(r >> 8) % 5],
+	     (r >> 12) % 100);
+    snprintf(dir, sizeof(dir), "pkg%u/src/d%u/", (r >> 16) % 10, (r >> 20) % 20);
+    names.push_back(name);
+    paths.push_back(std::string(dir) + name);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned int num_events = (argc > 1) ? atoi(argv[1]) : 1000000;
+  unsigned int runs       = (argc > 2) ? atoi(argv[2]) : 5;
+  if ((num_events == 0) || (runs == 0)) {
+    fprintf(stderr, "Usage: %s [events [runs]]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<std::string> names, paths;
+  make_storm(num_events, names, paths);
+  printf("%u events, ns per event, best of %u runs\n", num_events, runs);
+  printf("%-36s %10s %10s %9s\n", "filters", "regexec", "compiled", "accepted");
+
+  int rv = 0;
+  for (unsigned int f = 0; f < num_filter_sets; ++f) {
+    std::vector<regex_t> regexes;
+    FamPathFilter filter;
+    std::string desc;
+    for (unsigned int i = 0; (i < 3) && filter_sets[f][i]; ++i) {
+      regex_t re;
+      if (regcomp(&re, filter_sets[f][i], REG_EXTENDED | REG_NOSUB) != 0) {
+	fprintf(stderr, "Failed to compile %s\n", filter_sets[f][i]);
+	return 1;
+      }
+      regexes.push_back(re);
+      filter.add_required_regex(filter_sets[f][i]);
+      if (! desc.empty())  desc += " ";
+      desc += filter_sets[f][i];
+    }
+
+    double best_old = 0, best_new = 0;
+    unsigned long accepted_old = 0, accepted_new = 0;
+    for (unsigned int r = 0; r < runs; ++r) {
+      accepted_old = accepted_new = 0;
+
+      double start = now_ns();
+      for (unsigned int e = 0; e < num_events; ++e) {
+	bool ok = true;
+	for (size_t i = 0; ok && (i < regexes.size()); ++i) {
+	  ok = (regexec(&regexes[i], names[e].c_str(), 0, NULL, 0) == 0);
+	}
+	if (ok)  ++accepted_old;
+      }
+      double t_old = now_ns() - start;
+
+      start = now_ns();
+      for (unsigned int e = 0; e < num_events; ++e) {
+	if (filter.matches(names[e].c_str(), paths[e].c_str()))  ++accepted_new;
+      }
+      double t_new = now_ns() - start;
+
+      if ((r == 0) || (t_old < best_old))  best_old = t_old;
+      if ((r == 0) || (t_new < best_new))  best_new = t_new;
+    }
+
+    printf("%-36s %10.1f %10.1f %9lu\n", desc.c_str(), best_old / num_events,
+	   best_new / num_events, accepted_new);
+    if (accepted_old != accepted_new) {
+      printf("  MISMATCH: regexec accepted %lu events\n", accepted_old);
+      rv = 1;
+    }
+    for (size_t i = 0; i < regexes.size(); ++i)  regfree(&regexes[i]);
+  }
+
+  return rv;
+}
@@ -0,0 +1,143 @@
+
+/***************************************************************************
+ *  fam_tree_bench.cpp - Benchmark watch setup on synthetic directory trees
+ *
+ *  Created: Sat Oct 17 12:19:17 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Generates a tree of directories and files below a temporary directory
+ * and measures how long FileAlterationMonitor::watch_dir() takes to set
+ * up the watches for it. The time is reported per run and normalized to
+ * 10000 entries, directories and files together, so that runs with
+ * different tree shapes can be compared.
+ *
+ * Usage: fam_tree_bench [dirs [files_per_dir [fanout [runs]]]]
+ * Defaults are 2000 directories, 40 files per directory, 10
+ * subdirectories per directory and 5 runs. Each directory needs one
+ * inotify watch, keep dirs below /proc/sys/fs/inotify/max_user_watches.
+ */
+
+#include <lua_utils/fam.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace fawkes;
+
+static double
+now_ms()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static bool
+make_tree(const std::string &root, std::vector<std::string> &dirs,
+	  unsigned int num_dirs, unsigned int num_files, unsigned int fanout)
+{
+  char name[32];
+  dirs.push_back(root);
+  for (unsigned int d = 1; d < num_dirs; ++d) {
+    snprintf(name, sizeof(name), "/d%u", d);
+    dirs.push_back(dirs[(d - 1) / fanout] + name);
+    if (mkdir(dirs.back().c_str(), 0755) != 0)  return false;
+  }
+  for (unsigned int d = 0; d < num_dirs; ++d) {
+    for (unsigned int f = 0; f < num_files; ++f) {
+      snprintf(name, sizeof(name), "/f%u.lua", f);
+      int fd = open((dirs[d] + name).c_str(), O_WRONLY | O_CREAT, 0644);
+      if (fd == -1)  return false;
+      close(fd);
+    }
+  }
+  return true;
+}
+
+static void
+remove_tree(const std::vector<std::string> &dirs, unsigned int num_files)
+{
+  char name[32];
+  for (size_t d = dirs.size(); d > 0; --d) {
+    for (unsigned int f = 0; f < num_files; ++f) {
+      snprintf(name, sizeof(name), "/f%u.lua", f);
+      unlink((dirs[d - 1] + name).c_str());
+    }
+    rmdir(dirs[d - 1].c_str());
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned int num_dirs  = (argc > 1) ? atoi(argv[1]) : 2000;
+  unsigned int num_files = (argc > 2) ? atoi(argv[2]) : 40;
+  unsigned int fanout    = (argc > 3) ? atoi(argv[3]) : 10;
+  unsigned int runs      = (argc > 4) ? atoi(argv[4]) : 5;
+  if ((num_dirs == 0) || (fanout == 0) || (runs == 0)) {
+    fprintf(stderr, "Usage: %s [dirs [files_per_dir [fanout [runs]]]]\n", argv[0]);
+    return 1;
+  }
+
+  char tmpl[] = "/tmp/fam_tree_bench.XXXXXX";
+  if (mkdtemp(tmpl) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::vector<std::string> dirs;
+  if (! make_tree(tmpl, dirs, num_dirs, num_files, fanout)) {
+    perror("creating tree");
+    remove_tree(dirs, num_files);
+    return 1;
+  }
+
+  double entries = num_dirs + (double)num_dirs * num_files;
+  printf("%u directories, %u files each, fanout %u, %.0f entries\n",
+	 num_dirs, num_files, fanout, entries);
+
+  double best = 0;
+  int rv = 0;
+  for (unsigned int r = 0; r < runs; ++r) {
+    try {
+      FileAlterationMonitor fam;
+      double start = now_ms();
+      fam.watch_dir(tmpl);
+      double ms = now_ms() - start;
+      if ((r == 0) || (ms < best))  best = ms;
+      printf("run %u: %8.2f ms, %8.2f ms per 10k entries\n",
+	     r + 1, ms, ms * 10000. / entries);
+    } catch (std::exception &e) {
+      fprintf(stderr, "watch_dir failed: %s\n", e.what());
+      rv = 1;
+      break;
+    }
+  }
+  if (rv == 0) {
+    printf("best:  %8.2f ms, %8.2f ms per 10k entries\n",
+	   best, best * 10000. / entries);
+  }
+
+  remove_tree(dirs, num_files);
+  return rv;
+}
@@ -0,0 +1,122 @@
+
+/***************************************************************************
+ *  fam_wakeup_bench.cpp - Benchmark waking up a thread waiting for events
+ *
+ *  Created: Sun Oct 18 16:31:09 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Measures the time from FileAlterationMonitor::interrupt() in one
+ * thread until process_events() returns in another thread which waits
+ * without a timeout. The waiting thread is given time to block before
+ * each interrupt, so every sample includes a full wakeup. Median, 99th
+ * percentile and maximum are reported in microseconds.
+ *
+ * Usage: fam_wakeup_bench [wakeups [gap_us]]
+ * Defaults are 10000 wakeups with 200 microseconds between them.
+ */
+
+#include <lua_utils/fam.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+using namespace fawkes;
+
+static FileAlterationMonitor *fam;
+static unsigned int    num_wakeups;
+static unsigned int    gap_us;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cond  = PTHREAD_COND_INITIALIZER;
+static unsigned int    num_returned = 0;
+static long long       interrupt_ns = 0;
+
+static long long
+now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *
+interrupter(void *arg)
+{
+  for (unsigned int i = 0; i < num_wakeups; ++i) {
+    // wait for the previous wakeup to be taken, then let the waiter block
+    pthread_mutex_lock(&mutex);
+    while (num_returned < i)  pthread_cond_wait(&cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+    usleep(gap_us);
+
+    pthread_mutex_lock(&mutex);
+    interrupt_ns = now_ns();
+    pthread_mutex_unlock(&mutex);
+    fam->interrupt();
+  }
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  num_wakeups = (argc > 1) ? atoi(argv[1]) : 10000;
+  gap_us      = (argc > 2) ? atoi(argv[2]) : 200;
+  if (num_wakeups == 0) {
+    fprintf(stderr, "Usage: %s [wakeups [gap_us]]\n", argv[0]);
+    return 1;
+  }
+
+  fam = new FileAlterationMonitor();
+  if (! fam->interruptible()) {
+    fprintf(stderr, "Monitor cannot be interrupted\n");
+    return 1;
+  }
+
+  std::vector<double> latency_us;
+  latency_us.reserve(num_wakeups);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, interrupter, NULL) != 0) {
+    perror("pthread_create");
+    return 1;
+  }
+  for (unsigned int i = 0; i < num_wakeups; ++i) {
+    fam->process_events(-1);
+    long long returned = now_ns();
+
+    pthread_mutex_lock(&mutex);
+    latency_us.push_back((returned - interrupt_ns) / 1000.);
+    ++num_returned;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+  pthread_join(thread, NULL);
+  delete fam;
+
+  std::sort(latency_us.begin(), latency_us.end());
+  printf("%u wakeups, %u us apart\n", num_wakeups, gap_us);
+  printf("median %8.1f us\n", latency_us[latency_us.size() / 2]);
+  printf("p99    %8.1f us\n", latency_us[(latency_us.size() * 99) / 100]);
+  printf("max    %8.1f us\n", latency_us.back());
+  return 0;
+}
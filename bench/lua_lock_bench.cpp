@@ -0,0 +1,150 @@
+
+/***************************************************************************
+ *  lua_lock_bench.cpp - Benchmark the cost of locking a Lua context
+ *
+ *  Created: Sat Oct 17 15:42:08 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Measures what locking costs per call, uncontended and with several
+ * threads contending. The recursive Mutex used as the context lock is
+ * compared to a plain recursive pthread mutex, and the cost of a cheap
+ * LuaContext method, which locks the context, is
+ * reported alongside. Times are in nanoseconds per call.
+ *
+ * Usage: lua_lock_bench [calls [max_threads]]
+ * Defaults are 1000000 calls per thread and up to 4 threads.
+ */
+
+#include <lua_utils/context.h>
+#include <lua_utils/mutex.h>
+
+#include <pthread.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace fawkes;
+
+static unsigned long num_calls;
+static Mutex          mutex(Mutex::RECURSIVE);
+static pthread_mutex_t pmutex;
+static LuaContext    *context;
+static volatile unsigned long counter;
+
+static double
+now_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000. + ts.tv_nsec;
+}
+
+static void *
+mutex_worker(void *arg)
+{
+  for (unsigned long i = 0; i < num_calls; ++i) {
+    MutexLocker lock(&mutex);
+    ++counter;
+  }
+  return NULL;
+}
+
+static void *
+pthread_worker(void *arg)
+{
+  for (unsigned long i = 0; i < num_calls; ++i) {
+    pthread_mutex_lock(&pmutex);
+    ++counter;
+    pthread_mutex_unlock(&pmutex);
+  }
+  return NULL;
+}
+
+static void *
+context_worker(void *arg)
+{
+  for (unsigned long i = 0; i < num_calls; ++i) {
+    counter += context->stack_size();
+  }
+  return NULL;
+}
+
+/* Run worker in num_threads threads, return ns per call. */
+static double
+run(void *(*worker)(void *), unsigned int num_threads)
+{
+  std::vector<pthread_t> threads(num_threads);
+  counter = 0;
+  double start = now_ns();
+  if (num_threads == 1) {
+    worker(NULL);
+  } else {
+    for (unsigned int t = 0; t < num_threads; ++t) {
+      if (pthread_create(&threads[t], NULL, worker, NULL) != 0) {
+	perror("pthread_create");
+	exit(1);
+      }
+    }
+    for (unsigned int t = 0; t < num_threads; ++t)  pthread_join(threads[t], NULL);
+  }
+  return (now_ns() - start) / ((double)num_calls * num_threads);
+}
+
+int
+main(int argc, char **argv)
+{
+  num_calls = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+  unsigned int max_threads = (argc > 2) ? atoi(argv[2]) : 4;
+  if ((num_calls == 0) || (max_threads == 0)) {
+    fprintf(stderr, "Usage: %s [calls [max_threads]]\n", argv[0]);
+    return 1;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&pmutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  context = new LuaContext(/* watch dirs */ false);
+
+  printf("%lu calls per thread, ns per call\n", num_calls);
+  printf("%-8s %12s %12s %12s\n", "threads", "Mutex", "pthread", "LuaContext");
+  for (unsigned int t = 1; t <= max_threads; t *= 2) {
+    double m = run(mutex_worker, t);
+    double p = run(pthread_worker, t);
+    double c = run(context_worker, t);
+    printf("%-8u %12.1f %12.1f %12.1f\n", t, m, p, c);
+  }
+
+  // the same thread locking again, as in calls within a LuaContextLocker
+  double start = now_ns();
+  for (unsigned long i = 0; i < num_calls; ++i) {
+    mutex.lock();
+    mutex.lock();
+    ++counter;
+    mutex.unlock();
+    mutex.unlock();
+  }
+  printf("nested Mutex lock: %.1f ns per pair\n", (now_ns() - start) / num_calls);
+
+  delete context;
+  pthread_mutex_destroy(&pmutex);
+  return 0;
+}
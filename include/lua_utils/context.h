@@ -26,18 +26,25 @@
 
 #ifndef USE_ROS
 #  include <lua/exceptions.h>
+#  include <lua/data_loader.h>
 #  include <core/utils/lock_list.h>
 #  include <utils/system/fam.h>
+#  include <utils/misc/histogram.h>
 #else
 #  include <lua_utils/exceptions.h>
+#  include <lua_utils/data_loader.h>
 #  include <lua_utils/fam.h>
+#  include <lua_utils/histogram.h>
 #endif
 
 #include <lua.hpp>
 
+#include <pthread.h>
 #include <map>
 #include <utility>
 #include <list>
+#include <set>
+#include <vector>
 #include <string>
 
 namespace fawkes {
@@ -46,9 +53,48 @@ namespace fawkes {
 #endif
 
 class LuaContextWatcher;
-#ifndef USE_ROS
 class Mutex;
-#endif
+
+/** Result of the benchmark run before swapping in a restarted state.
+ * Latencies are medians over all runs. Figures of the old state are 0 if
+ * it does not provide the benchmark entry point.
+ */
+typedef struct {
+  unsigned int  runs;			///< number of runs per state
+  double        old_latency_us;		///< latency of the old state in microseconds
+  double        new_latency_us;		///< latency of the new state in microseconds
+  double        old_memory_kb;		///< memory in use by the old state in KB
+  double        new_memory_kb;		///< memory in use by the new state in KB
+  bool          accepted;		///< true if the new state has been swapped in
+} LuaBenchmarkResult;
+
+/** Lock statistics of a call site.
+ * A call site is the LuaContext method which took the context lock, or
+ * "lock" for LuaContext::lock() and LuaContextLocker.
+ */
+typedef struct {
+  const char          *site;		///< name of the call site
+  unsigned long        num_acquired;	///< number of acquisitions
+  unsigned long        num_contended;	///< acquisitions which had to wait
+  unsigned long long   wait_us;		///< total time spent waiting in microseconds
+  unsigned long long   hold_us;		///< total time the lock was held in microseconds
+  unsigned long        max_hold_us;	///< longest time the lock was held in microseconds
+} LuaLockSite;
+
+/** Snapshot of context lock statistics.
+ * Only the outermost acquisition of a thread is counted, nested locking
+ * by a thread already holding the lock is part of the outer hold time.
+ */
+typedef struct {
+  double          seconds;		///< time since the statistics were reset
+  unsigned long   num_acquired;		///< number of acquisitions
+  unsigned long   num_contended;	///< acquisitions which had to wait
+  Log2Histogram   wait_us;		///< time spent waiting per acquisition in microseconds
+  Log2Histogram   hold_us;		///< time the lock was held per acquisition in microseconds
+  const char     *holder;		///< call site holding the lock now, NULL if free or unknown
+  unsigned long   holder_us;		///< time the current holder has held the lock in microseconds
+  std::vector<LuaLockSite>  sites;	///< call sites, longest total hold time first
+} LuaLockStats;
 
 class LuaContext : public FamListener
 {
@@ -60,20 +106,29 @@ class LuaContext : public FamListener
   void set_start_script(const char *start_script);
 
   void restart();
+  void set_restart_benchmark(const char *entry_point, unsigned int runs = 5,
+			     double max_latency_ratio = 1.5,
+			     double max_memory_ratio = 2.0);
 
   void add_package_dir(const char *path);
   void add_cpackage_dir(const char *path);
   void add_package(const char *package);
   void add_watchdir(const char *path);
   void add_watchfile(const char *path);
+  void set_watch_loaded_files(bool enabled);
+  std::set<std::string> loaded_files();
+  void add_data_source(const char *path, const char *target);
+  void remove_data_source(const char *path);
 
   lua_State *  get_lua_state();
 
-#ifndef USE_ROS
   void lock();
   bool try_lock();
   void unlock();
-#endif
+
+  void set_lock_stats(bool enabled);
+  LuaLockStats lock_stats(unsigned int max_sites = 10);
+  void reset_lock_stats();
 
   void do_file(const char *filename);
   void do_string(const char *format, ...);
@@ -145,23 +200,122 @@ class LuaContext : public FamListener
 
   /* from FamListener */
   virtual void fam_event(const char *filename, unsigned int mask);
+  virtual void fam_events(const FamEvent *events, unsigned int num_events);
   void process_fam_events();
+  int  fam_fd() const;
+  int  fam_timeout();
+  void set_fam_reader_thread(bool enabled);
 
 
  private:
-  lua_State *  init_state();
+  /// @cond INTERNALS
+  typedef struct {
+    unsigned long                   generation;
+    std::list<std::string>          package_dirs;
+    std::list<std::string>          cpackage_dirs;
+    std::list<std::string>          packages;
+    std::map<std::string, std::pair<void *, std::string> > usertypes;
+    std::map<std::string, std::string>    strings;
+    std::map<std::string, bool>           booleans;
+    std::map<std::string, lua_Number>     numbers;
+    std::map<std::string, lua_Integer>    integers;
+    std::map<std::string, lua_CFunction>  cfunctions;
+    std::map<std::string, std::string>    data_sources;
+    std::string                     start_script;
+    std::list<LuaContextWatcher *>  watchers;
+    std::string                     benchmark_entry;
+    unsigned int                    benchmark_runs;
+    double                          benchmark_max_latency_ratio;
+    double                          benchmark_max_memory_ratio;
+  } StateConfig;
+  /// @endcond
+
+  /// @cond INTERNALS
+  class ConfigLocker
+  {
+   public:
+    ConfigLocker(LuaContext *context);
+    ~ConfigLocker();
+
+   private:
+    LuaContext *__context;
+  };
+  /// @endcond
+
+  void         init_config();
+  void         snapshot_config(StateConfig &config);
+  lua_State *  init_state(const StateConfig &config);
+  void         replay_config(lua_State *L, const StateConfig &config);
+  void         run_start_script(lua_State *L, const char *start_script);
+  void         restart_once();
   void         do_string(lua_State *L, const char *format, ...);
   void         do_file(lua_State *L, const char *s);
   void         assert_unique_name(const char *name, std::string type);
+  void         file_loaded(lua_State *L, const char *filename);
+  void         watch_loaded_files();
+  static std::set<std::string> loaded_files(lua_State *L);
+  static int   lua_loader(lua_State *L);
+  static int   find_module(lua_State *L, const char *name);
+
+  /// @cond INTERNALS
+  typedef struct {
+    int          id;
+    std::string  path;
+    bool         is_dir;
+  } ScriptWatch;
+  /// @endcond
+
+  int          add_script_watch(lua_State *L, const char *path);
+  void         sync_script_watches();
+  bool         dispatch_script_events(const FamEvent *events, unsigned int num_events);
+  void         call_script_watch(int id, const FamEvent *events,
+				 const std::vector<unsigned int> &indexes);
+  static std::vector<ScriptWatch> script_watches(lua_State *L);
+  static int   lua_fam_watch(lua_State *L);
+  static int   lua_fam_unwatch(lua_State *L);
+
+  void         load_data(lua_State *L, const char *path, const char *target);
+  void         set_data(lua_State *L, const char *target, lua_State *data_L);
+  void         apply_data_sources();
+  void         apply_source_checks();
+  void         restart_checked();
+  bool         benchmark_restart(lua_State *L, const StateConfig &config);
+  bool         benchmark_run(lua_State *L, const std::string &entry_point,
+			     double &usec, std::string &errmsg);
+
+  /// @cond INTERNALS
+  class ContextLocker
+  {
+   public:
+    ContextLocker(LuaContext *context, const char *site);
+    ~ContextLocker();
+
+   private:
+    LuaContext *__context;
+  };
+  /// @endcond
+
+  void         init_lock_stats();
+  void         lock_context(const char *site);
+  bool         try_lock_context(const char *site);
+  void         lock_acquired(const char *site, bool contended, long long wait_start_us);
+  void         unlock_context();
 
  private:
   lua_State *__L;
   bool       __owns_L;
   bool       __enable_tracebacks;
 
-#ifndef USE_ROS
   Mutex  *__lua_mutex;
-#endif
+
+  volatile bool    __lock_stats_enabled;
+  pthread_mutex_t  __lock_stats_mutex;
+  unsigned int     __lock_depth;
+  const char      *__lock_holder;
+  long long        __lock_hold_start_us;
+  long long        __lock_stats_start_us;
+  LuaLockStats     __lock_stats;
+  std::map<const char *, LuaLockSite>  __lock_sites;
   char   *__start_script;
 
   std::list<std::string>            __package_dirs;
@@ -183,6 +337,27 @@ class LuaContext : public FamListener
   std::map<std::string, lua_CFunction>::iterator __cfunctions_it;
 
   FileAlterationMonitor  *__fam;
+  FamPathFilter           __restart_filter;
+  bool                    __watch_loaded_files;
+  std::set<std::string>   __loaded_files;
+  std::map<std::string, bool>  __script_watch_paths;
+  int                          __script_watch_id;
+  std::map<std::string, std::string>           __data_sources;
+  std::map<std::string, std::string>::iterator __data_sources_it;
+  LuaDataLoader                               *__loader;
+  std::map<std::string, std::string>           __broken_sources;
+  bool                                         __restart_pending;
+
+  pthread_mutex_t         __config_mutex;
+  unsigned long           __config_generation;
+  pthread_mutex_t         __restart_mutex;
+  bool                    __restarting;
+  bool                    __restart_again;
+
+  std::string   __benchmark_entry;
+  unsigned int  __benchmark_runs;
+  double        __benchmark_max_latency_ratio;
+  double        __benchmark_max_memory_ratio;
 
 #ifndef USE_ROS
   LockList<LuaContextWatcher *> __watchers;
@@ -192,6 +367,17 @@ class LuaContext : public FamListener
 
 };
 
+
+class LuaContextLocker
+{
+ public:
+  LuaContextLocker(LuaContext *context);
+  ~LuaContextLocker();
+
+ private:
+  LuaContext *__context;
+};
+
 } // end of namespace fawkes
 
 #endif
@@ -43,6 +43,12 @@ class LuaContextWatcher
   virtual void lua_init(LuaContext *context) = 0;
   virtual void lua_finalize(LuaContext *context) = 0;
   virtual void lua_restarted(LuaContext *context) = 0;
+  virtual void lua_data_reloaded(LuaContext *context, const char *path,
+				 const char *target);
+  virtual void lua_syntax_error(LuaContext *context, const char *path,
+				const char *errmsg);
+  virtual void lua_restart_benchmarked(LuaContext *context,
+				       const LuaBenchmarkResult &result);
 };
 
 
@@ -0,0 +1,93 @@
+
+/***************************************************************************
+ *  data_loader.h - Background loader for Lua data and source files
+ *
+ *  Created: Sat Oct 17 22:10:42 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __LUA_DATA_LOADER_H_
+#define __LUA_DATA_LOADER_H_
+
+#include <lua.hpp>
+
+#include <pthread.h>
+#include <list>
+#include <string>
+
+namespace fawkes {
+#if 0 /* just to make Emacs auto-indent happy */
+}
+#endif
+
+class FileAlterationMonitor;
+
+class LuaDataLoader
+{
+ public:
+  LuaDataLoader(FileAlterationMonitor *fam);
+  ~LuaDataLoader();
+
+  void load(const char *path);
+  bool fetch(std::string &path, lua_State *&L, std::string &errmsg);
+
+  void check(const char *path);
+  bool fetch_check(std::string &path, std::string &errmsg);
+  bool checks_pending();
+
+  static lua_State * load_file(const char *path, std::string &errmsg);
+  static bool        check_file(const char *path, std::string &errmsg);
+  static void        copy_value(lua_State *from, int idx, lua_State *to);
+
+  /** Maximum nesting depth of tables in data files. */
+  static const unsigned int MAX_DEPTH = 64;
+
+ private:
+  /// @cond INTERNALS
+  typedef struct {
+    std::string  path;
+    bool         check;
+  } Job;
+
+  typedef struct {
+    std::string  path;
+    lua_State   *L;
+    std::string  errmsg;
+  } Result;
+  /// @endcond
+
+  void          queue(const char *path, bool check);
+  static void * loader_thread(void *arg);
+  static bool   is_plain_data(lua_State *L, int idx, unsigned int depth);
+
+ private:
+  FileAlterationMonitor  *__fam;
+
+  pthread_t               __loader;
+  bool                    __running;
+  bool                    __quit;
+  pthread_mutex_t         __mutex;
+  pthread_cond_t          __cond;
+  std::list<Job>          __queue;
+  std::list<Result>       __results;
+  std::list<Result>       __checks;
+  unsigned int            __num_checks;
+};
+
+} // end of namespace fawkes
+
+#endif
@@ -23,14 +23,41 @@
 #ifndef __UTILS_SYSTEM_FAM_H_
 #define __UTILS_SYSTEM_FAM_H_
 
+#include <lua_utils/fam_filter.h>
+#include <lua_utils/fam_stats.h>
+
 #include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <map>
 #include <list>
+#include <set>
+#include <vector>
+#include <deque>
 #include <string>
-#include <regex.h>
+
+struct inotify_event;
 
 namespace fawkes {
 
+class FamReactor;
+class FamPoller;
+class FamEventRing;
+class FamEventRecorder;
+class FamEventPlayer;
+
+/** File alteration event record.
+ * The path and name are only valid for the duration of the listener
+ * call, the watch path as long as the monitor exists.
+ */
+typedef struct {
+  const char   *watch_path;	///< path of the watched directory
+  const char   *name;		///< file name, empty for events on the watch itself
+  const char   *path;		///< full path of the file
+  unsigned int  dir_id;		///< id of the watch path, see FileAlterationMonitor::dir_path()
+  unsigned int  mask;		///< inotify event mask
+} FamEvent;
+
 class FamListener
 {
  public:
@@ -55,6 +82,8 @@ class FamListener
   static const unsigned int FAM_Q_OVERFLOW;
   static const unsigned int FAM_IGNORED;
 
+  static const unsigned int FAM_CONTENT_CHANGED;
+
   static const unsigned int FAM_ONLYDIR;
   static const unsigned int FAM_DONT_FOLLOW;
   static const unsigned int FAM_MASK_ADD;
@@ -65,39 +94,214 @@ class FamListener
 
 
   virtual void fam_event(const char *filename, unsigned int mask) = 0;
+  virtual void fam_events(const FamEvent *events, unsigned int num_events);
 };
 
 class FileAlterationMonitor
 {
  public:
+  /** Backend used to detect changes of a watched path. */
+  typedef enum {
+    BACKEND_AUTO,	///< poll on network and overlay file systems, inotify otherwise
+    BACKEND_INOTIFY,	///< kernel notifications through inotify
+    BACKEND_POLL	///< periodically stat files, see FamPoller
+  } Backend;
+
   FileAlterationMonitor();
   ~FileAlterationMonitor();
 
   void watch_dir(const char *dirpath);
+  void watch_dir(const char *dirpath, Backend backend);
   void watch_file(const char *filepath);
+  void watch_file(const char *filepath, Backend backend);
+  void watch_files(const std::set<std::string> &filepaths);
+  void unwatch_dir(const char *dirpath);
+  void unwatch_file(const char *filepath);
   void add_filter(const char *regex);
+  void add_include_filter(const char *pattern);
+  void add_exclude_filter(const char *pattern);
+
+  void set_quiet_period(unsigned int quiet_period_ms);
+  void set_content_hashing(bool enabled);
+  void set_backend(Backend backend);
+  void set_poll_interval(unsigned int interval_ms, unsigned int budget_us = 2000);
 
   void process_events(int timeout = 0);
   void interrupt();
+  bool interruptible() const;
+
+  int  fd() const;
+  void dispatch_events();
+  int  next_timeout();
+
+  void start_reader_thread(unsigned int queue_capacity = 4096);
+  void stop_reader_thread();
+  bool reader_thread_running() const;
+  unsigned int  queue_depth() const;
+  unsigned int  max_queue_depth() const;
+  unsigned long num_dropped() const;
+  unsigned int  dispatch_lag_us() const;
+  unsigned int  max_dispatch_lag_us() const;
+
+  void start_recording(const char *filename);
+  void stop_recording();
+  void replay(const char *filename, double speed = 1.0);
+  bool replaying() const;
 
   void add_listener(FamListener *listener);
+  void add_listener(FamListener *listener, unsigned int mask,
+		    const FamPathFilter *filter = NULL);
   void remove_listener(FamListener *listener);
 
+  const char * dir_path(unsigned int dir_id) const;
+
+  unsigned int num_overflows() const;
+  unsigned int num_rescans() const;
+  FamStats     stats() const;
+  void         reset_stats();
+
  private:
-  std::list<FamListener *>            __listeners;
-  std::list<FamListener *>::iterator  __lit;
-  std::list<regex_t *>                __regexes;
-  std::list<regex_t *>::iterator      __rxit;
-
-  int     __inotify_fd;
-  char   *__inotify_buf;
-  size_t  __inotify_bufsize;
-  std::map<int, std::string> __inotify_watches;
-  std::map<int, std::string>::iterator __inotify_wit;
-
-  bool __interrupted;
-  bool __interruptible;
-  int  __pipe_fds[2];
+  /// @cond INTERNALS
+  typedef struct {
+    int                    wd;
+    std::string            path;
+    size_t                 rootlen;
+    unsigned int           dir_id;
+    bool                   recursive;
+    std::set<std::string>  names;
+    std::set<std::string>  file_names;
+    std::set<std::string>  files;
+  } WatchInfo;
+
+  typedef struct {
+    unsigned int  dir_id;
+    bool          existed;
+    bool          exists;
+    long long     last_ms;
+  } PendingEvent;
+
+  typedef struct {
+    off_t     size;
+    time_t    mtime_sec;
+    long      mtime_nsec;
+    uint64_t  hash;
+  } Fingerprint;
+
+  typedef struct {
+    unsigned int  refs;
+    bool          polled;
+  } TreeRoot;
+
+  typedef struct {
+    FamListener            *listener;
+    unsigned int            mask;
+    FamPathFilter           filter;
+    bool                    routed;
+    std::vector<FamEvent>   events;
+  } ListenerInfo;
+  /// @endcond
+
+  friend class FamReactor;
+  friend class FamPoller;
+  friend class FamEventPlayer;
+  void queue_event(const struct inotify_event *event);
+  bool has_queued_events();
+  void wakeup();
+  bool consume_interrupt();
+
+  static void * reader_thread(void *arg);
+  void read_loop();
+  void drain_ring();
+
+  Backend select_backend(const char *path, Backend backend);
+  void watch_tree(const char *dirpath, size_t rootlen, bool synthesize);
+  WatchInfo * watch_parent(const std::string &dirpath);
+  WatchInfo * find_watch(int wd);
+  WatchInfo & insert_watch(int wd);
+  void drop_watch(WatchInfo &info, bool rm_watch);
+  void unwatch_tree(const std::string &dirpath, bool keep_names);
+  size_t tree_root_length(const std::string &path) const;
+  bool process_queue();
+  unsigned int intern_dir(const std::string &path);
+  void post_event(unsigned int dir_id, const char *name, unsigned int mask);
+  void account_event(unsigned int dir_id, const char *name, unsigned int mask);
+  void replay_event(const std::string &dirpath, size_t rootlen,
+		    const char *name, unsigned int mask);
+  size_t root_length(const char *path) const;
+  void resync();
+  void batch_event(unsigned int dir_id, const char *name, unsigned int mask);
+  bool dispatch_batch();
+  bool route_event(const ListenerInfo &li, size_t b);
+  void coalesce_event(unsigned int dir_id, const char *name, unsigned int mask);
+  void flush_coalesced(bool force);
+  int  coalesce_wait();
+  const char * relative_path(const WatchInfo &info, const char *name);
+  static bool  name_watched(const WatchInfo &info, const char *name);
+  static bool  file_watched(const WatchInfo &info, const char *name);
+  void fingerprint_dir(const WatchInfo &info);
+  bool content_changed(const std::string &path, unsigned int mask);
+
+ private:
+  std::list<ListenerInfo>             __listeners;
+  std::list<ListenerInfo>::iterator   __lit;
+  std::vector<std::string>            __roots;
+  std::map<std::string, TreeRoot>     __tree_roots;
+  std::deque<std::string>             __dir_paths;
+  std::map<std::string, unsigned int> __dir_ids;
+  FamPathFilter                       __filter;
+  std::string                         __relpath;
+
+  FamReactor *__reactor;
+  std::vector<WatchInfo>  __inotify_watches;
+  std::map<int, unsigned int> __watch_slots;
+  std::vector<unsigned int>   __free_watch_slots;
+  unsigned int            __num_inotify_watches;
+  unsigned int            __watch_mask;
+
+  Backend    __backend;
+  FamPoller *__poller;
+
+  FamEventRecorder *__recorder;
+  FamEventPlayer   *__player;
+
+  FamStats   __stats;
+  long long  __stats_start_us;
+
+  pthread_mutex_t    __queue_mutex;
+  std::vector<char>  __queue;
+  std::vector<char>  __queue_proc;
+
+  std::vector<FamEvent>  __batch;
+  std::vector<size_t>    __batch_offsets;
+  std::string            __batch_strings;
+  std::vector<size_t>    __batch_rootlens;
+
+  unsigned int                         __quiet_period_ms;
+  std::map<std::string, PendingEvent>  __pending;
+  std::string                          __coalesce_key;
+
+  bool                                 __content_hashing;
+  std::map<std::string, Fingerprint>   __fingerprints;
+  std::string                          __fingerprint_path;
+
+  unsigned int  __num_overflows;
+  unsigned int  __num_rescans;
+  time_t        __last_sync;
+
+  volatile int  __interrupted;
+  bool          __interruptible;
+  int           __wakeup_fd;
+  int  __epoll_fd;
+
+  FamEventRing  *__ring;
+  pthread_t      __reader;
+  volatile bool  __reader_running;
+  int            __reader_wakeup_fd;
+  unsigned long  __dropped_seen;
+  unsigned long  __dropped_total;
+  long long      __lag_sum_us;
+  unsigned long  __lag_count;
+  long long      __lag_max_us;
 };
 
 } // end of namespace fawkes
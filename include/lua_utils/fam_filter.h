@@ -0,0 +1,87 @@
+
+/***************************************************************************
+ *  fam_filter.h - Compiled path filter for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 13:40:05 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_FILTER_H_
+#define __UTILS_SYSTEM_FAM_FILTER_H_
+
+#include <vector>
+#include <string>
+#include <regex.h>
+
+namespace fawkes {
+
+class FamPathFilter
+{
+ public:
+  FamPathFilter();
+  FamPathFilter(const FamPathFilter &other);
+  ~FamPathFilter();
+
+  FamPathFilter & operator=(const FamPathFilter &other);
+
+  void add_required_regex(const char *regex);
+  void add_include(const char *pattern, bool is_regex = false);
+  void add_exclude(const char *pattern, bool is_regex = false);
+  void clear();
+
+  bool empty() const;
+  bool needs_path() const;
+  bool matches(const char *name, const char *relpath) const;
+
+ private:
+  /// @cond INTERNALS
+  typedef enum {
+    EXACT,
+    PREFIX,
+    SUFFIX,
+    GLOB,
+    REGEX
+  } RuleKind;
+
+  typedef struct {
+    RuleKind      kind;
+    bool          on_path;
+    bool          no_hidden;
+    std::string   pattern;
+    regex_t      *regex;
+  } Rule;
+  /// @endcond
+
+  static Rule compile_glob(const char *pattern);
+  static Rule compile_regex(const char *regex);
+  static bool match_rule(const Rule &rule, const char *name, const char *relpath);
+  static bool match_any(const std::vector<Rule> &rules,
+			const char *name, const char *relpath);
+  static void insert_sorted(std::vector<Rule> &rules, const Rule &rule);
+  static void free_rules(std::vector<Rule> &rules);
+  static void copy_rules(std::vector<Rule> &to, const std::vector<Rule> &from);
+
+ private:
+  std::vector<Rule>  __required;
+  std::vector<Rule>  __includes;
+  std::vector<Rule>  __excludes;
+  bool               __needs_path;
+};
+
+} // end of namespace fawkes
+
+#endif
@@ -0,0 +1,104 @@
+
+/***************************************************************************
+ *  fam_poller.h - Stat polling backend for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 16:05:48 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_POLLER_H_
+#define __UTILS_SYSTEM_FAM_POLLER_H_
+
+#include <sys/types.h>
+#include <ctime>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+namespace fawkes {
+
+class FileAlterationMonitor;
+class FamPathFilter;
+
+class FamPoller
+{
+ public:
+  FamPoller(FileAlterationMonitor *client, const FamPathFilter &filter);
+
+  void add_dir(const char *dirpath, size_t rootlen);
+  void add_file(const char *filepath);
+  bool remove_dir(const char *dirpath);
+  bool remove_file(const char *filepath);
+
+  void set_interval(unsigned int interval_ms);
+  void set_budget(unsigned int budget_us);
+
+  bool empty() const;
+  unsigned int num_dirs() const;
+  unsigned int num_entries() const;
+
+  int  wait_time() const;
+  bool poll();
+
+ private:
+  /// @cond INTERNALS
+  typedef struct {
+    off_t   size;
+    time_t  mtime_sec;
+    long    mtime_nsec;
+  } Entry;
+
+  typedef struct {
+    std::string                   path;
+    size_t                        rootlen;
+    bool                          is_dir;
+    bool                          is_root;
+    bool                          exists;
+    time_t                        mtime_sec;
+    long                          mtime_nsec;
+    Entry                         self;
+    std::map<std::string, Entry>  files;
+    std::set<std::string>         subdirs;
+  } Node;
+  /// @endcond
+
+  void index_tree(const std::string &dirpath, size_t rootlen, bool is_root, bool post);
+  bool scan_dir(size_t n, bool post);
+  void scan_file(size_t n);
+  void remove_tree(const std::string &dirpath, bool post);
+  bool passes(const Node &node, const char *name);
+  void post(const std::string &watch_path, const char *name, unsigned int mask);
+
+ private:
+  FileAlterationMonitor *__client;
+  const FamPathFilter   &__filter;
+  std::string            __relpath;
+
+  std::vector<Node>  __nodes;
+  size_t             __next;
+  bool               __in_round;
+  long long          __round_due_ms;
+  bool               __posted;
+
+  unsigned int       __interval_ms;
+  unsigned int       __budget_us;
+};
+
+} // end of namespace fawkes
+
+#endif
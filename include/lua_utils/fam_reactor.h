@@ -0,0 +1,92 @@
+
+/***************************************************************************
+ *  fam_reactor.h - Process-wide inotify reactor for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 10:12:31 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_REACTOR_H_
+#define __UTILS_SYSTEM_FAM_REACTOR_H_
+
+#include <lua_utils/fam_stats.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <list>
+
+namespace fawkes {
+
+class FileAlterationMonitor;
+
+class FamReactor
+{
+ public:
+  static FamReactor * instance();
+  static void         release();
+
+  int  add_watch(const char *path, uint32_t mask, FileAlterationMonitor *client);
+  void rm_watch(int wd, FileAlterationMonitor *client);
+  void remove_client(FileAlterationMonitor *client);
+
+  int  fd() const;
+  void read_events(FileAlterationMonitor *reader);
+
+  unsigned int num_watches();
+  unsigned int num_overflows();
+  size_t       read_buffer_size();
+  unsigned int pending_bytes();
+  void         read_stats(Log2Histogram &read_bytes, unsigned int &max_pending);
+  void         reset_read_stats();
+
+  /** Maximum size of the read buffer in bytes. */
+  static const size_t MAX_BUFSIZE = 1024 * 1024;
+
+ private:
+  FamReactor();
+  ~FamReactor();
+
+  /// @cond INTERNALS
+  typedef struct {
+    uint32_t                           mask;
+    std::list<FileAlterationMonitor *> clients;
+  } Watch;
+  /// @endcond
+
+ private:
+  static FamReactor      *__instance;
+  static unsigned int     __refcount;
+  static pthread_mutex_t  __instance_mutex;
+
+  pthread_mutex_t  __mutex;
+
+  int     __inotify_fd;
+  char   *__inotify_buf;
+  size_t  __inotify_bufsize;
+
+  unsigned int __num_overflows;
+  Log2Histogram __read_bytes;
+  unsigned int __max_pending;
+
+  std::map<int, Watch>            __watches;
+  std::map<int, Watch>::iterator  __wit;
+};
+
+} // end of namespace fawkes
+
+#endif
@@ -0,0 +1,101 @@
+
+/***************************************************************************
+ *  fam_record.h - Record and replay of FileAlterationMonitor event streams
+ *
+ *  Created: Sat Oct 17 19:22:14 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_RECORD_H_
+#define __UTILS_SYSTEM_FAM_RECORD_H_
+
+#include <sys/types.h>
+#include <cstdio>
+#include <vector>
+#include <string>
+
+namespace fawkes {
+
+class FileAlterationMonitor;
+
+class FamEventRecorder
+{
+ public:
+  FamEventRecorder(const char *filename);
+  ~FamEventRecorder();
+
+  bool knows_dir(unsigned int dir_id) const;
+  void record_dir(unsigned int dir_id, const std::string &path, size_t rootlen);
+  void record(unsigned int dir_id, const char *name, unsigned int mask);
+
+  unsigned long num_events() const;
+
+ private:
+  void write_varint(unsigned long long value);
+
+ private:
+  FILE               *__file;
+  long long           __last_us;
+  std::vector<bool>   __dirs;
+  unsigned long       __num_events;
+};
+
+
+class FamEventPlayer
+{
+ public:
+  FamEventPlayer(FileAlterationMonitor *client, const char *filename, double speed);
+  ~FamEventPlayer();
+
+  bool finished() const;
+  int  wait_time() const;
+  bool play();
+
+  unsigned long num_events() const;
+
+  /** Maximum number of events posted by a single call to play(). */
+  static const unsigned int MAX_EVENTS_PER_CALL = 1024;
+  /** Maximum number of directories in a recording, a larger directory
+   * id is taken as a sign of a corrupt file. */
+  static const unsigned int MAX_DIRS = 1048576;
+
+ private:
+  bool read_varint(unsigned long long &value);
+  bool read_next();
+  bool corrupt(const char *what);
+
+ private:
+  FileAlterationMonitor *__client;
+  FILE                  *__file;
+  double                 __speed;
+  long long              __start_us;
+
+  std::vector<std::string>  __dir_paths;
+  std::vector<size_t>       __dir_rootlens;
+  std::vector<bool>         __dir_defined;
+
+  bool                   __have_next;
+  long long              __next_us;
+  unsigned int           __next_dir;
+  unsigned int           __next_mask;
+  std::string            __next_name;
+  unsigned long          __num_events;
+};
+
+} // end of namespace fawkes
+
+#endif
@@ -0,0 +1,60 @@
+
+/***************************************************************************
+ *  fam_ring.h - Bounded event queue for the FileAlterationMonitor reader
+ *
+ *  Created: Sat Oct 17 18:22:10 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_RING_H_
+#define __UTILS_SYSTEM_FAM_RING_H_
+
+#include <sys/types.h>
+
+struct inotify_event;
+
+namespace fawkes {
+
+class FamEventRing
+{
+ public:
+  FamEventRing(size_t capacity);
+  ~FamEventRing();
+
+  bool push(const struct inotify_event *event, long long stamp_us);
+  const struct inotify_event * front(long long *stamp_us);
+  void pop();
+
+  size_t size() const;
+  size_t capacity() const;
+  size_t max_size() const;
+  unsigned long num_dropped() const;
+
+ private:
+  char                   *__slots;
+  long long              *__stamps;
+  size_t                  __slot_size;
+  size_t                  __capacity;
+  volatile size_t         __head;
+  volatile size_t         __tail;
+  size_t                  __max_size;
+  volatile unsigned long  __dropped;
+};
+
+} // end of namespace fawkes
+
+#endif
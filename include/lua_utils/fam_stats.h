@@ -0,0 +1,72 @@
+
+/***************************************************************************
+ *  fam_stats.h - Statistics of FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 20:48:37 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_SYSTEM_FAM_STATS_H_
+#define __UTILS_SYSTEM_FAM_STATS_H_
+
+#include <lua_utils/histogram.h>
+
+namespace fawkes {
+
+/** Snapshot of monitor statistics.
+ * Event counters cover the time since the statistics were last reset,
+ * divide them by seconds to get rates. Figures marked as process-wide
+ * are shared by all monitors of the process since they use the same
+ * inotify instance. Limits are 0 if they cannot be determined.
+ */
+typedef struct {
+  double          seconds;		///< time since the statistics were reset
+
+  unsigned long   num_read;		///< raw events read, from inotify, polling or replay
+  unsigned long   num_create;		///< create and moved-to events read
+  unsigned long   num_modify;		///< modify events read
+  unsigned long   num_delete;		///< delete and moved-from events read
+  unsigned long   num_self;		///< events on watches themselves read
+  unsigned long   num_overflow;		///< kernel queue overflows read
+  unsigned long   num_other;		///< other events read
+
+  unsigned long   num_filtered;		///< events dropped by filters
+  unsigned long   num_posted;		///< events that passed the filters
+  unsigned long   num_delivered;	///< events dispatched to listeners after coalescing and hashing
+  unsigned int    num_pending;		///< events currently held back by coalescing
+
+  Log2Histogram   dispatch_us;		///< time per batch spent in listeners in microseconds
+  Log2Histogram   batch_size;		///< number of events per dispatched batch
+
+  Log2Histogram   read_bytes;		///< bytes per read from inotify, process-wide
+  unsigned int    pending_bytes;	///< bytes currently in the kernel queue, process-wide
+  unsigned int    max_pending_bytes;	///< most bytes seen in the kernel queue before a read, process-wide
+  unsigned int    max_queued_events;	///< kernel queue limit in events
+
+  unsigned int    num_watches;		///< inotify watches of this monitor
+  unsigned int    num_kernel_watches;	///< inotify watches, process-wide
+  unsigned int    max_user_watches;	///< kernel watch limit per user
+  unsigned int    num_polled_dirs;	///< directories watched by polling
+  unsigned int    num_polled_files;	///< files indexed by polling
+
+  unsigned int    queue_depth;		///< events waiting in the reader thread queue
+  unsigned long   num_dropped;		///< events dropped because the reader thread queue was full
+} FamStats;
+
+} // end of namespace fawkes
+
+#endif
@@ -0,0 +1,52 @@
+
+/***************************************************************************
+ *  histogram.h - Histogram with power of two buckets
+ *
+ *  Created: Sat Oct 17 20:48:37 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __UTILS_MISC_HISTOGRAM_H_
+#define __UTILS_MISC_HISTOGRAM_H_
+
+#include <vector>
+
+namespace fawkes {
+
+class Log2Histogram
+{
+ public:
+  Log2Histogram(unsigned int num_buckets = DEFAULT_BUCKETS);
+
+  void add(unsigned long value);
+  void reset();
+  double mean() const;
+  unsigned long percentile(double p) const;
+
+  /** Default number of buckets, values up to about eight million are
+   * told apart. */
+  static const unsigned int DEFAULT_BUCKETS = 24;
+
+  std::vector<unsigned long>  buckets;	///< bucket i > 0 counts values from 2^(i-1) to 2^i - 1, bucket 0 zeros, the last bucket also all larger values
+  unsigned long       count;		///< number of values
+  unsigned long long  sum;		///< sum of all values
+  unsigned long       max;		///< largest value
+};
+
+} // end of namespace fawkes
+
+#endif
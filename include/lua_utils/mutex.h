@@ -0,0 +1,74 @@
+
+/***************************************************************************
+ *  mutex.h - Mutex and scoped locker for builds without Fawkes core
+ *
+ *  Created: Sun Oct 18 10:12:31 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifndef __LUA_MUTEX_H_
+#define __LUA_MUTEX_H_
+
+#include <pthread.h>
+
+namespace fawkes {
+#if 0 /* just to make Emacs auto-indent happy */
+}
+#endif
+
+class Mutex
+{
+ public:
+  /** Mutex type. */
+  typedef enum {
+    NORMAL,	///< a thread locking the mutex again deadlocks
+    RECURSIVE	///< a thread may lock the mutex again
+  } Type;
+
+  Mutex(Type type = NORMAL);
+  ~Mutex();
+
+  void lock();
+  bool try_lock();
+  void unlock();
+
+ private:
+  Mutex(const Mutex &m);
+  Mutex & operator=(const Mutex &m);
+
+ private:
+  pthread_mutex_t  __mutex;
+};
+
+
+class MutexLocker
+{
+ public:
+  MutexLocker(Mutex *mutex, bool initially_lock = true);
+  ~MutexLocker();
+
+  void relock();
+  void unlock();
+
+ private:
+  Mutex *__mutex;
+  bool   __locked;
+};
+
+} // end of namespace fawkes
+
+#endif
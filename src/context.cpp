@@ -24,6 +24,7 @@
 #ifdef USE_ROS
 #  include <lua_utils/context.h>
 #  include <lua_utils/context_watcher.h>
+#  include <lua_utils/mutex.h>
 #else
 #  include <lua/context.h>
 #  include <lua/context_watcher.h>
@@ -35,16 +36,40 @@
 #endif
 
 #include <algorithm>
+#include <iterator>
 #include <tolua++.h>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <ctime>
 
 namespace fawkes {
 #if 0 /* just to make Emacs auto-indent happy */
 }
 #endif
 
+/// @cond INTERNALS
+// the last bucket takes everything from about half a second
+static const unsigned int LOCK_HISTOGRAM_BUCKETS = 21;
+
+static long long
+context_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool
+lock_site_longer(const LuaLockSite &a, const LuaLockSite &b)
+{
+  return a.hold_us > b.hold_us;
+}
+/// @endcond
+
 /** @class LuaContext <lua/context.h>
  * Lua C++ wrapper.
  * This thin wrapper allows for easy integration of Fawkes into other
@@ -57,10 +82,45 @@ namespace fawkes {
  * make sure that you lock the Lua context to avoid multi-threading
  * problems (if that is a possible concern in your application).
  *
+ * Every method locks the context for its own duration, so single calls
+ * are safe from any thread. Stack operations usually only make sense as a
+ * sequence though, other threads may push or pop in between two calls.
+ * Hold a LuaContextLocker for the whole sequence.
+ *
+ * A restart builds the new state without the context lock and swaps it
+ * in while holding the lock, that is between calls and LuaContextLocker
+ * sequences, so no call ever runs on a state that is being closed. The
+ * swap waits for a call in progress to return. Raw access through
+ * get_lua_state() is not covered by this, a state obtained that way may
+ * be closed by a restart once the lock is released.
+ *
  * LuaContext can use a FileAlterationMonitor on all added package and
  * C package directories. If anything changes in these directories the
  * Lua instance is then automatically restarted (closed, re-opened and
- * re-initialized).
+ * re-initialized). Changed Lua files are compiled in a separate thread
+ * first, the restart happens only once all of them compile. Syntax errors
+ * are reported through LuaContextWatcher::lua_syntax_error().
+ *
+ * Scripts can watch files and directories themselves through the same
+ * monitor, for example to reload data files:
+ * @code
+ * local id = fam.watch("/path/to/maps", function (events)
+ *   for _, e in ipairs(events) do print(e.type, e.path) end
+ * end)
+ * fam.unwatch(id)
+ * @endcode
+ * The callback is called from process_fam_events() with all events of a
+ * batch below the watched path, each a table with the fields path, name,
+ * mask and type, the latter being one of "created", "modified" and
+ * "deleted". Changes to paths watched by scripts do not restart the
+ * context. Kernel watches are kept across a restart, so no change is
+ * missed while the new state registers its callbacks again, and paths no
+ * longer registered by the new state are released afterwards.
+ *
+ * Large tables of data kept in files of their own can be added as data
+ * sources with add_data_source(). A change to such a file does not
+ * restart the context, only the file is loaded again in a separate
+ * thread and the result replaces the target value in the running state.
  *
  * @author Tim Niemueller
  */
@@ -77,18 +137,31 @@ LuaContext::LuaContext(bool watch_dirs, bool enable_tracebacks)
   __enable_tracebacks = enable_tracebacks;
 
   if ( watch_dirs ) {
+    // filtered when dispatching, files watched by scripts may be of any type
     __fam = new FileAlterationMonitor();
-    __fam->add_filter("^[^.].*\\.lua$"); 
     __fam->add_listener(this);
+    __loader = new LuaDataLoader(__fam);
   } else {
     __fam = NULL;
+    __loader = NULL;
   }
-#ifndef USE_ROS
-  __lua_mutex = new Mutex();
-#endif
+  __restart_filter.add_required_regex("^[^.].*\\.lua$");
+  __restart_pending = false;
+  __benchmark_runs = 0;
+  __benchmark_max_latency_ratio = 0.;
+  __benchmark_max_memory_ratio = 0.;
+  __watch_loaded_files = false;
+  __script_watch_id = 0;
+  __lua_mutex = new Mutex(Mutex::RECURSIVE);
+  init_lock_stats();
 
   __start_script = NULL;
-  __L = init_state();
+  __L = NULL;
+  init_config();
+  StateConfig config;
+  snapshot_config(config);
+  __L = init_state(config);
+  sync_script_watches();
 }
 
 
@@ -104,20 +177,28 @@ LuaContext::LuaContext(lua_State *L)
 {
   __owns_L = false;
   __L = L;
-#ifndef USE_ROS
-  __lua_mutex = new Mutex();
-#endif
+  __lua_mutex = new Mutex(Mutex::RECURSIVE);
+  init_lock_stats();
   __start_script = NULL;
   __fam = NULL;
+  __watch_loaded_files = false;
+  __script_watch_id = 0;
+  __loader = NULL;
+  __restart_pending = false;
+  __benchmark_runs = 0;
+  __benchmark_max_latency_ratio = 0.;
+  __benchmark_max_memory_ratio = 0.;
+  init_config();
 }
 
 /** Destructor. */
 LuaContext::~LuaContext()
 {
-#ifndef USE_ROS
+  // wait for a restart and calls in progress
+  pthread_mutex_lock(&__restart_mutex);
   __lua_mutex->lock();
-  delete __lua_mutex;
-#endif
+  // interrupts the monitor when finishing a load
+  delete __loader;
   delete __fam;
   if ( __start_script )  free(__start_script);
   if ( __owns_L) {
@@ -138,25 +219,140 @@ LuaContext::~LuaContext()
 #endif
       }
     }
-
-    lua_close(__L);
   }
-#ifndef USE_ROS
+
+  if ( __owns_L)  lua_close(__L);
+  pthread_mutex_destroy(&__lock_stats_mutex);
+  pthread_mutex_destroy(&__config_mutex);
+  pthread_mutex_unlock(&__restart_mutex);
+  pthread_mutex_destroy(&__restart_mutex);
+  __lua_mutex->unlock();
   delete __lua_mutex;
+}
+
+
+/** Initialize configuration.
+ * Sets up the lock which protects the configuration applied to new
+ * states, and the serialization of restarts.
+ */
+void
+LuaContext::init_config()
+{
+  pthread_mutex_init(&__config_mutex, NULL);
+  pthread_mutex_init(&__restart_mutex, NULL);
+  __config_generation = 0;
+  __restarting    = false;
+  __restart_again = false;
+}
+
+
+/** Copy the configuration applied to new states.
+ * Only takes the configuration lock, not the context lock, so that a
+ * restart can initialize a new state while other threads use the
+ * current one.
+ * @param config upon return a copy of the current configuration
+ */
+void
+LuaContext::snapshot_config(StateConfig &config)
+{
+  pthread_mutex_lock(&__config_mutex);
+  config.generation    = __config_generation;
+  config.package_dirs  = __package_dirs;
+  config.cpackage_dirs = __cpackage_dirs;
+  config.packages      = __packages;
+  config.usertypes     = __usertypes;
+  config.strings       = __strings;
+  config.booleans      = __booleans;
+  config.numbers       = __numbers;
+  config.integers      = __integers;
+  config.cfunctions    = __cfunctions;
+  config.data_sources  = __data_sources;
+  config.start_script  = __start_script ? __start_script : "";
+  config.benchmark_entry = __benchmark_entry;
+  config.benchmark_runs  = __benchmark_runs;
+  config.benchmark_max_latency_ratio = __benchmark_max_latency_ratio;
+  config.benchmark_max_memory_ratio  = __benchmark_max_memory_ratio;
+#ifdef USE_ROS
+  config.watchers.assign(__watchers.begin(), __watchers.end());
+#endif
+  pthread_mutex_unlock(&__config_mutex);
+
+#ifndef USE_ROS
+  MutexLocker lock(__watchers.mutex());
+  config.watchers.assign(__watchers.begin(), __watchers.end());
 #endif
 }
 
 
+/// @cond INTERNALS
+/* Locks the configuration for a change for the lifetime of the locker.
+ * Must be taken after the context lock. */
+LuaContext::ConfigLocker::ConfigLocker(LuaContext *context)
+  : __context(context)
+{
+  pthread_mutex_lock(&__context->__config_mutex);
+}
+
+
+LuaContext::ConfigLocker::~ConfigLocker()
+{
+  ++__context->__config_generation;
+  pthread_mutex_unlock(&__context->__config_mutex);
+}
+
+
+/* Find names of a configuration map that have been removed, or added
+ * or changed, between two snapshots. */
+template <typename T>
+static void
+config_diff(const std::map<std::string, T> &before, const std::map<std::string, T> &after,
+	    std::vector<std::string> &removed, std::vector<std::string> &changed)
+{
+  typename std::map<std::string, T>::const_iterator i, j;
+  for (i = before.begin(); i != before.end(); ++i) {
+    if (after.find(i->first) == after.end())  removed.push_back(i->first);
+  }
+  for (j = after.begin(); j != after.end(); ++j) {
+    i = before.find(j->first);
+    if ( (i == before.end()) || ! (i->second == j->second) )  changed.push_back(j->first);
+  }
+}
+/// @endcond
+
+
 /** Initialize Lua state.
- * Initializes the state and makes all necessary initializations.
+ * Initializes the state and makes all necessary initializations. The
+ * context lock is not needed, the state is not shared yet. Paths that
+ * scripts watch while the state is initialized are only watched once it
+ * has been swapped in, see sync_script_watches().
+ * @param config configuration to apply, see snapshot_config()
  * @return fresh initialized Lua state
  */
 lua_State *
-LuaContext::init_state()
+LuaContext::init_state(const StateConfig &config)
 {
   lua_State *L = luaL_newstate();
   luaL_openlibs(L);
 
+  // replace the searcher for Lua modules to record which files are loaded
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "loaders");
+  lua_pushlightuserdata(L, this);
+  lua_pushcclosure(L, LuaContext::lua_loader, 1);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+
+  if (__fam) {
+    lua_createtable(L, 0, 2);
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, LuaContext::lua_fam_watch, 1);
+    lua_setfield(L, -2, "watch");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, LuaContext::lua_fam_unwatch, 1);
+    lua_setfield(L, -2, "unwatch");
+    lua_setglobal(L, "fam");
+  }
+
   if (__enable_tracebacks) {
     lua_getglobal(L, "debug");
     lua_getfield(L, -1, "traceback");
@@ -164,57 +360,69 @@ LuaContext::init_state()
   }
 
   // Add package paths
-  for (__slit = __package_dirs.begin(); __slit != __package_dirs.end(); ++__slit) {
-    do_string(L, "package.path = package.path .. \";%s/?.lua;%s/?/init.lua\"", __slit->c_str(), __slit->c_str());
+  std::list<std::string>::const_iterator s;
+  for (s = config.package_dirs.begin(); s != config.package_dirs.end(); ++s) {
+    do_string(L, "package.path = package.path .. \";%s/?.lua;%s/?/init.lua\"", s->c_str(), s->c_str());
   }
 
-  for (__slit = __cpackage_dirs.begin(); __slit != __cpackage_dirs.end(); ++__slit) {
-    do_string(L, "package.cpath = package.cpath .. \";%s/?.so\"", __slit->c_str());
+  for (s = config.cpackage_dirs.begin(); s != config.cpackage_dirs.end(); ++s) {
+    do_string(L, "package.cpath = package.cpath .. \";%s/?.so\"", s->c_str());
   }
 
   // load base packages
-  for (__slit = __packages.begin(); __slit != __packages.end(); ++__slit) {
-    do_string(L, "require(\"%s\")", __slit->c_str());
+  for (s = config.packages.begin(); s != config.packages.end(); ++s) {
+    do_string(L, "require(\"%s\")", s->c_str());
   }
 
-  for ( __utit = __usertypes.begin(); __utit != __usertypes.end(); ++__utit) {
-    tolua_pushusertype(L, __utit->second.first, __utit->second.second.c_str());
-    lua_setglobal(L, __utit->first.c_str());
+  std::map<std::string, std::pair<void *, std::string> >::const_iterator ut;
+  for (ut = config.usertypes.begin(); ut != config.usertypes.end(); ++ut) {
+    tolua_pushusertype(L, ut->second.first, ut->second.second.c_str());
+    lua_setglobal(L, ut->first.c_str());
   }
 
-  for ( __strings_it = __strings.begin(); __strings_it != __strings.end(); ++__strings_it) {
-    lua_pushstring(L, __strings_it->second.c_str());
-    lua_setglobal(L, __strings_it->first.c_str());
+  std::map<std::string, std::string>::const_iterator str;
+  for (str = config.strings.begin(); str != config.strings.end(); ++str) {
+    lua_pushstring(L, str->second.c_str());
+    lua_setglobal(L, str->first.c_str());
   }
 
-  for ( __booleans_it = __booleans.begin(); __booleans_it != __booleans.end(); ++__booleans_it) {
-    lua_pushboolean(L, __booleans_it->second);
-    lua_setglobal(L, __booleans_it->first.c_str());
+  std::map<std::string, bool>::const_iterator b;
+  for (b = config.booleans.begin(); b != config.booleans.end(); ++b) {
+    lua_pushboolean(L, b->second);
+    lua_setglobal(L, b->first.c_str());
   }
 
-  for ( __numbers_it = __numbers.begin(); __numbers_it != __numbers.end(); ++__numbers_it) {
-    lua_pushnumber(L, __numbers_it->second);
-    lua_setglobal(L, __numbers_it->first.c_str());
+  std::map<std::string, lua_Number>::const_iterator n;
+  for (n = config.numbers.begin(); n != config.numbers.end(); ++n) {
+    lua_pushnumber(L, n->second);
+    lua_setglobal(L, n->first.c_str());
   }
 
-  for ( __integers_it = __integers.begin(); __integers_it != __integers.end(); ++__integers_it) {
-    lua_pushinteger(L, __integers_it->second);
-    lua_setglobal(L, __integers_it->first.c_str());
+  std::map<std::string, lua_Integer>::const_iterator in;
+  for (in = config.integers.begin(); in != config.integers.end(); ++in) {
+    lua_pushinteger(L, in->second);
+    lua_setglobal(L, in->first.c_str());
   }
 
-  for ( __cfunctions_it = __cfunctions.begin(); __cfunctions_it != __cfunctions.end(); ++__cfunctions_it) {
-    lua_pushcfunction(L, __cfunctions_it->second);
-    lua_setglobal(L, __cfunctions_it->first.c_str());
+  std::map<std::string, lua_CFunction>::const_iterator cf;
+  for (cf = config.cfunctions.begin(); cf != config.cfunctions.end(); ++cf) {
+    lua_pushcfunction(L, cf->second);
+    lua_setglobal(L, cf->first.c_str());
+  }
+
+  std::map<std::string, std::string>::const_iterator ds;
+  for (ds = config.data_sources.begin(); ds != config.data_sources.end(); ++ds) {
+    try {
+      load_data(L, ds->first.c_str(), ds->second.c_str());
+    } catch (...) {
+      lua_close(L);
+      throw;
+    }
   }
 
   LuaContext *tmpctx = new LuaContext(L);
-#ifndef USE_ROS
-  MutexLocker(__watchers.mutex());
-  LockList<LuaContextWatcher *>::iterator i;
-#else
-  std::list<LuaContextWatcher *>::iterator i;
-#endif
-  for (i = __watchers.begin(); i != __watchers.end(); ++i) {
+  std::list<LuaContextWatcher *>::const_iterator i;
+  for (i = config.watchers.begin(); i != config.watchers.end(); ++i) {
     try {
       (*i)->lua_init(tmpctx);
     } catch (...) {
@@ -225,12 +433,12 @@ LuaContext::init_state()
   }
   delete tmpctx;
 
-  if ( __start_script ) {
-    if (access(__start_script, R_OK) == 0) {
-      // it's a file and we can access it, execute it!
-      do_file(L, __start_script);
-    } else {
-      do_string(L, "require(\"%s\")", __start_script);
+  if ( ! config.start_script.empty() ) {
+    try {
+      run_start_script(L, config.start_script.c_str());
+    } catch (...) {
+      lua_close(L);
+      throw;
     }
   }
 
@@ -238,6 +446,128 @@ LuaContext::init_state()
 }
 
 
+/** Apply configuration changes made while a state was initialized.
+ * Called with the context lock held right before the state is swapped
+ * in, so that nothing registered during a restart is lost. Only the
+ * differences to the configuration the state was initialized with are
+ * applied.
+ * @param L Lua state initialized with init_state()
+ * @param config configuration the state has been initialized with
+ */
+void
+LuaContext::replay_config(lua_State *L, const StateConfig &config)
+{
+  StateConfig now;
+  snapshot_config(now);
+  if (now.generation == config.generation)  return;
+
+  // the lists only ever grow
+  std::list<std::string>::const_iterator s = now.package_dirs.begin();
+  std::advance(s, config.package_dirs.size());
+  for (; s != now.package_dirs.end(); ++s) {
+    do_string(L, "package.path = package.path .. \";%s/?.lua;%s/?/init.lua\"", s->c_str(), s->c_str());
+  }
+  s = now.cpackage_dirs.begin();
+  std::advance(s, config.cpackage_dirs.size());
+  for (; s != now.cpackage_dirs.end(); ++s) {
+    do_string(L, "package.cpath = package.cpath .. \";%s/?.so\"", s->c_str());
+  }
+  s = now.packages.begin();
+  std::advance(s, config.packages.size());
+  for (; s != now.packages.end(); ++s) {
+    do_string(L, "require(\"%s\")", s->c_str());
+  }
+
+  std::vector<std::string> removed, changed;
+  std::vector<std::string>::iterator c;
+  config_diff(config.usertypes, now.usertypes, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    tolua_pushusertype(L, now.usertypes[*c].first, now.usertypes[*c].second.c_str());
+    lua_setglobal(L, c->c_str());
+  }
+  changed.clear();
+  config_diff(config.strings, now.strings, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    lua_pushstring(L, now.strings[*c].c_str());
+    lua_setglobal(L, c->c_str());
+  }
+  changed.clear();
+  config_diff(config.booleans, now.booleans, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    lua_pushboolean(L, now.booleans[*c]);
+    lua_setglobal(L, c->c_str());
+  }
+  changed.clear();
+  config_diff(config.numbers, now.numbers, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    lua_pushnumber(L, now.numbers[*c]);
+    lua_setglobal(L, c->c_str());
+  }
+  changed.clear();
+  config_diff(config.integers, now.integers, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    lua_pushinteger(L, now.integers[*c]);
+    lua_setglobal(L, c->c_str());
+  }
+  changed.clear();
+  config_diff(config.cfunctions, now.cfunctions, removed, changed);
+  for (c = changed.begin(); c != changed.end(); ++c) {
+    lua_pushcfunction(L, now.cfunctions[*c]);
+    lua_setglobal(L, c->c_str());
+  }
+  // names may have been removed and assigned again with another type
+  for (c = removed.begin(); c != removed.end(); ++c) {
+    if ( (now.usertypes.find(*c) == now.usertypes.end()) &&
+	 (now.strings.find(*c) == now.strings.end()) &&
+	 (now.booleans.find(*c) == now.booleans.end()) &&
+	 (now.numbers.find(*c) == now.numbers.end()) &&
+	 (now.integers.find(*c) == now.integers.end()) &&
+	 (now.cfunctions.find(*c) == now.cfunctions.end()) )
+    {
+      lua_pushnil(L);
+      lua_setglobal(L, c->c_str());
+    }
+  }
+
+  // removed data sources keep their value, like in the current state
+  std::map<std::string, std::string>::const_iterator ds, old_ds;
+  for (ds = now.data_sources.begin(); ds != now.data_sources.end(); ++ds) {
+    old_ds = config.data_sources.find(ds->first);
+    if ( (old_ds == config.data_sources.end()) || (old_ds->second != ds->second) ) {
+      load_data(L, ds->first.c_str(), ds->second.c_str());
+    }
+  }
+
+  std::list<LuaContextWatcher *>::const_iterator i;
+  for (i = now.watchers.begin(); i != now.watchers.end(); ++i) {
+    if (std::find(config.watchers.begin(), config.watchers.end(), *i) == config.watchers.end()) {
+      LuaContext tmpctx(L);
+      (*i)->lua_init(&tmpctx);
+    }
+  }
+
+  if ( (now.start_script != config.start_script) && ! now.start_script.empty() ) {
+    run_start_script(L, now.start_script.c_str());
+  }
+}
+
+
+/** Run start script in a state.
+ * @param L Lua state to run the script in
+ * @param start_script path of a file, or name of a module
+ */
+void
+LuaContext::run_start_script(lua_State *L, const char *start_script)
+{
+  if (access(start_script, R_OK) == 0) {
+    // it's a file and we can access it, execute it!
+    do_file(L, start_script);
+  } else {
+    do_string(L, "require(\"%s\")", start_script);
+  }
+}
+
+
 /** Set start script.
  * The script will be executed once immediately in this method, make
  * sure you call this after all other init-relevant routines like
@@ -252,165 +582,1086 @@ LuaContext::init_state()
 void
 LuaContext::set_start_script(const char *start_script)
 {
-  if ( __start_script )  free(__start_script);
+  ContextLocker lock(this, "set_start_script");
+  {
+    ConfigLocker config(this);
+    if ( __start_script )  free(__start_script);
+    __start_script = start_script ? strdup(start_script) : NULL;
+  }
   if ( start_script ) {
-    __start_script = strdup(start_script);
-    if (access(__start_script, R_OK) == 0) {
+    if (access(start_script, R_OK) == 0) {
       // it's a file and we can access it, execute it!
-      do_file(__start_script);
+      do_file(start_script);
     } else {
-      do_string("require(\"%s\")", __start_script);
+      do_string("require(\"%s\")", start_script);
     }
-  } else {
-    __start_script = NULL;
   }
 }
 
 
+/** Set benchmark to run before swapping in a restarted state.
+ * If set, restart() calls the entry point alternately in the old and in
+ * the new state before swapping them. If the new state is slower or uses
+ * more memory than allowed it is discarded and the old state is kept, as
+ * if initializing the new state had failed. The new state is also
+ * discarded if the entry point fails in it. The result is reported
+ * through LuaContextWatcher::lua_restart_benchmarked(). Since the entry
+ * point also runs in the live state it should not have side effects.
+ * @param entry_point name of a global function without arguments, NULL to
+ * disable the benchmark
+ * @param runs number of calls per state, at least one
+ * @param max_latency_ratio maximum ratio of the median latency of the new
+ * state to the one of the old state, 0 to not check latency
+ * @param max_memory_ratio maximum ratio of the memory used by the new
+ * state to the one used by the old state, 0 to not check memory
+ */
+void
+LuaContext::set_restart_benchmark(const char *entry_point, unsigned int runs,
+				  double max_latency_ratio, double max_memory_ratio)
+{
+  ContextLocker lock(this, "set_restart_benchmark");
+  ConfigLocker config(this);
+  __benchmark_entry = entry_point ? entry_point : "";
+  __benchmark_runs  = (runs > 0) ? runs : 1;
+  __benchmark_max_latency_ratio = max_latency_ratio;
+  __benchmark_max_memory_ratio  = max_memory_ratio;
+}
+
+
+/** Run benchmark entry point once.
+ * @param L Lua state to run the benchmark in
+ * @param entry_point name of the global function to call
+ * @param usec upon return the time the call took in microseconds
+ * @param errmsg upon return the error message if the call failed
+ * @return true if the call succeeded
+ */
+bool
+LuaContext::benchmark_run(lua_State *L, const std::string &entry_point,
+			  double &usec, std::string &errmsg)
+{
+  lua_getglobal(L, entry_point.c_str());
+  if (! lua_isfunction(L, -1)) {
+    lua_pop(L, 1);
+    errmsg = entry_point + " is not a function";
+    return false;
+  }
+
+  int errfunc = __enable_tracebacks ? 1 : 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int err = lua_pcall(L, 0, 0, errfunc);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (err != 0) {
+    errmsg = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    return false;
+  }
+  usec = (end.tv_sec - start.tv_sec) * 1000000. + (end.tv_nsec - start.tv_nsec) / 1000.;
+  return true;
+}
+
+
+/** Benchmark restarted state against the current state.
+ * The new state is not shared yet and runs without the context lock.
+ * The lock is only taken for each single run in the current state, so
+ * that other threads can keep using it in between.
+ * @param L new Lua state
+ * @param config configuration with the benchmark settings
+ * @return true if the new state may be swapped in
+ */
+bool
+LuaContext::benchmark_restart(lua_State *L, const StateConfig &config)
+{
+  LuaBenchmarkResult r;
+  r.runs = config.benchmark_runs;
+  r.accepted = true;
+
+  std::vector<double> old_us, new_us;
+  std::string errmsg;
+  bool have_old = true;
+  double usec;
+  for (unsigned int i = 0; i < config.benchmark_runs; ++i) {
+    // alternate so that both see the same system load
+    if (have_old) {
+      ContextLocker lock(this, "restart_benchmark");
+      if (benchmark_run(__L, config.benchmark_entry, usec, errmsg)) {
+	old_us.push_back(usec);
+      } else {
+	have_old = false;
+	old_us.clear();
+      }
+    }
+    if (! benchmark_run(L, config.benchmark_entry, usec, errmsg)) {
+#ifndef USE_ROS
+      LibLogger::log_error("LuaContext", "Restart benchmark failed: %s", errmsg.c_str());
+#endif
+      r.accepted = false;
+      break;
+    }
+    new_us.push_back(usec);
+  }
+
+  std::sort(old_us.begin(), old_us.end());
+  std::sort(new_us.begin(), new_us.end());
+  r.old_latency_us = old_us.empty() ? 0. : old_us[old_us.size() / 2];
+  r.new_latency_us = new_us.empty() ? 0. : new_us[new_us.size() / 2];
+
+  {
+    ContextLocker lock(this, "restart_benchmark");
+    lua_gc(__L, LUA_GCCOLLECT, 0);
+    r.old_memory_kb = lua_gc(__L, LUA_GCCOUNT, 0) + lua_gc(__L, LUA_GCCOUNTB, 0) / 1024.;
+  }
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  r.new_memory_kb = lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.;
+
+  if (r.accepted && ! old_us.empty()) {
+    if ( (config.benchmark_max_latency_ratio > 0.) &&
+	 (r.new_latency_us > r.old_latency_us * config.benchmark_max_latency_ratio) )
+    {
+      r.accepted = false;
+    }
+    if ( (config.benchmark_max_memory_ratio > 0.) &&
+	 (r.new_memory_kb > r.old_memory_kb * config.benchmark_max_memory_ratio) )
+    {
+      r.accepted = false;
+    }
+  }
+
+#ifndef USE_ROS
+  if (! r.accepted) {
+    LibLogger::log_warn("LuaContext", "Keeping old state, restart benchmark: "
+			"%.1f us (was %.1f us), %.0f KB (was %.0f KB)",
+			r.new_latency_us, r.old_latency_us,
+			r.new_memory_kb, r.old_memory_kb);
+  }
+#endif
+  ContextLocker lock(this, "restart_benchmark");
+#ifndef USE_ROS
+  MutexLocker watchers_lock(__watchers.mutex());
+  LockList<LuaContextWatcher *>::iterator i;
+#else
+  std::list<LuaContextWatcher *>::iterator i;
+#endif
+  for (i = __watchers.begin(); i != __watchers.end(); ++i) {
+    try {
+      (*i)->lua_restart_benchmarked(this, r);
+    } catch (Exception &e) {
+#ifndef USE_ROS
+      LibLogger::log_warn("LuaContext", "Context watcher threw an exception on "
+			  "restart benchmark, exception follows");
+      LibLogger::log_warn("LuaContext", e);
+#endif
+    }
+  }
+
+  return r.accepted;
+}
+
+
 /** Restart Lua.
  * Creates a new Lua state, initializes it, anf if this went well the
- * current state is swapped with the new state.
+ * current state is swapped with the new state. If a benchmark has been
+ * set with set_restart_benchmark() the new state must also pass it.
+ * The new state is initialized and benchmarked without the context
+ * lock, so other threads keep using the current state meanwhile. The
+ * lock is only taken to apply what has been registered in the meantime
+ * and to swap the states. If a restart is requested while another one
+ * is in progress, the call returns right away and the running restart
+ * is repeated once it has finished.
  */
 void
 LuaContext::restart()
 {
+  pthread_mutex_lock(&__config_mutex);
+  if (__restarting) {
+    __restart_again = true;
+    pthread_mutex_unlock(&__config_mutex);
+    return;
+  }
+  __restarting = true;
+  pthread_mutex_unlock(&__config_mutex);
+
+  pthread_mutex_lock(&__restart_mutex);
+  bool again;
+  do {
+    restart_once();
+
+    pthread_mutex_lock(&__config_mutex);
+    again = __restart_again;
+    __restart_again = false;
+    __restarting = again;
+    pthread_mutex_unlock(&__config_mutex);
+  } while (again);
+  pthread_mutex_unlock(&__restart_mutex);
+}
+
+
+/** Initialize a new state and swap it in. */
+void
+LuaContext::restart_once()
+{
+  try {
+    StateConfig config;
+    snapshot_config(config);
+    lua_State *L = init_state(config);
+
+    if (! config.benchmark_entry.empty() && ! benchmark_restart(L, config)) {
+      lua_close(L);
+      return;
+    }
+
+    {
+      ContextLocker lock(this, "restart");
+      try {
+	replay_config(L, config);
+      } catch (...) {
+	lua_close(L);
+	throw;
+      }
+
 #ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
+      MutexLocker watchers_lock(__watchers.mutex());
+      LockList<LuaContextWatcher *>::iterator i;
+#else
+      std::list<LuaContextWatcher *>::iterator i;
 #endif
-  try {
-    lua_State *L = init_state();
-    lua_State *tL = __L;
+      for (i = __watchers.begin(); i != __watchers.end(); ++i) {
+	try {
+	  (*i)->lua_finalize(this);
+	} catch (Exception &e) {
+#ifndef USE_ROS
+	  LibLogger::log_warn("LuaContext", "Context watcher threw an exception on finalize, "
+			      "exception follows");
+	  LibLogger::log_warn("LuaContext", e);
+#endif
+	}
+      }
+
+      // swap, no call is running on the old state while we hold the lock
+      lua_State *tL = __L;
+      __L = L;
+      lua_close(tL);
+
+      if (__watch_loaded_files)  watch_loaded_files();
+      sync_script_watches();
+
+      for (i = __watchers.begin(); i != __watchers.end(); ++i) {
+	try {
+	  (*i)->lua_restarted(this);
+	} catch (Exception &e) {
+#ifndef USE_ROS
+	  LibLogger::log_warn("LuaContext", "Context watcher threw an exception on restart, "
+			      "exception follows");
+	  LibLogger::log_warn("LuaContext", e);
+#endif
+	}
+      }
+    }
+
+  } catch (Exception &e) {
+#ifndef USE_ROS
+    LibLogger::log_error("LuaContext", "Could not restart Lua instance, an error "
+			 "occured while initializing new state. Keeping old state.");
+    LibLogger::log_error("LuaContext", e);
+#endif
+  }
+}
+
+
+/** Add a Lua package directory.
+ * The directory is added to the search path for lua packages. Files with
+ * a .lua suffix will be considered as Lua modules.
+ * @param path path to add
+ */
+void
+LuaContext::add_package_dir(const char *path)
+{
+  ContextLocker lock(this, "add_package_dir");
+
+  do_string(__L, "package.path = package.path .. \";%s/?.lua;%s/?/init.lua\"", path, path);
+
+  {
+    ConfigLocker config(this);
+    __package_dirs.push_back(path);
+  }
+  if ( __fam && ! __watch_loaded_files )  __fam->watch_dir(path);
+}
+
+
+/** Add a Lua C package directory.
+ * The directory is added to the search path for lua C packages. Files
+ * with a .so suffix will be considered as Lua modules.
+ * @param path path to add
+ */
+void
+LuaContext::add_cpackage_dir(const char *path)
+{
+  ContextLocker lock(this, "add_cpackage_dir");
+
+  do_string(__L, "package.cpath = package.cpath .. \";%s/?.so\"", path);
+
+  {
+    ConfigLocker config(this);
+    __cpackage_dirs.push_back(path);
+  }
+  if ( __fam && ! __watch_loaded_files )  __fam->watch_dir(path);
+}
+
+
+/** Add a default package.
+ * Packages that are added this way are automatically loaded now and
+ * on restart().
+ * @param package package to add
+ */
+void
+LuaContext::add_package(const char *package)
+{
+  ContextLocker lock(this, "add_package");
+
+  if (find(__packages.begin(), __packages.end(), package) == __packages.end()) {
+    do_string(__L, "require(\"%s\")", package);
+
+    ConfigLocker config(this);
+    __packages.push_back(package);
+  }
+}
+
+/** Add a directory to watch for changes.
+ * Files with a .lua suffix will be considered as Lua modules.
+ * @param path path to add
+ */
+void
+LuaContext::add_watchdir(const char *path)
+{
+  ContextLocker lock(this, "add_watchdir");
+  if ( __fam )  __fam->watch_dir(path);
+}
+
+/** Add a file to watch for changes.
+ * @param path path to add
+ */
+void
+LuaContext::add_watchfile(const char *path)
+{
+  ContextLocker lock(this, "add_watchfile");
+  if ( __fam )  __fam->watch_file(path);
+}
+
+
+/** Watch only loaded files.
+ * Instead of watching the complete package directories only the files
+ * which have actually been loaded by the current Lua state, through
+ * require() or do_file(), are watched. Their parent directories are
+ * watched restricted to the names of these files. The set of watched
+ * files is updated whenever a module is loaded and after each restart.
+ * Call this before adding package directories, directories added before
+ * remain watched completely. Directories and files added with
+ * add_watchdir() and add_watchfile() are not affected.
+ * @param enabled true to watch only loaded files, false to stop watching
+ * loaded files
+ */
+void
+LuaContext::set_watch_loaded_files(bool enabled)
+{
+  ContextLocker lock(this, "set_watch_loaded_files");
+  __watch_loaded_files = enabled;
+  if (! __fam)  return;
+
+  if (enabled) {
+    watch_loaded_files();
+  } else {
+    __loaded_files.clear();
+    __fam->watch_files(__loaded_files);
+  }
+}
+
+
+/** Get loaded files.
+ * @return paths of all Lua files loaded by the current Lua state
+ */
+std::set<std::string>
+LuaContext::loaded_files()
+{
+  ContextLocker lock(this, "loaded_files");
+  return loaded_files(__L);
+}
+
+
+/** Get loaded files of a state.
+ * @param L Lua state
+ * @return paths of all Lua files loaded by the given state
+ */
+std::set<std::string>
+LuaContext::loaded_files(lua_State *L)
+{
+  std::set<std::string> rv;
+  lua_getfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.loaded_files");
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      rv.insert(lua_tostring(L, -2));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  return rv;
+}
+
+
+/** Record a loaded file.
+ * @param L Lua state which loaded the file
+ * @param filename name of the file
+ */
+void
+LuaContext::file_loaded(lua_State *L, const char *filename)
+{
+  char path[PATH_MAX];
+  if (realpath(filename, path) == NULL) {
+    strncpy(path, filename, PATH_MAX - 1);
+    path[PATH_MAX - 1] = 0;
+  }
+
+  lua_getfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.loaded_files");
+  if (! lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.loaded_files");
+  }
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, path);
+  lua_pop(L, 1);
+
+  // states being initialized are taken care of after the swap
+  if ( (L == __L) && __watch_loaded_files && __fam &&
+       (__loaded_files.find(path) == __loaded_files.end()) )
+  {
+    __loaded_files.insert(path);
+    __fam->watch_files(__loaded_files);
+  }
+}
+
+
+/** Watch the files loaded by the current state. */
+void
+LuaContext::watch_loaded_files()
+{
+  if (! __fam)  return;
+  __loaded_files = loaded_files(__L);
+  __fam->watch_files(__loaded_files);
+}
+
+
+/** Search for a Lua module.
+ * Searches package.path like the Lua 5.1 module searcher and loads the
+ * first file found. Never raises a Lua error itself.
+ * @param L Lua state
+ * @param name name of the module
+ * @return 1 if the module was loaded and the chunk is on the stack,
+ * 0 if it was not found and the list of tried files is on the stack,
+ * -1 if it could not be loaded and the error message is on the stack
+ */
+int
+LuaContext::find_module(lua_State *L, const char *name)
+{
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "path");
+  const char *path = lua_tostring(L, -1);
+  if (path == NULL) {
+    lua_pop(L, 2);
+    lua_pushstring(L, "'package.path' must be a string");
+    return -1;
+  }
+  std::string templates = path;
+  lua_pop(L, 2);
+
+  std::string modpath = name;
+  std::replace(modpath.begin(), modpath.end(), '.', '/');
+
+  std::string tried;
+  std::string::size_type start = 0;
+  while (start <= templates.length()) {
+    std::string::size_type end = templates.find(';', start);
+    if (end == std::string::npos)  end = templates.length();
+    std::string filename = templates.substr(start, end - start);
+    start = end + 1;
+    if (filename.empty())  continue;
+
+    std::string::size_type q;
+    while ( (q = filename.find('?')) != std::string::npos ) {
+      filename.replace(q, 1, modpath);
+    }
+    if (access(filename.c_str(), R_OK) != 0) {
+      tried += "\n\tno file '" + filename + "'";
+      continue;
+    }
+
+    if (luaL_loadfile(L, filename.c_str()) != 0) {
+      std::string errmsg = lua_tostring(L, -1);
+      lua_pop(L, 1);
+      lua_pushfstring(L, "error loading module '%s' from file '%s':\n\t%s",
+		      name, filename.c_str(), errmsg.c_str());
+      return -1;
+    }
+    LuaContext *context = (LuaContext *)lua_touserdata(L, lua_upvalueindex(1));
+    context->file_loaded(L, filename.c_str());
+    return 1;
+  }
+
+  lua_pushstring(L, tried.c_str());
+  return 0;
+}
+
+
+/** Lua module searcher.
+ * Replaces the Lua file searcher in package.loaders to record the files
+ * which have been loaded.
+ * @param L Lua state
+ * @return number of return values
+ */
+int
+LuaContext::lua_loader(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  // raise errors only once all C++ objects are gone
+  if (find_module(L, name) < 0)  return lua_error(L);
+  return 1;
+}
+
+
+/** Add a data source.
+ * The data file is a Lua chunk which returns a value made of tables,
+ * strings, numbers and booleans. It is loaded now and on every restart
+ * and the value is assigned to the target. If files are watched, a change
+ * to the file does not restart the context. Instead only this file is
+ * loaded again in a separate thread and the value replaces the target in
+ * the next call to process_fam_events(), after which the context watchers
+ * are notified with LuaContextWatcher::lua_data_reloaded(). Code holding
+ * a reference to the old value keeps seeing the old value. If reloading
+ * fails the old value is kept and the error is logged.
+ * @param path path of the data file
+ * @param target name of a global variable or a dotted name of a field in
+ * a table reachable from the globals, e.g. "config.maps"
+ * @exception Exception thrown if the file cannot be loaded or the target
+ * cannot be assigned
+ */
+void
+LuaContext::add_data_source(const char *path, const char *target)
+{
+  char rpath[PATH_MAX];
+  if (realpath(path, rpath) == NULL) {
+#ifndef USE_ROS
+    throw CouldNotOpenFileException(path, errno, "Cannot add data source");
+#else
+    throw Exception(std::string("Cannot add data source ") + path + ": " + strerror(errno));
+#endif
+  }
+
+  ContextLocker lock(this, "add_data_source");
+  load_data(__L, rpath, target);
+  {
+    ConfigLocker config(this);
+    __data_sources[rpath] = target;
+  }
+
+  if (__fam)  __fam->watch_file(rpath);
+}
+
+
+/** Remove a data source.
+ * The file is no longer watched and loaded on restart. The value assigned
+ * to the target is kept.
+ * @param path path of the data file as passed to add_data_source()
+ */
+void
+LuaContext::remove_data_source(const char *path)
+{
+  char rpath[PATH_MAX];
+  if (realpath(path, rpath) == NULL)  return;
+
+  ContextLocker lock(this, "remove_data_source");
+  ConfigLocker config(this);
+  if (__data_sources.erase(rpath) > 0) {
+    if (__fam)  __fam->unwatch_file(rpath);
+  }
+}
+
+
+/** Load data file and assign it.
+ * @param L Lua state to assign the data in
+ * @param path path of the data file
+ * @param target target to assign the data to
+ */
+void
+LuaContext::load_data(lua_State *L, const char *path, const char *target)
+{
+  std::string errmsg;
+  lua_State *data_L = LuaDataLoader::load_file(path, errmsg);
+  if (! data_L) {
+#ifndef USE_ROS
+    throw Exception("Failed to load data file %s: %s", path, errmsg.c_str());
+#else
+    throw Exception(std::string("Failed to load data file ") + path + ": " + errmsg);
+#endif
+  }
+  set_data(L, target, data_L);
+}
+
+
+/** Assign loaded data.
+ * The data is copied and assigned to the target in one step.
+ * @param L Lua state to assign the data in
+ * @param target target to assign the data to
+ * @param data_L state returned by LuaDataLoader, it is closed
+ */
+void
+LuaContext::set_data(lua_State *L, const char *target, lua_State *data_L)
+{
+  LuaDataLoader::copy_value(data_L, -1, L);
+  lua_close(data_L);
+
+  std::string t = target;
+  std::string::size_type dot = t.rfind('.');
+  if (dot == std::string::npos) {
+    lua_setglobal(L, target);
+    return;
+  }
+
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  std::string::size_type start = 0;
+  while (start <= dot) {
+    std::string::size_type end = t.find('.', start);
+    lua_getfield(L, -1, t.substr(start, end - start).c_str());
+    lua_remove(L, -2);
+    if (! lua_istable(L, -1)) {
+      lua_pop(L, 2);
+#ifndef USE_ROS
+      throw Exception("Cannot assign data to %s, %s is not a table",
+		      target, t.substr(0, end).c_str());
+#else
+      throw Exception(std::string("Cannot assign data to ") + target + ", " +
+		      t.substr(0, end) + " is not a table");
+#endif
+    }
+    start = end + 1;
+  }
+  lua_insert(L, -2);
+  lua_setfield(L, -2, t.substr(dot + 1).c_str());
+  lua_pop(L, 1);
+}
+
+
+/** Assign data sources which have been reloaded. */
+void
+LuaContext::apply_data_sources()
+{
+  std::string path, errmsg;
+  lua_State *data_L;
+  while (__loader->fetch(path, data_L, errmsg)) {
+    ContextLocker lock(this, "apply_data_sources");
+    // may have been removed while loading
+    __data_sources_it = __data_sources.find(path);
+    if (__data_sources_it == __data_sources.end()) {
+      if (data_L)  lua_close(data_L);
+      continue;
+    }
+    std::string target = __data_sources_it->second;
+
+    try {
+      if (! data_L) {
+#ifndef USE_ROS
+	throw Exception("%s", errmsg.c_str());
+#else
+	throw Exception(errmsg);
+#endif
+      }
+      set_data(__L, target.c_str(), data_L);
+    } catch (Exception &e) {
+#ifndef USE_ROS
+      LibLogger::log_error("LuaContext", "Could not reload data file %s, keeping "
+			   "old data", path.c_str());
+      LibLogger::log_error("LuaContext", e);
+#endif
+      continue;
+    }
+
+#ifndef USE_ROS
+    MutexLocker watchers_lock(__watchers.mutex());
+    LockList<LuaContextWatcher *>::iterator i;
+#else
+    std::list<LuaContextWatcher *>::iterator i;
+#endif
+    for (i = __watchers.begin(); i != __watchers.end(); ++i) {
+      try {
+	(*i)->lua_data_reloaded(this, path.c_str(), target.c_str());
+      } catch (Exception &e) {
+#ifndef USE_ROS
+	LibLogger::log_warn("LuaContext", "Context watcher threw an exception on "
+			    "data reload, exception follows");
+	LibLogger::log_warn("LuaContext", e);
+#endif
+      }
+    }
+  }
+}
+
+
+/** Get file watches registered by scripts.
+ * @param L Lua state
+ * @return watches registered by the given state
+ */
+std::vector<LuaContext::ScriptWatch>
+LuaContext::script_watches(lua_State *L)
+{
+  std::vector<ScriptWatch> rv;
+  lua_getfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.fam_watches");
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+      ScriptWatch w;
+      w.id = lua_tointeger(L, -2);
+      lua_getfield(L, -1, "path");
+      w.path = lua_tostring(L, -1);
+      lua_getfield(L, -2, "dir");
+      w.is_dir = lua_toboolean(L, -1);
+      lua_pop(L, 3);
+      rv.push_back(w);
+    }
+  }
+  lua_pop(L, 1);
+  return rv;
+}
+
+
+/** Register a file watch for a script.
+ * The path is watched right away if L is the current state. For states
+ * being initialized it is only checked and watched by
+ * sync_script_watches() once the state has been swapped in.
+ * Never raises a Lua error itself.
+ * @param L Lua state registering the watch, the callback is at index 2
+ * @param path path of the file or directory to watch
+ * @return id of the watch, -1 if the path cannot be watched and the error
+ * message is on the stack
+ */
+int
+LuaContext::add_script_watch(lua_State *L, const char *path)
+{
+  char rpath[PATH_MAX];
+  struct stat st;
+  if ( (realpath(path, rpath) == NULL) || (stat(rpath, &st) != 0) ) {
+    lua_pushfstring(L, "cannot watch %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  bool is_dir = S_ISDIR(st.st_mode);
+  if ( (L == __L) &&
+       (__script_watch_paths.find(rpath) == __script_watch_paths.end()) )
+  {
+    try {
+      if (is_dir) {
+	__fam->watch_dir(rpath);
+      } else {
+	__fam->watch_file(rpath);
+      }
+    } catch (Exception &e) {
+      lua_pushfstring(L, "cannot watch %s: %s", path, e.what());
+      return -1;
+    }
+    __script_watch_paths[rpath] = is_dir;
+  }
+
+  // states being initialized register watches without the context lock
+  pthread_mutex_lock(&__config_mutex);
+  int id = ++__script_watch_id;
+  pthread_mutex_unlock(&__config_mutex);
+  lua_getfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.fam_watches");
+  if (! lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.fam_watches");
+  }
+  lua_createtable(L, 0, 3);
+  lua_pushstring(L, rpath);
+  lua_setfield(L, -2, "path");
+  lua_pushboolean(L, is_dir);
+  lua_setfield(L, -2, "dir");
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "callback");
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);
+  return id;
+}
+
+
+/** Update watched paths to those of scripts of the current state.
+ * Paths no longer watched by any script are released, paths registered
+ * while the state was initialized are watched. Paths which cannot be
+ * watched are skipped, their callbacks are not called.
+ */
+void
+LuaContext::sync_script_watches()
+{
+  if (! __fam)  return;
+
+  std::vector<ScriptWatch> watches = script_watches(__L);
+  std::map<std::string, bool> wanted;
+  for (size_t w = 0; w < watches.size(); ++w) {
+    wanted[watches[w].path] = watches[w].is_dir;
+  }
+
+  std::map<std::string, bool>::iterator wp;
+  for (wp = wanted.begin(); wp != wanted.end(); ++wp) {
+    if (__script_watch_paths.find(wp->first) != __script_watch_paths.end())  continue;
+    try {
+      if (wp->second) {
+	__fam->watch_dir(wp->first.c_str());
+      } else {
+	__fam->watch_file(wp->first.c_str());
+      }
+      __script_watch_paths[wp->first] = wp->second;
+    } catch (Exception &e) {
+#ifndef USE_ROS
+      LibLogger::log_warn("LuaContext", "Cannot watch %s for a script", wp->first.c_str());
+      LibLogger::log_warn("LuaContext", e);
+#endif
+    }
+  }
+
+  std::map<std::string, bool>::iterator p = __script_watch_paths.begin();
+  while (p != __script_watch_paths.end()) {
+    if (wanted.find(p->first) != wanted.end()) {
+      ++p;
+      continue;
+    }
+    if (p->second) {
+      __fam->unwatch_dir(p->first.c_str());
+    } else {
+      __fam->unwatch_file(p->first.c_str());
+    }
+    __script_watch_paths.erase(p++);
+  }
+}
+
+
+/** Pass file events to script callbacks.
+ * @param events events of the batch
+ * @param num_events number of events
+ * @return true if any event not reported to a script calls for a restart,
+ * changed source files have been queued for a syntax check
+ */
+bool
+LuaContext::dispatch_script_events(const FamEvent *events, unsigned int num_events)
+{
+  std::vector<bool> reported(num_events, false);
+  if (! __data_sources.empty()) {
+    for (unsigned int i = 0; i < num_events; ++i) {
+      if (__data_sources.find(events[i].path) == __data_sources.end())  continue;
+      reported[i] = true;
+      // editors replacing the file cause a create or moved-to event afterwards
+      if (! (events[i].mask & (FAM_DELETE | FAM_MOVED_FROM))) {
+	__loader->load(events[i].path);
+      }
+    }
+  }
+  if (! __script_watch_paths.empty()) {
+    ContextLocker lock(this, "dispatch_script_events");
+    std::vector<ScriptWatch> watches = script_watches(__L);
+    std::vector<unsigned int> indexes;
+    for (size_t w = 0; w < watches.size(); ++w) {
+      const std::string &wp = watches[w].path;
+      indexes.clear();
+      for (unsigned int i = 0; i < num_events; ++i) {
+	const char *p = events[i].path;
+	if ( (strncmp(p, wp.c_str(), wp.length()) == 0) &&
+	     ((p[wp.length()] == 0) || (watches[w].is_dir && (p[wp.length()] == '/'))) )
+	{
+	  indexes.push_back(i);
+	  reported[i] = true;
+	}
+      }
+      // callbacks may unwatch other watches, those are skipped
+      if (! indexes.empty())  call_script_watch(watches[w].id, events, indexes);
+    }
+  }
+
+  bool restart = false;
+  for (unsigned int i = 0; i < num_events; ++i) {
+    if (reported[i])  continue;
+    if ( (events[i].name[0] == 0) || (events[i].mask & FAM_ISDIR) ) {
+      restart = true;
+    } else if (__restart_filter.matches(events[i].name, NULL)) {
+      restart = true;
+      if (events[i].mask & (FAM_DELETE | FAM_MOVED_FROM)) {
+	__broken_sources.erase(events[i].path);
+      } else {
+	__loader->check(events[i].path);
+      }
+    }
+  }
+  return restart;
+}
+
+
+/** Handle finished syntax checks.
+ * Reports syntax errors and performs a restart deferred until all checks
+ * have finished.
+ */
+void
+LuaContext::apply_source_checks()
+{
+  std::string path, errmsg;
+  while (__loader->fetch_check(path, errmsg)) {
+    if (errmsg.empty()) {
+      __broken_sources.erase(path);
+      continue;
+    }
+    __broken_sources[path] = errmsg;
 
 #ifndef USE_ROS
-    MutexLocker(__watchers.mutex());
+    LibLogger::log_error("LuaContext", "Not restarting, syntax error in %s: %s",
+			 path.c_str(), errmsg.c_str());
+    MutexLocker lock(__watchers.mutex());
     LockList<LuaContextWatcher *>::iterator i;
 #else
     std::list<LuaContextWatcher *>::iterator i;
 #endif
     for (i = __watchers.begin(); i != __watchers.end(); ++i) {
       try {
-	(*i)->lua_finalize(this);
-      } catch (Exception &e) {
-#ifndef USE_ROS
-	LibLogger::log_warn("LuaContext", "Context watcher threw an exception on finalize, "
-			    "exception follows");
-	LibLogger::log_warn("LuaContext", e);
-#endif
-      }
-    }
-
-    // swap and destroy old context
-    __L = L;
-    lua_close(tL);
-
-    for (i = __watchers.begin(); i != __watchers.end(); ++i) {
-      try {
-	(*i)->lua_restarted(this);
+	(*i)->lua_syntax_error(this, path.c_str(), errmsg.c_str());
       } catch (Exception &e) {
 #ifndef USE_ROS
-	LibLogger::log_warn("LuaContext", "Context watcher threw an exception on restart, "
-			    "exception follows");
+	LibLogger::log_warn("LuaContext", "Context watcher threw an exception on "
+			    "syntax error, exception follows");
 	LibLogger::log_warn("LuaContext", e);
 #endif
       }
     }
+  }
 
-  } catch (Exception &e) {
-#ifndef USE_ROS
-    LibLogger::log_error("LuaContext", "Could not restart Lua instance, an error "
-			 "occured while initializing new state. Keeping old state.");
-    LibLogger::log_error("LuaContext", e);
-#endif
+  if (__restart_pending && ! __loader->checks_pending()) {
+    __restart_pending = false;
+    restart_checked();
   }
 }
 
 
-/** Add a Lua package directory.
- * The directory is added to the search path for lua packages. Files with
- * a .lua suffix will be considered as Lua modules.
- * @param path path to add
- */
+/** Restart unless changed source files have syntax errors. */
 void
-LuaContext::add_package_dir(const char *path)
+LuaContext::restart_checked()
 {
+  if (__broken_sources.empty()) {
+    restart();
 #ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
+  } else {
+    LibLogger::log_warn("LuaContext", "Deferring restart until %zu file(s) with "
+			"syntax errors have been fixed", __broken_sources.size());
 #endif
-
-  do_string(__L, "package.path = package.path .. \";%s/?.lua;%s/?/init.lua\"", path, path);
-
-  __package_dirs.push_back(path);
-  if ( __fam )  __fam->watch_dir(path);
+  }
 }
 
 
-/** Add a Lua C package directory.
- * The directory is added to the search path for lua C packages. Files
- * with a .so suffix will be considered as Lua modules.
- * @param path path to add
+/** Call the callback of a script watch.
+ * @param id id of the watch
+ * @param events events of the batch
+ * @param indexes indexes of the events to pass
  */
 void
-LuaContext::add_cpackage_dir(const char *path)
+LuaContext::call_script_watch(int id, const FamEvent *events,
+			      const std::vector<unsigned int> &indexes)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
-
-  do_string(__L, "package.cpath = package.cpath .. \";%s/?.so\"", path);
-
-  __cpackage_dirs.push_back(path);
-  if ( __fam )  __fam->watch_dir(path);
-}
+  lua_getfield(__L, LUA_REGISTRYINDEX, "fawkes.LuaContext.fam_watches");
+  if (! lua_istable(__L, -1)) {
+    lua_pop(__L, 1);
+    return;
+  }
+  lua_rawgeti(__L, -1, id);
+  if (! lua_istable(__L, -1)) {
+    lua_pop(__L, 2);
+    return;
+  }
 
+  lua_getfield(__L, -1, "callback");
+  lua_createtable(__L, indexes.size(), 0);
+  for (size_t k = 0; k < indexes.size(); ++k) {
+    const FamEvent &e = events[indexes[k]];
+    const char *type = "modified";
+    if (e.mask & (FAM_CREATE | FAM_MOVED_TO)) {
+      type = "created";
+    } else if (e.mask & (FAM_DELETE | FAM_MOVED_FROM | FAM_DELETE_SELF | FAM_MOVE_SELF)) {
+      type = "deleted";
+    }
+    lua_createtable(__L, 0, 4);
+    lua_pushstring(__L, e.path);
+    lua_setfield(__L, -2, "path");
+    lua_pushstring(__L, e.name);
+    lua_setfield(__L, -2, "name");
+    lua_pushinteger(__L, e.mask);
+    lua_setfield(__L, -2, "mask");
+    lua_pushstring(__L, type);
+    lua_setfield(__L, -2, "type");
+    lua_rawseti(__L, -2, k + 1);
+  }
 
-/** Add a default package.
- * Packages that are added this way are automatically loaded now and
- * on restart().
- * @param package package to add
- */
-void
-LuaContext::add_package(const char *package)
-{
+  int errfunc = __enable_tracebacks ? 1 : 0;
+  if (lua_pcall(__L, 1, 0, errfunc) != 0) {
 #ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
+    LibLogger::log_warn("LuaContext", "File watch callback failed: %s",
+			lua_tostring(__L, -1));
 #endif
-
-  if (find(__packages.begin(), __packages.end(), package) == __packages.end()) {
-    do_string(__L, "require(\"%s\")", package);
-
-    __packages.push_back(package);
+    lua_pop(__L, 1);
   }
+  lua_pop(__L, 2);
 }
 
-/** Add a directory to watch for changes.
- * Files with a .lua suffix will be considered as Lua modules.
- * @param path path to add
+
+/** Lua function to watch a file or directory.
+ * Lua signature: id = fam.watch(path, callback)
+ * @param L Lua state
+ * @return number of return values
  */
-void
-LuaContext::add_watchdir(const char *path)
+int
+LuaContext::lua_fam_watch(lua_State *L)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
-  if ( __fam )  __fam->watch_dir(path);
+  const char *path = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  LuaContext *context = (LuaContext *)lua_touserdata(L, lua_upvalueindex(1));
+
+  // raise errors only once all C++ objects are gone
+  int id = context->add_script_watch(L, path);
+  if (id < 0)  return lua_error(L);
+  lua_pushinteger(L, id);
+  return 1;
 }
 
-/** Add a file to watch for changes.
- * @param path path to add
+
+/** Lua function to stop watching a file or directory.
+ * Lua signature: fam.unwatch(id)
+ * @param L Lua state
+ * @return number of return values
  */
-void
-LuaContext::add_watchfile(const char *path)
+int
+LuaContext::lua_fam_unwatch(lua_State *L)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
-  if ( __fam )  __fam->watch_file(path);
+  int id = luaL_checkint(L, 1);
+  LuaContext *context = (LuaContext *)lua_touserdata(L, lua_upvalueindex(1));
+
+  lua_getfield(L, LUA_REGISTRYINDEX, "fawkes.LuaContext.fam_watches");
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    lua_rawseti(L, -2, id);
+  }
+  lua_pop(L, 1);
+
+  // states being initialized are taken care of after the swap
+  if (L == context->__L)  context->sync_script_watches();
+  return 0;
 }
 
 
 /** Get Lua state.
  * Allows for raw modification of the used Lua state. Remember proper
- * locking!
+ * locking! The state may be closed by a restart at any time.
  * @return Currently used Lua state
  */
 lua_State *
@@ -420,12 +1671,16 @@ LuaContext::get_lua_state()
 }
 
 
-#ifndef USE_ROS
-/** Lock Lua state. */
+/** Lock Lua state.
+ * Allows to run a sequence of operations on the state without other
+ * threads interfering. The lock is recursive, the calling thread may
+ * call methods of the context while holding it. Prefer LuaContextLocker,
+ * which unlocks the state again if an operation throws.
+ */
 void
 LuaContext::lock()
 {
-  __lua_mutex->lock();
+  lock_context("lock");
 }
 
 
@@ -435,7 +1690,7 @@ LuaContext::lock()
 bool
 LuaContext::try_lock()
 {
-  return __lua_mutex->try_lock();
+  return try_lock_context("lock");
 }
 
 
@@ -443,9 +1698,183 @@ LuaContext::try_lock()
 void
 LuaContext::unlock()
 {
+  unlock_context();
+}
+
+
+/** Enable or disable lock statistics.
+ * With statistics enabled every acquisition of the context lock is
+ * timed, which costs two clock reads per acquisition and one more if it
+ * has to wait. Statistics gathered so far are kept when disabling.
+ * @param enabled true to gather statistics
+ * @see lock_stats()
+ */
+void
+LuaContext::set_lock_stats(bool enabled)
+{
+  __lock_stats_enabled = enabled;
+}
+
+
+/** Get snapshot of lock statistics.
+ * Does not wait for the context lock, so it can be taken while another
+ * thread hogs the context.
+ * @param max_sites maximum number of call sites to report
+ * @return lock statistics since the last reset
+ * @see set_lock_stats()
+ */
+LuaLockStats
+LuaContext::lock_stats(unsigned int max_sites)
+{
+  pthread_mutex_lock(&__lock_stats_mutex);
+  long long now = context_now_us();
+  LuaLockStats rv = __lock_stats;
+  rv.seconds   = (now - __lock_stats_start_us) / 1000000.;
+  rv.holder    = __lock_holder;
+  rv.holder_us = __lock_holder ? now - __lock_hold_start_us : 0;
+  std::map<const char *, LuaLockSite>::iterator i;
+  for (i = __lock_sites.begin(); i != __lock_sites.end(); ++i) {
+    rv.sites.push_back(i->second);
+  }
+  pthread_mutex_unlock(&__lock_stats_mutex);
+
+  std::sort(rv.sites.begin(), rv.sites.end(), lock_site_longer);
+  if (rv.sites.size() > max_sites)  rv.sites.resize(max_sites);
+  return rv;
+}
+
+
+/** Reset lock statistics. */
+void
+LuaContext::reset_lock_stats()
+{
+  pthread_mutex_lock(&__lock_stats_mutex);
+  __lock_stats = LuaLockStats();
+  __lock_stats.wait_us = Log2Histogram(LOCK_HISTOGRAM_BUCKETS);
+  __lock_stats.hold_us = Log2Histogram(LOCK_HISTOGRAM_BUCKETS);
+  __lock_stats.holder = NULL;
+  __lock_stats.holder_us = 0;
+  __lock_sites.clear();
+  __lock_stats_start_us = context_now_us();
+  pthread_mutex_unlock(&__lock_stats_mutex);
+}
+
+
+/** Initialize lock statistics, disabled. */
+void
+LuaContext::init_lock_stats()
+{
+  pthread_mutex_init(&__lock_stats_mutex, NULL);
+  __lock_stats_enabled = false;
+  __lock_depth  = 0;
+  __lock_holder = NULL;
+  __lock_hold_start_us = 0;
+  reset_lock_stats();
+}
+
+
+/** Lock the context.
+ * @param site call site taking the lock
+ */
+void
+LuaContext::lock_context(const char *site)
+{
+  if (! __lock_stats_enabled) {
+    __lua_mutex->lock();
+    ++__lock_depth;
+  } else if (__lua_mutex->try_lock()) {
+    lock_acquired(site, false, 0);
+  } else {
+    long long start = context_now_us();
+    __lua_mutex->lock();
+    lock_acquired(site, true, start);
+  }
+}
+
+
+/** Try to lock the context.
+ * @param site call site taking the lock
+ * @return true if the context has been locked
+ */
+bool
+LuaContext::try_lock_context(const char *site)
+{
+  if (! __lua_mutex->try_lock())  return false;
+  if (__lock_stats_enabled) {
+    lock_acquired(site, false, 0);
+  } else {
+    ++__lock_depth;
+  }
+  return true;
+}
+
+
+/** Account an acquisition of the context lock.
+ * Called with the lock held.
+ * @param site call site which took the lock
+ * @param contended true if the call site had to wait
+ * @param wait_start_us time the call site started waiting
+ */
+void
+LuaContext::lock_acquired(const char *site, bool contended, long long wait_start_us)
+{
+  // nested locking is part of the outer hold
+  if (++__lock_depth > 1)  return;
+
+  long long now = context_now_us();
+  unsigned long wait_us = contended ? now - wait_start_us : 0;
+
+  pthread_mutex_lock(&__lock_stats_mutex);
+  ++__lock_stats.num_acquired;
+  if (contended)  ++__lock_stats.num_contended;
+  __lock_stats.wait_us.add(wait_us);
+
+  LuaLockSite &s = __lock_sites[site];
+  s.site = site;
+  ++s.num_acquired;
+  if (contended)  ++s.num_contended;
+  s.wait_us += wait_us;
+
+  __lock_holder = site;
+  __lock_hold_start_us = now;
+  pthread_mutex_unlock(&__lock_stats_mutex);
+}
+
+
+/** Unlock the context. */
+void
+LuaContext::unlock_context()
+{
+  if ( (--__lock_depth == 0) && __lock_holder ) {
+    unsigned long hold_us = context_now_us() - __lock_hold_start_us;
+
+    pthread_mutex_lock(&__lock_stats_mutex);
+    __lock_stats.hold_us.add(hold_us);
+    LuaLockSite &s = __lock_sites[__lock_holder];
+    s.site = __lock_holder;
+    s.hold_us += hold_us;
+    if (hold_us > s.max_hold_us)  s.max_hold_us = hold_us;
+    __lock_holder = NULL;
+    pthread_mutex_unlock(&__lock_stats_mutex);
+  }
   __lua_mutex->unlock();
 }
-#endif
+
+
+/// @cond INTERNALS
+/* Locks the context for the lifetime of the locker. */
+LuaContext::ContextLocker::ContextLocker(LuaContext *context, const char *site)
+  : __context(context)
+{
+  __context->lock_context(site);
+}
+
+
+LuaContext::ContextLocker::~ContextLocker()
+{
+  __context->unlock_context();
+}
+/// @endcond
 
 /** Execute file.
  * @param filename filet to load and excute.
@@ -453,9 +1882,7 @@ LuaContext::unlock()
 void
 LuaContext::do_file(const char *filename)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "do_file");
   do_file(__L, filename);
 }
 
@@ -497,6 +1924,8 @@ LuaContext::do_file(lua_State *L, const char *filename)
     }
   }
 
+  file_loaded(L, filename);
+
   int errfunc = __enable_tracebacks ? 1 : 0;
   if ( (err = lua_pcall(L, 0, LUA_MULTRET, errfunc)) != 0 ) {
     // There was an error while executing the initialization file
@@ -561,9 +1990,7 @@ LuaContext::do_string(lua_State *L, const char *format, ...)
 void
 LuaContext::do_string(const char *format, ...)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "do_string");
   va_list arg;
   va_start(arg, format);
   char *s;
@@ -593,6 +2020,7 @@ LuaContext::do_string(const char *format, ...)
 void
 LuaContext::load_string(const char *s)
 {
+  ContextLocker lock(this, "load_string");
   int err;
   if ( (err = luaL_loadstring(__L, s)) != 0 ) {
     std::string errmsg = lua_tostring(__L, -1);
@@ -629,6 +2057,7 @@ LuaContext::load_string(const char *s)
 void
 LuaContext::pcall(int nargs, int nresults, int errfunc)
 {
+  ContextLocker lock(this, "pcall");
   int err = 0;
   if ( ! errfunc && __enable_tracebacks )  errfunc = 1;
   if ( (err = lua_pcall(__L, nargs, nresults, errfunc)) != 0 ) {
@@ -718,9 +2147,7 @@ void
 LuaContext::set_usertype(const char *name, void *data,
 			  const char *type_name, const char *name_space)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_usertype");
   std::string type_n = type_name;
   if ( name_space ) {
     type_n = std::string(name_space) + "::" + type_name;
@@ -728,7 +2155,10 @@ LuaContext::set_usertype(const char *name, void *data,
 
   assert_unique_name(name, "usertype");
 
-  __usertypes[name] = std::make_pair(data, type_n);
+  {
+    ConfigLocker config(this);
+    __usertypes[name] = std::make_pair(data, type_n);
+  }
 
   tolua_pushusertype(__L, data, type_n.c_str());
   lua_setglobal(__L, name);
@@ -742,12 +2172,13 @@ LuaContext::set_usertype(const char *name, void *data,
 void
 LuaContext::set_string(const char *name, const char *value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_string");
   assert_unique_name(name, "string");
 
-  __strings[name] = value;
+  {
+    ConfigLocker config(this);
+    __strings[name] = value;
+  }
 
   lua_pushstring(__L, value);
   lua_setglobal(__L, name);
@@ -761,12 +2192,13 @@ LuaContext::set_string(const char *name, const char *value)
 void
 LuaContext::set_boolean(const char *name, bool value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_boolean");
   assert_unique_name(name, "boolean");
 
-  __booleans[name] = value;
+  {
+    ConfigLocker config(this);
+    __booleans[name] = value;
+  }
 
   lua_pushboolean(__L, value ? 1 : 0);
   lua_setglobal(__L, name);
@@ -780,12 +2212,13 @@ LuaContext::set_boolean(const char *name, bool value)
 void
 LuaContext::set_number(const char *name, lua_Number value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_number");
   assert_unique_name(name, "number");
 
-  __numbers[name] = value;
+  {
+    ConfigLocker config(this);
+    __numbers[name] = value;
+  }
 
   lua_pushnumber(__L, value);
   lua_setglobal(__L, name);
@@ -799,12 +2232,13 @@ LuaContext::set_number(const char *name, lua_Number value)
 void
 LuaContext::set_integer(const char *name, lua_Integer value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_integer");
   assert_unique_name(name, "integer");
 
-  __integers[name] = value;
+  {
+    ConfigLocker config(this);
+    __integers[name] = value;
+  }
 
   lua_pushinteger(__L, value);
   lua_setglobal(__L, name);
@@ -817,12 +2251,13 @@ LuaContext::set_integer(const char *name, lua_Integer value)
 void
 LuaContext::set_cfunction(const char *name, lua_CFunction function)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "set_cfunction");
   assert_unique_name(name, "cfunction");
 
-  __cfunctions[name] = function;
+  {
+    ConfigLocker config(this);
+    __cfunctions[name] = function;
+  }
 
   lua_pushcfunction(__L, function);
   lua_setglobal(__L, name);
@@ -835,9 +2270,7 @@ LuaContext::set_cfunction(const char *name, lua_CFunction function)
 void
 LuaContext::push_boolean(bool value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_boolean");
   lua_pushboolean(__L, value ? 1 : 0);
 }
 
@@ -849,9 +2282,7 @@ LuaContext::push_boolean(bool value)
 void
 LuaContext::push_fstring(const char *format, ...)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_fstring");
   va_list arg;
   va_start(arg, format);
   lua_pushvfstring(__L, format, arg);
@@ -865,9 +2296,7 @@ LuaContext::push_fstring(const char *format, ...)
 void
 LuaContext::push_integer(lua_Integer value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_integer");
   lua_pushinteger(__L, value);
 }
 
@@ -878,9 +2307,7 @@ LuaContext::push_integer(lua_Integer value)
 void
 LuaContext::push_light_user_data(void *p)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_light_user_data");
   lua_pushlightuserdata(__L, p);
 }
 
@@ -892,9 +2319,7 @@ LuaContext::push_light_user_data(void *p)
 void
 LuaContext::push_lstring(const char *s, size_t len)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_lstring");
   lua_pushlstring(__L, s, len);
 }
 
@@ -904,9 +2329,7 @@ LuaContext::push_lstring(const char *s, size_t len)
 void
 LuaContext::push_nil()
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_nil");
   lua_pushnil(__L);
 }
 
@@ -917,9 +2340,7 @@ LuaContext::push_nil()
 void
 LuaContext::push_number(lua_Number value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_number");
   lua_pushnumber(__L, value);
 }
 
@@ -930,9 +2351,7 @@ LuaContext::push_number(lua_Number value)
 void
 LuaContext::push_string(const char *value)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_string");
   lua_pushstring(__L, value);
 }
 
@@ -942,9 +2361,7 @@ LuaContext::push_string(const char *value)
 void
 LuaContext::push_thread()
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_thread");
   lua_pushthread(__L);
 }
 
@@ -955,9 +2372,7 @@ LuaContext::push_thread()
 void
 LuaContext::push_value(int idx)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_value");
   lua_pushvalue(__L, idx);
 }
 
@@ -970,9 +2385,7 @@ LuaContext::push_value(int idx)
 void
 LuaContext::push_vfstring(const char *format, va_list arg)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_vfstring");
   lua_pushvfstring(__L, format, arg);
 }
 
@@ -986,9 +2399,7 @@ void
 LuaContext::push_usertype(void *data, const char *type_name,
 			  const char *name_space)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_usertype");
 
   std::string type_n = type_name;
   if ( name_space ) {
@@ -1004,9 +2415,7 @@ LuaContext::push_usertype(void *data, const char *type_name,
 void
 LuaContext::push_cfunction(lua_CFunction function)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "push_cfunction");
   lua_pushcfunction(__L, function);
 }
 
@@ -1017,9 +2426,7 @@ LuaContext::push_cfunction(lua_CFunction function)
 void
 LuaContext::pop(int n)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "pop");
   if (__enable_tracebacks && (n >= stack_size())) {
     throw LuaRuntimeException("pop", "Cannot pop traceback function, invalid n");
   }
@@ -1032,9 +2439,7 @@ LuaContext::pop(int n)
 void
 LuaContext::remove(int idx)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "remove");
   if (__enable_tracebacks && ((idx == 1) || (idx == -stack_size()))) {
     throw LuaRuntimeException("pop", "Cannot remove traceback function");
   }
@@ -1048,6 +2453,7 @@ LuaContext::remove(int idx)
 int
 LuaContext::stack_size()
 {
+  ContextLocker lock(this, "stack_size");
   return lua_gettop(__L);
 }
 
@@ -1059,6 +2465,7 @@ LuaContext::stack_size()
 void
 LuaContext::create_table(int narr, int nrec)
 {
+  ContextLocker lock(this, "create_table");
   lua_createtable(__L, narr, nrec);
 }
 
@@ -1072,6 +2479,7 @@ LuaContext::create_table(int narr, int nrec)
 void
 LuaContext::set_table(int t_index)
 {
+  ContextLocker lock(this, "set_table");
   lua_settable(__L, t_index);
 }
 
@@ -1087,6 +2495,7 @@ LuaContext::set_table(int t_index)
 void
 LuaContext::set_field(const char *key, int t_index)
 {
+  ContextLocker lock(this, "set_field");
   lua_setfield(__L, t_index, key);
 }
 
@@ -1099,6 +2508,7 @@ LuaContext::set_field(const char *key, int t_index)
 void
 LuaContext::set_global(const char *name)
 {
+  ContextLocker lock(this, "set_global");
   lua_setglobal(__L, name);
 }
 
@@ -1113,6 +2523,7 @@ LuaContext::set_global(const char *name)
 void
 LuaContext::get_table(int idx)
 {
+  ContextLocker lock(this, "get_table");
   lua_gettable(__L, idx);
 }
 
@@ -1126,6 +2537,7 @@ LuaContext::get_table(int idx)
 void
 LuaContext::get_field(int idx, const char *k)
 {
+  ContextLocker lock(this, "get_field");
   lua_getfield(__L, idx, k);
 }
 
@@ -1137,6 +2549,7 @@ LuaContext::get_field(int idx, const char *k)
 void
 LuaContext::raw_set(int idx)
 {
+  ContextLocker lock(this, "raw_set");
   lua_rawset(__L, idx);
 }
 
@@ -1150,6 +2563,7 @@ LuaContext::raw_set(int idx)
 void
 LuaContext::raw_seti(int idx, int n)
 {
+  ContextLocker lock(this, "raw_seti");
   lua_rawseti(__L, idx, n);
 }
 
@@ -1161,6 +2575,7 @@ LuaContext::raw_seti(int idx, int n)
 void
 LuaContext::raw_get(int idx)
 {
+  ContextLocker lock(this, "raw_get");
   lua_rawget(__L, idx);
 }
 
@@ -1173,6 +2588,7 @@ LuaContext::raw_get(int idx)
 void
 LuaContext::raw_geti(int idx, int n)
 {
+  ContextLocker lock(this, "raw_geti");
   lua_rawgeti(__L, idx, n);
 }
 
@@ -1183,6 +2599,7 @@ LuaContext::raw_geti(int idx, int n)
 void
 LuaContext::get_global(const char *name)
 {
+  ContextLocker lock(this, "get_global");
   lua_getglobal(__L, name);
 }
 
@@ -1195,16 +2612,17 @@ LuaContext::get_global(const char *name)
 void
 LuaContext::remove_global(const char *name)
 {
-#ifndef USE_ROS
-  MutexLocker lock(__lua_mutex);
-#endif
+  ContextLocker lock(this, "remove_global");
 
-  __usertypes.erase(name);
-  __strings.erase(name);
-  __booleans.erase(name);
-  __numbers.erase(name);
-  __integers.erase(name);
-  __cfunctions.erase(name);
+  {
+    ConfigLocker config(this);
+    __usertypes.erase(name);
+    __strings.erase(name);
+    __booleans.erase(name);
+    __numbers.erase(name);
+    __integers.erase(name);
+    __cfunctions.erase(name);
+  }
 
   lua_pushnil(__L);
   lua_setglobal(__L, name);
@@ -1218,6 +2636,7 @@ LuaContext::remove_global(const char *name)
 lua_Number
 LuaContext::to_number(int idx)
 {
+  ContextLocker lock(this, "to_number");
   return lua_tonumber(__L, idx);
 }
 
@@ -1229,6 +2648,7 @@ LuaContext::to_number(int idx)
 lua_Integer
 LuaContext::to_integer(int idx)
 {
+  ContextLocker lock(this, "to_integer");
   return lua_tointeger(__L, idx);
 }
 
@@ -1240,6 +2660,7 @@ LuaContext::to_integer(int idx)
 bool
 LuaContext::to_boolean(int idx)
 {
+  ContextLocker lock(this, "to_boolean");
   return lua_toboolean(__L, idx);
 }
 
@@ -1251,6 +2672,7 @@ LuaContext::to_boolean(int idx)
 const char *
 LuaContext::to_string(int idx)
 {
+  ContextLocker lock(this, "to_string");
   return lua_tostring(__L, idx);
 }
 
@@ -1262,6 +2684,7 @@ LuaContext::to_string(int idx)
 bool
 LuaContext::is_boolean(int idx)
 {
+  ContextLocker lock(this, "is_boolean");
   return lua_isboolean(__L, idx);
 }
 
@@ -1273,6 +2696,7 @@ LuaContext::is_boolean(int idx)
 bool
 LuaContext::is_cfunction(int idx)
 {
+  ContextLocker lock(this, "is_cfunction");
   return lua_iscfunction(__L, idx);
 }
 
@@ -1284,6 +2708,7 @@ LuaContext::is_cfunction(int idx)
 bool
 LuaContext::is_function(int idx)
 {
+  ContextLocker lock(this, "is_function");
   return lua_isfunction(__L, idx);
 }
 
@@ -1295,6 +2720,7 @@ LuaContext::is_function(int idx)
 bool
 LuaContext::is_light_user_data(int idx)
 {
+  ContextLocker lock(this, "is_light_user_data");
   return lua_islightuserdata(__L, idx);
 }
 
@@ -1306,6 +2732,7 @@ LuaContext::is_light_user_data(int idx)
 bool
 LuaContext::is_nil(int idx)
 {
+  ContextLocker lock(this, "is_nil");
   return lua_isnil(__L, idx);
 }
 
@@ -1317,6 +2744,7 @@ LuaContext::is_nil(int idx)
 bool
 LuaContext::is_number(int idx)
 {
+  ContextLocker lock(this, "is_number");
   return lua_isnumber(__L, idx);
 }
 
@@ -1328,6 +2756,7 @@ LuaContext::is_number(int idx)
 bool
 LuaContext::is_string(int idx)
 {
+  ContextLocker lock(this, "is_string");
   return lua_isstring(__L, idx);
 }
 
@@ -1339,6 +2768,7 @@ LuaContext::is_string(int idx)
 bool
 LuaContext::is_table(int idx)
 {
+  ContextLocker lock(this, "is_table");
   return lua_istable(__L, idx);
 }
 
@@ -1350,6 +2780,7 @@ LuaContext::is_table(int idx)
 bool
 LuaContext::is_thread(int idx)
 {
+  ContextLocker lock(this, "is_thread");
   return lua_isthread(__L, idx);
 }
 
@@ -1361,6 +2792,7 @@ LuaContext::is_thread(int idx)
 size_t
 LuaContext::objlen(int idx)
 {
+  ContextLocker lock(this, "objlen");
   return lua_objlen(__L, idx);
 }
 
@@ -1373,6 +2805,7 @@ LuaContext::objlen(int idx)
 void
 LuaContext::setfenv(int idx)
 {
+  ContextLocker lock(this, "setfenv");
   lua_setfenv(__L, idx);
 }
 
@@ -1385,7 +2818,11 @@ LuaContext::add_watcher(fawkes::LuaContextWatcher *watcher)
 {
 #ifndef USE_ROS
   __watchers.push_back_locked(watcher);
+  // picked up by a restart in progress
+  ConfigLocker config(this);
 #else
+  ContextLocker lock(this, "add_watcher");
+  ConfigLocker config(this);
   __watchers.push_back(watcher);
 #endif
 }
@@ -1399,7 +2836,10 @@ LuaContext::remove_watcher(fawkes::LuaContextWatcher *watcher)
 {
 #ifndef USE_ROS
   __watchers.remove_locked(watcher);
+  ConfigLocker config(this);
 #else
+  ContextLocker lock(this, "remove_watcher");
+  ConfigLocker config(this);
   __watchers.remove(watcher);
 #endif
 }
@@ -1410,6 +2850,55 @@ void
 LuaContext::process_fam_events()
 {
   if ( __fam)  __fam->process_events();
+  if ( __loader ) {
+    apply_data_sources();
+    apply_source_checks();
+  }
+}
+
+
+/** Get FAM file descriptor.
+ * Instead of calling process_fam_events() periodically the descriptor can
+ * be added to an event loop. Call process_fam_events() when it becomes
+ * readable or when fam_timeout() has passed.
+ * @return pollable file descriptor, -1 if files are not watched
+ * @see FileAlterationMonitor::fd()
+ */
+int
+LuaContext::fam_fd() const
+{
+  return __fam ? __fam->fd() : -1;
+}
+
+
+/** Get time until FAM events must be processed.
+ * @return time in milliseconds after which process_fam_events() must be
+ * called even if fam_fd() did not become readable, -1 for no limit
+ * @see FileAlterationMonitor::next_timeout()
+ */
+int
+LuaContext::fam_timeout()
+{
+  return __fam ? __fam->next_timeout() : -1;
+}
+
+
+/** Enable or disable the FAM reader thread.
+ * With the reader thread file events keep being read while a restart
+ * triggered by earlier events is in progress. Restarts still happen in
+ * the thread calling process_fam_events().
+ * @param enabled true to read events in a separate thread
+ * @see FileAlterationMonitor::start_reader_thread()
+ */
+void
+LuaContext::set_fam_reader_thread(bool enabled)
+{
+  if (! __fam)  return;
+  if (enabled) {
+    __fam->start_reader_thread();
+  } else {
+    __fam->stop_reader_thread();
+  }
 }
 
 
@@ -1420,4 +2909,56 @@ LuaContext::fam_event(const char *filename, unsigned int mask)
 }
 
 
+void
+LuaContext::fam_events(const FamEvent *events, unsigned int num_events)
+{
+  // one restart per burst, no matter how many files changed
+  if (dispatch_script_events(events, num_events)) {
+    if (__loader->checks_pending()) {
+      __restart_pending = true;
+    } else {
+      restart_checked();
+    }
+  }
+}
+
+
+
+/** @class LuaContextLocker <lua/context.h>
+ * Scoped lock of a Lua context.
+ * Locks the context on construction and unlocks it when it goes out of
+ * scope, so that a sequence of stack operations runs without other
+ * threads interfering, even if one of them throws. Each method of the
+ * context only locks for itself, a sequence like the one below needs
+ * the locker to keep the stack consistent.
+ * @code
+ * {
+ *   LuaContextLocker lock(context);
+ *   context->get_global("f");
+ *   context->push_integer(1);
+ *   context->pcall(1, 1);
+ *   result = context->to_integer(-1);
+ *   context->pop(1);
+ * }
+ * @endcode
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param context context to lock
+ */
+LuaContextLocker::LuaContextLocker(LuaContext *context)
+{
+  __context = context;
+  __context->lock();
+}
+
+
+/** Destructor. */
+LuaContextLocker::~LuaContextLocker()
+{
+  __context->unlock();
+}
+
+
 } // end of namespace fawkes
@@ -75,4 +75,54 @@ LuaContextWatcher::~LuaContextWatcher()
 }
 
 
+/** Lua data reload event.
+ * This is called when a data source added with
+ * LuaContext::add_data_source() has been reloaded after its file changed
+ * and the new data has been assigned to the target. It is not called on
+ * restart, where all data sources are loaded before lua_init(). The
+ * default implementation does nothing.
+ * @param context the context the data has been reloaded into, it is
+ * locked while the method is executed
+ * @param path path of the data file
+ * @param target global or table field the data has been assigned to
+ */
+void
+LuaContextWatcher::lua_data_reloaded(LuaContext *context, const char *path,
+				     const char *target)
+{
+}
+
+
+/** Lua syntax error event.
+ * This is called when a changed source file in a watched directory does
+ * not compile. The context is not restarted until all changed files
+ * compile again, so this is reported right away instead of as a failed
+ * restart. The default implementation does nothing.
+ * @param context the context which has not been restarted
+ * @param path path of the source file
+ * @param errmsg error message of the Lua compiler
+ */
+void
+LuaContextWatcher::lua_syntax_error(LuaContext *context, const char *path,
+				    const char *errmsg)
+{
+}
+
+
+/** Lua restart benchmark event.
+ * This is called during a restart if a benchmark has been configured with
+ * LuaContext::set_restart_benchmark(), after the new state has been
+ * initialized and benchmarked against the old one, and before the states
+ * are swapped if the result is accepted. The default implementation does
+ * nothing.
+ * @param context the context being restarted, still running the old state
+ * @param result benchmark result
+ */
+void
+LuaContextWatcher::lua_restart_benchmarked(LuaContext *context,
+					   const LuaBenchmarkResult &result)
+{
+}
+
+
 } // end of namespace fawkes
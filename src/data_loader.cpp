@@ -0,0 +1,374 @@
+
+/***************************************************************************
+ *  data_loader.cpp - Background loader for Lua data and source files
+ *
+ *  Created: Sat Oct 17 22:10:42 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#ifdef USE_ROS
+#  include <lua_utils/data_loader.h>
+#  include <lua_utils/fam.h>
+#else
+#  include <lua/data_loader.h>
+#  include <utils/system/fam.h>
+#endif
+
+namespace fawkes {
+#if 0 /* just to make Emacs auto-indent happy */
+}
+#endif
+
+/** @class LuaDataLoader <lua/data_loader.h>
+ * Background loader for Lua data and source files.
+ * A data file is a Lua chunk returning a value made of tables, strings,
+ * numbers and booleans, for example a large configuration table. The
+ * file is executed in a scratch Lua state of its own so that parsing and
+ * building the table do not block the state it is meant for. The result
+ * is then copied into that state with copy_value().
+ *
+ * Source files can be checked for syntax errors with check() before
+ * anything is done with them, for example before restarting a context
+ * because a script changed. They are only compiled, not executed.
+ *
+ * Files passed to load() and check() are handled one after another by a
+ * thread which is started on the first request. When a file has been
+ * handled the monitor passed to the constructor is interrupted, which
+ * wakes up the thread processing its events to fetch() or fetch_check()
+ * the result. If the monitor cannot be interrupted, results wait until it
+ * processes events for another reason.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param fam monitor to interrupt when a load has finished, may be NULL
+ */
+LuaDataLoader::LuaDataLoader(FileAlterationMonitor *fam)
+{
+  __fam     = fam;
+  __running = false;
+  __quit    = false;
+  __num_checks = 0;
+  pthread_mutex_init(&__mutex, NULL);
+  pthread_cond_init(&__cond, NULL);
+}
+
+
+/** Destructor.
+ * Waits for a load in progress, queued loads are discarded.
+ */
+LuaDataLoader::~LuaDataLoader()
+{
+  if (__running) {
+    pthread_mutex_lock(&__mutex);
+    __quit = true;
+    pthread_cond_signal(&__cond);
+    pthread_mutex_unlock(&__mutex);
+    pthread_join(__loader, NULL);
+  }
+
+  std::list<Result>::iterator r;
+  for (r = __results.begin(); r != __results.end(); ++r) {
+    if (r->L)  lua_close(r->L);
+  }
+  pthread_cond_destroy(&__cond);
+  pthread_mutex_destroy(&__mutex);
+}
+
+
+/** Queue a data file for loading.
+ * A file which is already queued is loaded only once.
+ * @param path path of the data file
+ */
+void
+LuaDataLoader::load(const char *path)
+{
+  queue(path, false);
+}
+
+
+/** Queue a source file for a syntax check.
+ * A file which is already queued is checked only once.
+ * @param path path of the source file
+ */
+void
+LuaDataLoader::check(const char *path)
+{
+  queue(path, true);
+}
+
+
+void
+LuaDataLoader::queue(const char *path, bool check)
+{
+  pthread_mutex_lock(&__mutex);
+  std::list<Job>::iterator j;
+  for (j = __queue.begin(); j != __queue.end(); ++j) {
+    if ( (j->check == check) && (j->path == path) )  break;
+  }
+  if (j == __queue.end()) {
+    Job job;
+    job.path  = path;
+    job.check = check;
+    __queue.push_back(job);
+    if (check)  ++__num_checks;
+  }
+  if (! __running) {
+    __running = (pthread_create(&__loader, NULL, LuaDataLoader::loader_thread, this) == 0);
+  }
+  pthread_cond_signal(&__cond);
+  pthread_mutex_unlock(&__mutex);
+}
+
+
+/** Fetch the result of a finished load.
+ * @param path upon return the path of the data file
+ * @param L upon return the scratch state with the data on top of the
+ * stack, or NULL if loading failed. The caller must close it.
+ * @param errmsg upon return the reason if loading failed
+ * @return true if a result has been fetched, false if no load has finished
+ */
+bool
+LuaDataLoader::fetch(std::string &path, lua_State *&L, std::string &errmsg)
+{
+  pthread_mutex_lock(&__mutex);
+  if (__results.empty()) {
+    pthread_mutex_unlock(&__mutex);
+    return false;
+  }
+  Result &r = __results.front();
+  path   = r.path;
+  L      = r.L;
+  errmsg = r.errmsg;
+  __results.pop_front();
+  pthread_mutex_unlock(&__mutex);
+  return true;
+}
+
+
+/** Fetch the result of a finished syntax check.
+ * @param path upon return the path of the source file
+ * @param errmsg upon return the error message if the file does not
+ * compile, the empty string otherwise
+ * @return true if a result has been fetched, false if no check has finished
+ */
+bool
+LuaDataLoader::fetch_check(std::string &path, std::string &errmsg)
+{
+  pthread_mutex_lock(&__mutex);
+  if (__checks.empty()) {
+    pthread_mutex_unlock(&__mutex);
+    return false;
+  }
+  path   = __checks.front().path;
+  errmsg = __checks.front().errmsg;
+  __checks.pop_front();
+  --__num_checks;
+  pthread_mutex_unlock(&__mutex);
+  return true;
+}
+
+
+/** Check if syntax checks are outstanding.
+ * @return true if checks are queued, in progress or have not been fetched
+ */
+bool
+LuaDataLoader::checks_pending()
+{
+  pthread_mutex_lock(&__mutex);
+  bool rv = (__num_checks > 0);
+  pthread_mutex_unlock(&__mutex);
+  return rv;
+}
+
+
+/** Load a data file.
+ * @param path path of the data file
+ * @param errmsg upon return the reason if loading failed
+ * @return new Lua state with the data on top of the stack, NULL if the
+ * file could not be loaded, failed to execute or did not return plain data
+ */
+lua_State *
+LuaDataLoader::load_file(const char *path, std::string &errmsg)
+{
+  lua_State *L = luaL_newstate();
+  if (! L) {
+    errmsg = "out of memory";
+    return NULL;
+  }
+  luaL_openlibs(L);
+
+  if ( (luaL_loadfile(L, path) != 0) || (lua_pcall(L, 0, 1, 0) != 0) ) {
+    errmsg = lua_tostring(L, -1);
+  } else if (lua_isnil(L, -1)) {
+    errmsg = std::string("data file ") + path + " did not return a value";
+  } else if (! is_plain_data(L, -1, 0)) {
+    errmsg = std::string("data file ") + path + " returned values other than "
+      "tables, strings, numbers and booleans, or tables nested too deeply";
+  } else {
+    return L;
+  }
+  lua_close(L);
+  return NULL;
+}
+
+
+/** Check a source file for syntax errors.
+ * Files which cannot be read are not considered to be erroneous, they
+ * may have been removed in the meantime.
+ * @param path path of the source file
+ * @param errmsg upon return the error message if the file does not compile
+ * @return true if the file compiles or cannot be read, false otherwise
+ */
+bool
+LuaDataLoader::check_file(const char *path, std::string &errmsg)
+{
+  lua_State *L = luaL_newstate();
+  if (! L) {
+    errmsg = "out of memory";
+    return false;
+  }
+
+  int err = luaL_loadfile(L, path);
+  if ( (err != 0) && (err != LUA_ERRFILE) ) {
+    errmsg = lua_tostring(L, -1);
+  }
+  lua_close(L);
+  return (err == 0) || (err == LUA_ERRFILE);
+}
+
+
+/** Copy a value between states.
+ * Only plain data as accepted by load_file() is copied, other values
+ * become nil. Tables are copied deeply.
+ * @param from state to copy from
+ * @param idx index of the value in from
+ * @param to state to push the copy to
+ */
+void
+LuaDataLoader::copy_value(lua_State *from, int idx, lua_State *to)
+{
+  switch (lua_type(from, idx)) {
+  case LUA_TBOOLEAN:
+    lua_pushboolean(to, lua_toboolean(from, idx));
+    break;
+
+  case LUA_TNUMBER:
+    lua_pushnumber(to, lua_tonumber(from, idx));
+    break;
+
+  case LUA_TSTRING:
+    {
+      size_t len;
+      const char *s = lua_tolstring(from, idx, &len);
+      lua_pushlstring(to, s, len);
+    }
+    break;
+
+  case LUA_TTABLE:
+    if (idx < 0)  idx = lua_gettop(from) + idx + 1;
+    lua_checkstack(from, 2);
+    lua_checkstack(to, 3);
+    lua_newtable(to);
+    lua_pushnil(from);
+    while (lua_next(from, idx) != 0) {
+      copy_value(from, -2, to);
+      copy_value(from, -1, to);
+      lua_rawset(to, -3);
+      lua_pop(from, 1);
+    }
+    break;
+
+  default:
+    lua_pushnil(to);
+  }
+}
+
+
+bool
+LuaDataLoader::is_plain_data(lua_State *L, int idx, unsigned int depth)
+{
+  switch (lua_type(L, idx)) {
+  case LUA_TNIL:
+  case LUA_TBOOLEAN:
+  case LUA_TNUMBER:
+  case LUA_TSTRING:
+    return true;
+
+  case LUA_TTABLE:
+    {
+      // cyclic tables end up here as well
+      if (depth >= MAX_DEPTH)  return false;
+      if (idx < 0)  idx = lua_gettop(L) + idx + 1;
+      lua_checkstack(L, 2);
+      lua_pushnil(L);
+      while (lua_next(L, idx) != 0) {
+	if ( ! is_plain_data(L, -2, depth + 1) || ! is_plain_data(L, -1, depth + 1) ) {
+	  lua_pop(L, 2);
+	  return false;
+	}
+	lua_pop(L, 1);
+      }
+    }
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+
+void *
+LuaDataLoader::loader_thread(void *arg)
+{
+  LuaDataLoader *l = (LuaDataLoader *)arg;
+
+  pthread_mutex_lock(&l->__mutex);
+  while (! l->__quit) {
+    if (l->__queue.empty()) {
+      pthread_cond_wait(&l->__cond, &l->__mutex);
+      continue;
+    }
+    Job job = l->__queue.front();
+    l->__queue.pop_front();
+    pthread_mutex_unlock(&l->__mutex);
+
+    Result r;
+    r.path = job.path;
+    if (job.check) {
+      r.L = NULL;
+      check_file(r.path.c_str(), r.errmsg);
+    } else {
+      r.L = load_file(r.path.c_str(), r.errmsg);
+    }
+
+    pthread_mutex_lock(&l->__mutex);
+    if (job.check) {
+      l->__checks.push_back(r);
+    } else {
+      l->__results.push_back(r);
+    }
+    // interrupt() throws if the monitor is not interruptible, which would
+    // terminate the process from this thread, results are then fetched on
+    // the next event instead
+    if (l->__fam && l->__fam->interruptible())  l->__fam->interrupt();
+  }
+  pthread_mutex_unlock(&l->__mutex);
+  return NULL;
+}
+
+} // end of namespace fawkes
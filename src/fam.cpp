@@ -22,6 +22,10 @@
  */
 
 #include <lua_utils/fam.h>
+#include <lua_utils/fam_reactor.h>
+#include <lua_utils/fam_poller.h>
+#include <lua_utils/fam_ring.h>
+#include <lua_utils/fam_record.h>
 
 #ifndef USE_ROS
 #  include <core/exception.h>
@@ -37,18 +41,84 @@ using ros::Exception;
 
 #ifdef HAVE_INOTIFY
 #  include <sys/inotify.h>
+#  include <sys/vfs.h>
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
 #  include <sys/stat.h>
 #  include <poll.h>
 #  include <dirent.h>
-#  include <unistd.h>
 #  include <cstring>
 #endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctime>
 #include <cerrno>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
 
 namespace fawkes {
 
+/// @cond INTERNALS
+static long long
+fam_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+fam_signal(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+    // only fails if the counter is about to overflow, still signaled
+  }
+}
+
+static void
+fam_drain(int fd)
+{
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+    // not signaled
+  }
+}
+
+static long long
+fam_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef HAVE_INOTIFY
+/* Events every watch is created with, needed to follow the tree. */
+static const uint32_t FAM_WATCH_MASK =
+  IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+static uint32_t
+fam_inotify_mask(unsigned int fam_mask)
+{
+  static const struct { unsigned int fam; uint32_t in; } map[] = {
+    { 0x00000001, IN_ACCESS },      { 0x00000002, IN_MODIFY },
+    { 0x00000004, IN_ATTRIB },      { 0x00000008, IN_CLOSE_WRITE },
+    { 0x00000010, IN_CLOSE_NOWRITE }, { 0x00000020, IN_OPEN },
+    { 0x00000040, IN_MOVED_FROM },  { 0x00000080, IN_MOVED_TO },
+    { 0x00000100, IN_CREATE },      { 0x00000200, IN_DELETE },
+    { 0x00000400, IN_DELETE_SELF }, { 0x00000800, IN_MOVE_SELF }
+  };
+  uint32_t mask = 0;
+  for (size_t i = 0; i < sizeof(map) / sizeof(map[0]); ++i) {
+    if (fam_mask & map[i].fam)  mask |= map[i].in;
+  }
+  return mask;
+}
+#endif
+/// @endcond
+
 /* Supported events suitable for MASK parameter of INOTIFY_ADD_WATCH.  */
 /** File was accessed.  */
 const unsigned int FamListener::FAM_ACCESS        = 0x00000001;
@@ -87,6 +157,11 @@ const unsigned int FamListener::FAM_Q_OVERFLOW	  = 0x00004000;
 /** File was ignored.  */
 const unsigned int FamListener::FAM_IGNORED	  = 0x00008000;
 
+/* Events synthesized by the FileAlterationMonitor.  */
+/** Content has changed, posted for merged events, see
+ * FileAlterationMonitor::set_quiet_period().  */
+const unsigned int FamListener::FAM_CONTENT_CHANGED = 0x00100000;
+
 /* Special flags.  */
 /** Only watch the path if it is a directory.  */
 const unsigned int FamListener::FAM_ONLYDIR	  = 0x01000000;
@@ -112,98 +187,491 @@ const unsigned int FamListener::FAM_ALL_EVENTS	   = (FAM_ACCESS | FAM_MODIFY | F
  * for modifications. If a modifiacation, removal or addition of a file
  * is detected one or more listeners are called. The files which trigger
  * the event can be constrained with regular expressions.
+ *
+ * All monitors of a process share a single inotify instance through the
+ * FamReactor, so creating many monitors watching the same directories
+ * does not consume additional inotify instances or kernel watches.
+ *
+ * Since inotify does not see changes made by other hosts on network file
+ * systems, paths on such file systems are polled by a FamPoller instead.
+ * The same holds for overlay file systems, e.g. in containers, where
+ * changes made directly to a lower layer do not reach watches on the
+ * merged directory. The backend can also be chosen explicitly for all or individual paths.
  * @author Tim Niemueller
  */
 
 /** Constructor.
- * Opens the inotify context.
+ * Attaches to the process-wide inotify reactor.
  */
 FileAlterationMonitor::FileAlterationMonitor()
 {
+  __reactor = FamReactor::instance();
+  __num_inotify_watches = 0;
+  pthread_mutex_init(&__queue_mutex, NULL);
+
+  __backend = BACKEND_AUTO;
+  intern_dir("");
+  __poller  = new FamPoller(this, __filter);
+  __recorder = NULL;
+  __player   = NULL;
+  __stats    = FamStats();
+  __stats_start_us = fam_now_us();
+
+  __quiet_period_ms = 0;
+  __content_hashing = false;
 #ifdef HAVE_INOTIFY
-  if ( (__inotify_fd = inotify_init()) == -1 ) {
-    throw Exception("Failed to initialize inotify");
-  }
+  __watch_mask      = FAM_WATCH_MASK;
+#else
+  __watch_mask      = 0;
+#endif
+
+  __num_overflows = 0;
+  __num_rescans   = 0;
+  __last_sync     = time(NULL);
 
-  // from http://www.linuxjournal.com/article/8478
-  __inotify_bufsize = 1024 * (sizeof(struct inotify_event) + 16);
-  __inotify_buf     = (char *)malloc(__inotify_bufsize);
+  __interrupted   = 0;
+  __wakeup_fd     = -1;
+#ifdef HAVE_INOTIFY
+  // a single read resets the counter, however many wakeups there were
+  __wakeup_fd     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 #endif
+  __interruptible = (__wakeup_fd != -1);
 
-  __interrupted   = false;
-  __interruptible = (pipe(__pipe_fds) == 0);
+  __ring           = NULL;
+  __reader_running = false;
+  __dropped_seen   = 0;
+  __dropped_total  = 0;
+  __lag_sum_us     = 0;
+  __lag_count      = 0;
+  __lag_max_us     = 0;
 
-  __regexes.clear();
+  __epoll_fd = -1;
+#ifdef HAVE_INOTIFY
+  // single descriptor for external event loops, readable whenever the
+  // inotify descriptor or the wakeup descriptor is readable
+  if ( (__epoll_fd = epoll_create1(EPOLL_CLOEXEC)) != -1 ) {
+    struct epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = __reactor->fd();
+    epoll_ctl(__epoll_fd, EPOLL_CTL_ADD, __reactor->fd(), &ev);
+    if (__interruptible) {
+      ev.data.fd = __wakeup_fd;
+      epoll_ctl(__epoll_fd, EPOLL_CTL_ADD, __wakeup_fd, &ev);
+    }
+  }
+#endif
 }
 
 
 /** Destructor. */
 FileAlterationMonitor::~FileAlterationMonitor()
 {
-  for (__rxit = __regexes.begin(); __rxit != __regexes.end(); ++__rxit) {
-    regfree(*__rxit);
-    free(*__rxit);
-  }
+  stop_reader_thread();
+  __reactor->remove_client(this);
+  __inotify_watches.clear();
+  __watch_slots.clear();
+  __free_watch_slots.clear();
+  FamReactor::release();
+  delete __poller;
+  delete __recorder;
+  delete __player;
+
+  if (__interruptible)  close(__wakeup_fd);
+  if (__epoll_fd != -1)  close(__epoll_fd);
+  pthread_mutex_destroy(&__queue_mutex);
+}
+
 
 #ifdef HAVE_INOTIFY
-  for (__inotify_wit = __inotify_watches.begin(); __inotify_wit != __inotify_watches.end(); ++__inotify_wit) {
-    inotify_rm_watch(__inotify_fd, __inotify_wit->first);
+/// @cond INTERNALS
+/* Directory tree scanner used by FileAlterationMonitor::watch_dir().
+ * Subdirectories are detected from d_type, only entries of unknown type
+ * or symbolic links are stat'ed. Traversal is relative to the parent's
+ * file descriptor with one reused path buffer per walk. Trees that are
+ * wide near the root are expanded breadth-first until there is enough
+ * work and then walked by several threads in parallel. The names of
+ * files passing the filter are recorded per directory.
+ */
+class FamTreeScanner
+{
+ public:
+  typedef struct {
+    int                       wd;
+    std::string               path;
+    std::vector<std::string>  files;
+  } ScannedDir;
+
+  FamTreeScanner(FamReactor *reactor, FileAlterationMonitor *client, uint32_t mask,
+		 const FamPathFilter &filter, size_t rootlen)
+    : __reactor(reactor), __client(client), __mask(mask),
+      __filter(filter), __rootlen(rootlen), __next(0), __failed(false)
+  {
+    pthread_mutex_init(&__mutex, NULL);
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    __num_workers = (nproc < 1) ? 1 : ((nproc > MAX_WORKERS) ? MAX_WORKERS : nproc);
+  }
+
+  ~FamTreeScanner()
+  {
+    pthread_mutex_destroy(&__mutex);
+  }
+
+  void scan(const char *dirpath)
+  {
+    __frontier.push_back(dirpath);
+    if (__num_workers > 1) {
+      for (unsigned int depth = 0;
+	   ! __failed && ! __frontier.empty() && (depth < MAX_EXPAND_DEPTH) &&
+	     (__frontier.size() < PARALLEL_MIN_DIRS);
+	   ++depth)
+      {
+	std::vector<std::string> next;
+	for (size_t i = 0; ! __failed && (i < __frontier.size()); ++i) {
+	  expand(__frontier[i], next);
+	}
+	__frontier.swap(next);
+      }
+    }
+
+    if ( (__num_workers > 1) && (__frontier.size() >= PARALLEL_MIN_DIRS) ) {
+      std::vector<pthread_t> threads;
+      for (unsigned int i = 1; i < __num_workers; ++i) {
+	pthread_t t;
+	if (pthread_create(&t, NULL, FamTreeScanner::worker, this) == 0) {
+	  threads.push_back(t);
+	}
+      }
+      work();
+      for (size_t i = 0; i < threads.size(); ++i) {
+	pthread_join(threads[i], NULL);
+      }
+    } else {
+      work();
+    }
+  }
+
+  bool failed() const { return __failed; }
+  const std::string & error() const { return __error; }
+  const std::vector<ScannedDir> & watched() const { return __watched; }
+
+ private:
+  static const unsigned int MAX_WORKERS       = 8;
+  static const unsigned int MAX_EXPAND_DEPTH  = 3;
+  static const size_t       PARALLEL_MIN_DIRS = 32;
+
+  typedef std::vector<ScannedDir> WatchList;
+
+  static void * worker(void *arg)
+  {
+    ((FamTreeScanner *)arg)->work();
+    return NULL;
+  }
+
+  void fail(const std::string &msg)
+  {
+    pthread_mutex_lock(&__mutex);
+    if (! __failed) {
+      __error  = msg;
+      __failed = true;
+    }
+    pthread_mutex_unlock(&__mutex);
+  }
+
+  void merge(WatchList &w)
+  {
+    pthread_mutex_lock(&__mutex);
+    __watched.insert(__watched.end(), w.begin(), w.end());
+    pthread_mutex_unlock(&__mutex);
+  }
+
+  bool add_watch(const std::string &path, WatchList &w)
+  {
+    //LibLogger::log_debug("FileAlterationMonitor", "Adding watch for %s", path.c_str());
+    int iw;
+    if ( (iw = __reactor->add_watch(path.c_str(), __mask, __client)) >= 0) {
+      ScannedDir sd;
+      sd.wd   = iw;
+      sd.path = path;
+      w.push_back(sd);
+      return true;
+    } else {
+      fail(std::string("Cannot add watch for ") + path);
+      return false;
+    }
+  }
+
+  void list_entries(int dfd, const std::string &path,
+		    std::vector<std::string> &subdirs, std::vector<std::string> &files)
+  {
+    // fdopendir() takes ownership, keep dfd for openat() by the caller
+    int fd = dup(dfd);
+    DIR *d = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (d == NULL) {
+      if (fd >= 0)  close(fd);
+      return;
+    }
+
+    struct dirent *de;
+    while ( (de = readdir(d)) != NULL ) {
+      if (de->d_name[0] == '.')  continue;
+
+      bool is_dir = (de->d_type == DT_DIR);
+      if ( (de->d_type == DT_UNKNOWN) || (de->d_type == DT_LNK) ) {
+	struct stat st;
+	is_dir = (fstatat(dfd, de->d_name, &st, 0) == 0) && S_ISDIR(st.st_mode);
+      }
+      if (is_dir) {
+	subdirs.push_back(de->d_name);
+      } else if (__filter.empty()) {
+	files.push_back(de->d_name);
+      } else {
+	const char *relpath = NULL;
+	std::string rp;
+	if (__filter.needs_path()) {
+	  if (__rootlen < path.length()) {
+	    rp.assign(path, __rootlen, std::string::npos);
+	    rp.append(1, '/');
+	  }
+	  relpath = rp.append(de->d_name).c_str();
+	}
+	if (__filter.matches(de->d_name, relpath))  files.push_back(de->d_name);
+      }
+    }
+    closedir(d);
+  }
+
+  void walk(int dfd, std::string &path, WatchList &w)
+  {
+    if (! add_watch(path, w))  return;
+
+    std::vector<std::string> subdirs;
+    list_entries(dfd, path, subdirs, w.back().files);
+
+    size_t pathlen = path.length();
+    for (size_t i = 0; ! __failed && (i < subdirs.size()); ++i) {
+      path.append(1, '/').append(subdirs[i]);
+      int sfd = openat(dfd, subdirs[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (sfd >= 0) {
+	walk(sfd, path, w);
+	close(sfd);
+      } else {
+	fail(std::string("Failed to open dir ") + path);
+      }
+      path.resize(pathlen);
+    }
   }
-  close(__inotify_fd);
-  if ( __inotify_buf ) {
-    free(__inotify_buf);
-    __inotify_buf = NULL;
+
+  void expand(const std::string &path, std::vector<std::string> &next)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      fail(std::string("Failed to open dir ") + path);
+      return;
+    }
+    WatchList w;
+    if (add_watch(path, w)) {
+      std::vector<std::string> subdirs;
+      list_entries(fd, path, subdirs, w.back().files);
+      merge(w);
+      for (size_t i = 0; i < subdirs.size(); ++i) {
+	next.push_back(path + "/" + subdirs[i]);
+      }
+    }
+    close(fd);
+  }
+
+  void work()
+  {
+    WatchList w;
+    std::string path;
+    while (! __failed) {
+      pthread_mutex_lock(&__mutex);
+      if (__next >= __frontier.size()) {
+	pthread_mutex_unlock(&__mutex);
+	break;
+      }
+      path = __frontier[__next++];
+      pthread_mutex_unlock(&__mutex);
+
+      int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) {
+	fail(std::string("Failed to open dir ") + path);
+	break;
+      }
+      walk(fd, path, w);
+      close(fd);
+    }
+    merge(w);
   }
+
+ private:
+  FamReactor            *__reactor;
+  FileAlterationMonitor *__client;
+  uint32_t               __mask;
+  const FamPathFilter   &__filter;
+  size_t                 __rootlen;
+  unsigned int           __num_workers;
+
+  pthread_mutex_t           __mutex;
+  std::vector<std::string>  __frontier;
+  size_t                    __next;
+  WatchList                 __watched;
+  volatile bool             __failed;
+  std::string               __error;
+};
+/// @endcond
 #endif
-}
 
 
 /** Watch a directory.
- * This adds the given directory recursively to this FAM.
+ * This adds the given directory recursively to this FAM. Wide trees are
+ * scanned by several threads in parallel.
  * @param dirpath path to directory to add
  */
 void
 FileAlterationMonitor::watch_dir(const char *dirpath)
+{
+  watch_dir(dirpath, __backend);
+}
+
+
+/** Watch a directory with a specific backend.
+ * Directories are counted, watching the same directory again only
+ * requires an additional unwatch_dir() and keeps the backend chosen
+ * first. Trees may overlap, a directory below another watched directory
+ * is watched only once and stays watched as long as any directory
+ * containing it is. Relative paths used for filters are relative to the
+ * outermost watched directory.
+ * @param dirpath path to directory to add
+ * @param backend backend to use for this directory and everything below
+ */
+void
+FileAlterationMonitor::watch_dir(const char *dirpath, Backend backend)
+{
+  __roots.push_back(dirpath);
+  std::map<std::string, TreeRoot>::iterator t = __tree_roots.find(dirpath);
+  if (t != __tree_roots.end()) {
+    ++t->second.refs;
+    return;
+  }
+
+  TreeRoot root;
+  root.refs   = 1;
+  root.polled = (select_backend(dirpath, backend) == BACKEND_POLL);
+  if (root.polled) {
+    __poller->add_dir(dirpath, strlen(dirpath) + 1);
+  } else {
+    try {
+      watch_tree(dirpath, strlen(dirpath) + 1, false);
+    } catch (Exception &e) {
+      __roots.erase(std::find(__roots.begin(), __roots.end(), dirpath));
+      throw;
+    }
+  }
+  __tree_roots[dirpath] = root;
+}
+
+
+/** Set default backend.
+ * The backend is used for all paths watched with watch_dir() or
+ * watch_file() without an explicit backend from now on. Paths that are
+ * already watched keep their backend.
+ * @param backend default backend
+ */
+void
+FileAlterationMonitor::set_backend(Backend backend)
+{
+  __backend = backend;
+}
+
+
+/** Set poll interval.
+ * Paths watched by polling are checked once per interval. Each call to
+ * process_events() spends at most the given time budget on polling, a
+ * round over large trees is spread over several calls.
+ * @param interval_ms time in milliseconds between two rounds
+ * @param budget_us time budget in microseconds per call
+ */
+void
+FileAlterationMonitor::set_poll_interval(unsigned int interval_ms, unsigned int budget_us)
+{
+  __poller->set_interval(interval_ms);
+  __poller->set_budget(budget_us);
+}
+
+
+/** Decide which backend to use for a path.
+ * @param path path to watch
+ * @param backend requested backend
+ * @return BACKEND_POLL or BACKEND_INOTIFY
+ */
+FileAlterationMonitor::Backend
+FileAlterationMonitor::select_backend(const char *path, Backend backend)
 {
 #ifdef HAVE_INOTIFY
-  DIR *d = opendir(dirpath);
-  if ( d == NULL ) {
-    throw Exception(std::string("Failed to open dir ") + dirpath);
+  if (backend != BACKEND_AUTO)  return backend;
+
+  struct statfs sfs;
+  if (statfs(path, &sfs) != 0)  return BACKEND_INOTIFY;
+
+  // file systems where changes may be made by other hosts, and overlay
+  // mounts, where inotify misses changes made directly to a lower layer
+  switch ((unsigned long)sfs.f_type & 0xFFFFFFFFUL) {
+  case 0x6969UL:	// NFS
+  case 0x517BUL:	// SMB
+  case 0xFF534D42UL:	// CIFS
+  case 0xFE534D42UL:	// SMB2
+  case 0x01021997UL:	// 9P
+  case 0x5346414FUL:	// AFS
+  case 0x73757245UL:	// Coda
+  case 0x794C7630UL:	// overlayfs
+    return BACKEND_POLL;
+  default:
+    return BACKEND_INOTIFY;
   }
+#else
+  return BACKEND_POLL;
+#endif
+}
 
-  uint32_t mask = IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_DELETE_SELF;
-  int iw;
 
-  //LibLogger::log_debug("FileAlterationMonitor", "Adding watch for %s", dirpath);
-  if ( (iw = inotify_add_watch(__inotify_fd, dirpath, mask)) >= 0) {
-    __inotify_watches[iw] = dirpath;
+/** Watch a directory tree.
+ * @param dirpath path to directory to add
+ * @param rootlen length of the prefix of dirpath which is stripped to
+ * form the relative paths of events below this tree, including the
+ * trailing slash
+ * @param synthesize true to post create events for all files found in
+ * the tree, used for trees that appeared without us seeing their files
+ */
+void
+FileAlterationMonitor::watch_tree(const char *dirpath, size_t rootlen, bool synthesize)
+{
+#ifdef HAVE_INOTIFY
+  FamTreeScanner scanner(__reactor, this, __watch_mask, __filter, rootlen);
+  scanner.scan(dirpath);
 
-    dirent de, *res;
-    while ( (readdir_r(d, &de, &res) == 0) && (res != NULL) ) {
-      std::string fp = std::string(dirpath) + "/" + de.d_name;
-      struct stat st;
-      if ( stat(fp.c_str(), &st) == 0 ) {
-	if ( (de.d_name[0] != '.') && S_ISDIR(st.st_mode) ) {
-	  try {
-	    watch_dir(fp.c_str());
-	  } catch (Exception &e) {
-	    closedir(d);
-	    throw;
-	  }
-	//} else {
-	  //LibLogger::log_debug("SkillerExecutionThread", "Skipping file %s", fp.c_str());	  
-	}
-      } else {
-	//LibLogger::log_debug("FileAlterationMonitor",
-	//		     "Skipping watch on %s, cannot stat (%s)",
-	//		     fp.c_str(), strerror(errno));
+  // watches added before a failure are kept, just like before
+  const std::vector<FamTreeScanner::ScannedDir> &watched = scanner.watched();
+  for (size_t i = 0; i < watched.size(); ++i) {
+    WatchInfo &info = insert_watch(watched[i].wd);
+    // a directory in overlapping trees belongs to the outermost one
+    if (! info.recursive || (rootlen < info.rootlen))  info.rootlen = rootlen;
+    info.path    = watched[i].path;
+    info.recursive = true;
+    info.dir_id  = intern_dir(info.path);
+    info.files.clear();
+    info.files.insert(watched[i].files.begin(), watched[i].files.end());
+    if (__content_hashing)  fingerprint_dir(info);
+    if (synthesize) {
+      for (size_t f = 0; f < watched[i].files.size(); ++f) {
+	post_event(info.dir_id, watched[i].files[f].c_str(), IN_CREATE);
       }
     }
-  } else {
-    throw Exception(std::string("Cannot add watch for ") + dirpath);
   }
 
-  closedir(d);
+  if (scanner.failed()) {
+    throw Exception(scanner.error());
+  }
 #endif
 }
 
@@ -214,222 +682,1912 @@ FileAlterationMonitor::watch_dir(const char *dirpath)
 void
 FileAlterationMonitor::watch_file(const char *filepath)
 {
-#ifdef HAVE_INOTIFY
-  uint32_t mask = IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_DELETE_SELF;
-  int iw;
+  watch_file(filepath, __backend);
+}
 
-  //LibLogger::log_debug("FileAlterationMonitor", "Adding watch for %s", dirpath);
-  if ( (iw = inotify_add_watch(__inotify_fd, filepath, mask)) >= 0) {
-    __inotify_watches[iw] = filepath;
-  } else {
+
+/** Watch a file with a specific backend.
+ * The file is not watched itself, its parent directory is watched for
+ * events regarding the file's name. Thus the watch persists if the file
+ * is replaced, for example by editors or deploy tools that write a new
+ * file and rename it to the old name, and many files in one directory
+ * share a single kernel watch. The filters of this monitor do not apply
+ * to explicitly watched files.
+ * @param filepath path to file to add
+ * @param backend backend to use for this file
+ */
+void
+FileAlterationMonitor::watch_file(const char *filepath, Backend backend)
+{
+  const char *slash = strrchr(filepath, '/');
+  __roots.push_back(std::string(filepath, slash ? slash - filepath : 0));
+  if (select_backend(filepath, backend) == BACKEND_POLL) {
+    __poller->add_file(filepath);
+    return;
+  }
+#ifdef HAVE_INOTIFY
+  struct stat st;
+  WatchInfo *info = NULL;
+  std::string dir = slash ? std::string(filepath, (slash > filepath) ? slash - filepath : 1) : ".";
+  if ( (stat(filepath, &st) != 0) || ((info = watch_parent(dir)) == NULL) ) {
     throw Exception(std::string("Cannot add watch for file ") + filepath);
   }
+  const char *name = slash ? slash + 1 : filepath;
+  info->file_names.insert(name);
+  info->files.insert(name);
 #endif
 }
 
 
-/** Add a filter.
- * Filters are applied to path names that triggered an event. All
- * pathnames are checked against this regex and if any does not match
- * the event is not posted to listeners.
- * An example regular expression is
- * @code
- * ^[^.].*\\.lua$
- * @endcode
- * This regular expression matches to all files that does not start with
- * a dot and have an .lua ending.
- * @param regex regular expression to add
+/** Watch the parent directory of files.
+ * @param dirpath path of the directory
+ * @return watch of the directory, possibly shared with a recursive watch
+ * or other files, NULL if the directory cannot be watched
  */
-void
-FileAlterationMonitor::add_filter(const char *regex)
+FileAlterationMonitor::WatchInfo *
+FileAlterationMonitor::watch_parent(const std::string &dirpath)
 {
-  int regerr = 0;
-  regex_t *rx = (regex_t *)malloc(sizeof(regex_t));
-  if ( (regerr = regcomp(rx, regex, REG_EXTENDED)) != 0 ) {
-    char errtmp[1024];
-    regerror(regerr, rx, errtmp, sizeof(errtmp));
-    free(rx);
-    throw Exception(std::string("Failed to compile lua file regex: ") + errtmp);
+#ifdef HAVE_INOTIFY
+  int wd;
+  if ( (wd = __reactor->add_watch(dirpath.c_str(), __watch_mask | IN_ONLYDIR, this)) < 0) {
+    return NULL;
+  }
+  WatchInfo *info = find_watch(wd);
+  if (info == NULL) {
+    info = &insert_watch(wd);
+    info->path      = dirpath;
+    info->rootlen   = dirpath.length() + 1;
+    info->recursive = false;
+    info->dir_id    = intern_dir(dirpath);
   }
-  __regexes.push_back(rx);
+  return info;
+#else
+  return NULL;
+#endif
 }
 
 
-/** Add a listener.
- * @param listener listener to add
+/** Find a watch.
+ * @param wd watch descriptor
+ * @return watch with the given descriptor, NULL if this monitor does not
+ * hold such a watch
  */
-void
-FileAlterationMonitor::add_listener(FamListener *listener)
+FileAlterationMonitor::WatchInfo *
+FileAlterationMonitor::find_watch(int wd)
 {
-  __listeners.push_back(listener);
+  std::map<int, unsigned int>::iterator s = __watch_slots.find(wd);
+  if (s == __watch_slots.end())  return NULL;
+  return &__inotify_watches[s->second];
 }
 
 
-/** Remove a listener.
- * @param listener listener to remove
+/** Insert a watch.
+ * Watches are kept in a table of slots, indexed by a map from watch
+ * descriptor to slot. Descriptors cannot be used as index directly, the
+ * kernel hands them out process-wide and does not reuse them, so the
+ * table would grow with every watch ever added by any monitor. Slots of
+ * dropped watches are reused, the table only grows to the largest number
+ * of watches held at once. Note that growing the table invalidates
+ * references to other watches.
+ * @param wd watch descriptor
+ * @return watch with the given descriptor, fields other than the
+ * descriptor are empty if it did not exist before
  */
-void
-FileAlterationMonitor::remove_listener(FamListener *listener)
+FileAlterationMonitor::WatchInfo &
+FileAlterationMonitor::insert_watch(int wd)
 {
-  __listeners.remove(listener);
+  std::map<int, unsigned int>::iterator s = __watch_slots.find(wd);
+  if (s != __watch_slots.end())  return __inotify_watches[s->second];
+
+  unsigned int slot;
+  if (! __free_watch_slots.empty()) {
+    slot = __free_watch_slots.back();
+    __free_watch_slots.pop_back();
+  } else {
+    WatchInfo unused;
+    unused.wd        = -1;
+    unused.rootlen   = 0;
+    unused.dir_id    = 0;
+    unused.recursive = false;
+    slot = __inotify_watches.size();
+    __inotify_watches.push_back(unused);
+  }
+  __watch_slots[wd] = slot;
+  ++__num_inotify_watches;
+
+  WatchInfo &info = __inotify_watches[slot];
+  info.wd = wd;
+  return info;
 }
 
 
-/** Process events.
- * Call this when you want file events to be processed.
- * @param timeout timeout in milliseconds to wait for an event, 0 to just check
- * and no wait, -1 to wait forever until an event is received
+/** Drop a watch.
+ * The slot of the watch is cleared and may be reused, fingerprints of
+ * its files are forgotten.
+ * @param info watch to drop
+ * @param rm_watch true to release the kernel watch, false if the kernel
+ * has already removed it
  */
 void
-FileAlterationMonitor::process_events(int timeout)
+FileAlterationMonitor::drop_watch(WatchInfo &info, bool rm_watch)
 {
+  if (info.wd < 0)  return;
 #ifdef HAVE_INOTIFY
-  // Check for inotify events
-  __interrupted = false;
-  pollfd ipfd[2];
-  ipfd[0].fd = __inotify_fd;
-  ipfd[0].events = POLLIN;
-  ipfd[0].revents = 0;
-  ipfd[1].fd = __pipe_fds[0];
-  ipfd[1].events = POLLIN;
-  ipfd[1].revents = 0;
-  int prv = poll(ipfd, 2, timeout);
-  if ( prv == -1 ) {
-    if ( errno != EINTR ) {
-#ifndef USE_ROS
-      LibLogger::log_error("FileAlterationMonitor",
-			   "inotify poll failed: %s (%i)",
-			   strerror(errno), errno);
-#else
-      printf("FileAlterationMonitor: inotify poll failed: %s (%i)\n",
-	     strerror(errno), errno);
+  if (rm_watch)  __reactor->rm_watch(info.wd, this);
 #endif
-    } else {
-      __interrupted = true;
+  if (! __fingerprints.empty()) {
+    std::set<std::string>::iterator f;
+    for (f = info.files.begin(); f != info.files.end(); ++f) {
+      __fingerprints.erase(info.path + "/" + *f);
     }
-  } else while ( !__interrupted && (prv > 0) ) {
-    // Our fd has an event, we can read
-    if ( ipfd[0].revents & POLLERR ) {      
-      //LibLogger::log_error("FileAlterationMonitor", "inotify poll error");
-    } else if (__interrupted) {
-      // interrupted
-      return;
-    } else {
-      // must be POLLIN
-      int bytes = 0, i = 0;
-      if ((bytes = read(__inotify_fd, __inotify_buf, __inotify_bufsize)) != -1) {
-	while (!__interrupted && (i < bytes)) {
-	  struct inotify_event *event = (struct inotify_event *) &__inotify_buf[i];
-
-	  bool valid = true;
-	  if (! (event->mask & IN_ISDIR)) {
-	    for (__rxit = __regexes.begin(); __rxit != __regexes.end(); ++__rxit) {
-	      if (event->len > 0 && regexec(*__rxit, event->name, 0, NULL, 0) == REG_NOMATCH ) {
-		//LibLogger::log_debug("FileAlterationMonitor", "A regex did not match for %s", event->name);
-		valid = false;
-		break;
-	      }
-	    }
-	  }
-
-	  /*
-	  if (event->mask & IN_MODIFY) {
-	    printf("FileAlterationMonitor: %s has been modified\n", event->len > 0 ? event->name : "?");
-	  }
-	  if (event->mask & IN_MOVE) {
-	    printf("FileAlterationMonitor: %s has been moved\n", event->len > 0 ? event->name : "?");
-	  }
-	  if (event->mask & IN_DELETE) {
-	    printf("FileAlterationMonitor: %s has been deleted\n", event->len > 0 ? event->name : "?");
-	  }
-	  if (event->mask & IN_CREATE) {
-	    printf("FileAlterationMonitor: %s has been created\n", event->len > 0 ? event->name : "?");
-	  }
-	  */
-
-	  if ( valid ) {
-	    for (__lit = __listeners.begin(); __lit != __listeners.end(); ++__lit) {
-	      (*__lit)->fam_event(event->len > 0 ? event->name : "?", event->mask);
-	    }
-	  }
+  }
+  __watch_slots.erase(info.wd);
+  __free_watch_slots.push_back(&info - &__inotify_watches[0]);
+  info.wd = -1;
+  info.path.clear();
+  info.rootlen   = 0;
+  info.dir_id    = 0;
+  info.recursive = false;
+  info.names.clear();
+  info.file_names.clear();
+  info.files.clear();
+  --__num_inotify_watches;
+}
 
-	  if (event->mask & IN_DELETE_SELF) {
-	    //LibLogger::log_debug("FileAlterationMonitor", "Watched %s has been deleted", event->name);
-	    __inotify_watches.erase(event->wd);
-	    inotify_rm_watch(__inotify_fd, event->wd);
-	  }
 
-	  if (event->mask & IN_CREATE && event->len > 0) {
-	    // Check if it is a directory, if it is, watch it
-	    std::string fp = __inotify_watches[event->wd] + "/" + event->name;
-	    if (  (event->mask & IN_ISDIR) && (event->name[0] != '.') ) {
-	      /*
-	      LibLogger::log_debug("FileAlterationMonitor",
-				   "Directory %s has been created, "
-				   "adding to watch list", event->name);
-	      */
-	      try {
-		watch_dir(fp.c_str());
-	      } catch (Exception &e) {
-		//LibLogger::log_warn("FileAlterationMonitor", "Adding watch for %s failed, ignoring.", fp.c_str());
-		//LibLogger::log_warn("FileAlterationMonitor", e);
-	      }
-	    }
-	  }
+/** Remove the watches of a directory tree.
+ * @param dirpath path of the root of the tree
+ * @param keep_names true to keep the watches of directories in the tree
+ * which are still part of another watched tree, or also have files
+ * watched explicitly, only without reporting their other files anymore,
+ * false to drop all watches in the tree
+ */
+void
+FileAlterationMonitor::unwatch_tree(const std::string &dirpath, bool keep_names)
+{
+  for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+    WatchInfo &info = __inotify_watches[i];
+    if ( (info.wd < 0) ||
+	 (info.path.compare(0, dirpath.length(), dirpath) != 0) ||
+	 ((info.path.length() > dirpath.length()) && (info.path[dirpath.length()] != '/')) )
+    {
+      continue;
+    }
 
-	  i += sizeof(struct inotify_event) + event->len;
+    size_t covered;
+    if (keep_names && ! info.recursive) {
+      // not part of the tree, only shares a path with it
+      continue;
+    } else if (keep_names && ((covered = tree_root_length(info.path)) > 0)) {
+      // still in another watched tree
+      info.rootlen = covered;
+    } else if (keep_names && (! info.names.empty() || ! info.file_names.empty())) {
+      info.recursive = false;
+      std::set<std::string>::iterator f = info.files.begin();
+      while (f != info.files.end()) {
+	if (! name_watched(info, f->c_str())) {
+	  __fingerprints.erase(info.path + "/" + *f);
+	  info.files.erase(f++);
+	} else {
+	  ++f;
 	}
-      } else {
-	//LibLogger::log_error("FileAlterationMonitor", "inotify failed to read any bytes");
       }
+    } else {
+      drop_watch(info, true);
     }
-
-    prv = poll(ipfd, 2, 0);
   }
-#else
-  //LibLogger::log_error("FileAlterationMonitor",
-  //		       "inotify support not available, but "
-  //		       "process_events() was called. Ignoring.");
-#endif
 }
 
 
-/** Interrupt a running process_events().
- * This method will interrupt e.g. a running inifinetly blocking call of
- * process_events().
+/** Stop watching a directory.
+ * Removes the watches of a directory tree added with watch_dir(), once
+ * it has been unwatched as often as it has been watched. No events are
+ * posted for the files that are no longer watched. Directories that
+ * are also part of another watched tree, and files in the tree which
+ * are watched explicitly with watch_file() or watch_files(), are still
+ * reported.
+ * @param dirpath path of the directory as passed to watch_dir()
  */
 void
-FileAlterationMonitor::interrupt()
+FileAlterationMonitor::unwatch_dir(const char *dirpath)
 {
-  if (__interruptible) {
-    __interrupted = true;
-    char tmp = 0;
-    if (write(__pipe_fds[1], &tmp, 1) != 1) {
-      throw Exception("Failed to interrupt file alteration monitor,"
-		      " failed to write to pipe");
+  std::vector<std::string>::iterator r = std::find(__roots.begin(), __roots.end(), dirpath);
+  if (r != __roots.end())  __roots.erase(r);
+
+  std::map<std::string, TreeRoot>::iterator t = __tree_roots.find(dirpath);
+  if (t != __tree_roots.end()) {
+    if (--t->second.refs > 0)  return;
+    bool polled = t->second.polled;
+    __tree_roots.erase(t);
+    if (polled) {
+      __poller->remove_dir(dirpath);
+      return;
     }
-  } else {
-    throw Exception("Currently not interruptible");
+  } else if (__poller->remove_dir(dirpath)) {
+    return;
   }
+  unwatch_tree(dirpath, true);
 }
 
 
-/** @class FamListener <utils/system/fam.h>
- * File Alteration Monitor Listener.
- * Listener called by FileAlterationMonitor for events.
- * @author Tim Niemueller
- *
- * @fn FamListener::fam_event(const char *filename, unsigned int mask)
- * Event has been raised.
- * @param filename name of the file that triggered the event
- * @param mask mask indicating the event. Currently inotify event flags
- * are used, see inotify.h.
- *
+/** Get length of the outermost watched tree containing a directory.
+ * Only trees watched through inotify are considered.
+ * @param path path of the directory
+ * @return length of the root of the tree including the trailing slash,
+ * 0 if the directory is not in any tree
  */
+size_t
+FileAlterationMonitor::tree_root_length(const std::string &path) const
+{
+  size_t rootlen = 0;
+  std::map<std::string, TreeRoot>::const_iterator t;
+  for (t = __tree_roots.begin(); t != __tree_roots.end(); ++t) {
+    const std::string &root = t->first;
+    if ( ! t->second.polled && ((rootlen == 0) || (root.length() < rootlen)) &&
+	 (path.compare(0, root.length(), root) == 0) &&
+	 ((path.length() == root.length()) || (path[root.length()] == '/')) )
+    {
+      rootlen = root.length() + 1;
+    }
+  }
+  return rootlen;
+}
 
-/** Virtual empty destructor. */
-FamListener::~FamListener()
+
+/** Stop watching a file.
+ * Removes a file added with watch_file(). The watch of its parent
+ * directory is released unless other files or a tree are watched in it.
+ * @param filepath path of the file as passed to watch_file()
+ */
+void
+FileAlterationMonitor::unwatch_file(const char *filepath)
 {
+  const char *slash = strrchr(filepath, '/');
+  std::string root(filepath, slash ? slash - filepath : 0);
+  std::vector<std::string>::iterator r = std::find(__roots.begin(), __roots.end(), root);
+  if (r != __roots.end())  __roots.erase(r);
+
+  if (__poller->remove_file(filepath))  return;
+
+  std::string dir = slash ? std::string(filepath, (slash > filepath) ? slash - filepath : 1) : ".";
+  const char *name = slash ? slash + 1 : filepath;
+  for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+    WatchInfo &info = __inotify_watches[i];
+    if ( (info.wd < 0) || (info.path != dir) ||
+	 (info.file_names.find(name) == info.file_names.end()) )
+    {
+      continue;
+    }
+
+    info.file_names.erase(name);
+    if (! info.recursive && info.names.empty() && info.file_names.empty()) {
+      drop_watch(info, true);
+    } else if (! name_watched(info, name)) {
+      __fingerprints.erase(filepath);
+      info.files.erase(name);
+    }
+  }
+}
+
+
+/** Watch a set of files.
+ * Only the given files are watched, replacing the set passed on the
+ * previous call. Instead of one watch per file the parent directory of
+ * each file is watched, without subdirectories, and events are restricted
+ * to the names of the given files, so a file that is replaced or created
+ * later is still noticed. The filters of this monitor apply as usual.
+ * Directories which are also watched with watch_dir() keep reporting all
+ * of their files. Files in directories that do not exist are ignored.
+ * @param filepaths paths of the files to watch
+ */
+void
+FileAlterationMonitor::watch_files(const std::set<std::string> &filepaths)
+{
+#ifdef HAVE_INOTIFY
+  std::map<std::string, std::set<std::string> > wanted;
+  std::set<std::string>::const_iterator f;
+  for (f = filepaths.begin(); f != filepaths.end(); ++f) {
+    std::string::size_type slash = f->rfind('/');
+    if (slash == std::string::npos) {
+      wanted["."].insert(*f);
+    } else {
+      wanted[f->substr(0, (slash > 0) ? slash : 1)].insert(f->substr(slash + 1));
+    }
+  }
+
+  // update or drop the name sets of directories already watched
+  std::map<std::string, std::set<std::string> >::iterator w;
+  for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+    WatchInfo &info = __inotify_watches[i];
+    if ( (info.wd < 0) || info.names.empty() ) {
+      continue;
+    } else if ( (w = wanted.find(info.path)) != wanted.end() ) {
+      info.names.swap(w->second);
+      wanted.erase(w);
+    } else if (info.recursive || ! info.file_names.empty()) {
+      info.names.clear();
+    } else {
+      drop_watch(info, true);
+    }
+  }
+
+  for (w = wanted.begin(); w != wanted.end(); ++w) {
+    WatchInfo *info = watch_parent(w->first);
+    if (info == NULL)  continue;
+
+    info->names.swap(w->second);
+    struct stat st;
+    for (f = info->names.begin(); f != info->names.end(); ++f) {
+      if (stat((w->first + "/" + *f).c_str(), &st) == 0)  info->files.insert(*f);
+    }
+    if (__content_hashing)  fingerprint_dir(*info);
+  }
+#endif
+}
+
+
+/** Start recording events.
+ * All events seen by this monitor are written to the given file, before
+ * they are filtered, coalesced or hashed, including events of polled
+ * paths. The recording can be fed into a monitor with replay() later,
+ * see FamEventRecorder for the file format. A recording in progress is
+ * stopped first.
+ * @param filename name of the file to write
+ */
+void
+FileAlterationMonitor::start_recording(const char *filename)
+{
+  stop_recording();
+  __recorder = new FamEventRecorder(filename);
+}
+
+
+/** Stop recording events.
+ * Flushes and closes the recording, if any.
+ */
+void
+FileAlterationMonitor::stop_recording()
+{
+  delete __recorder;
+  __recorder = NULL;
+}
+
+
+/** Replay recorded events.
+ * The events of a recording made with start_recording() are posted
+ * from process_events() or dispatch_events() as if they had been read
+ * from the kernel, subject to the current filters, coalescing and
+ * content hashing. A replayed queue overflow resynchronizes the watched
+ * trees just like a live one. A replay in progress is aborted first.
+ * @param filename name of the recording
+ * @param speed factor by which the original timing is sped up, 0 or
+ * less to replay as fast as possible
+ */
+void
+FileAlterationMonitor::replay(const char *filename, double speed)
+{
+  delete __player;
+  __player = NULL;
+  __player = new FamEventPlayer(this, filename, speed);
+}
+
+
+/** Check if a replay is in progress.
+ * @return true if events of a recording remain to be replayed
+ */
+bool
+FileAlterationMonitor::replaying() const
+{
+  return __player && ! __player->finished();
+}
+
+
+/** Account for a raw event.
+ * Counts the event and writes it to the recording, if any.
+ * @param dir_id interned path of the watch the event occured on
+ * @param name name of the file, empty for events on the watch itself
+ * @param mask event mask
+ */
+void
+FileAlterationMonitor::account_event(unsigned int dir_id, const char *name,
+				     unsigned int mask)
+{
+  ++__stats.num_read;
+  if (mask & FamListener::FAM_Q_OVERFLOW) {
+    ++__stats.num_overflow;
+  } else if (mask & (FamListener::FAM_CREATE | FamListener::FAM_MOVED_TO)) {
+    ++__stats.num_create;
+  } else if (mask & (FamListener::FAM_DELETE | FamListener::FAM_MOVED_FROM)) {
+    ++__stats.num_delete;
+  } else if (mask & FamListener::FAM_MODIFY) {
+    ++__stats.num_modify;
+  } else if (mask & (FamListener::FAM_DELETE_SELF | FamListener::FAM_MOVE_SELF |
+		     FamListener::FAM_IGNORED | FamListener::FAM_UNMOUNT))
+  {
+    ++__stats.num_self;
+  } else {
+    ++__stats.num_other;
+  }
+
+  if (__recorder == NULL)  return;
+  if (! __recorder->knows_dir(dir_id)) {
+    const std::string &path = __dir_paths[dir_id];
+    size_t rootlen = root_length(path.c_str());
+    __recorder->record_dir(dir_id, path, (rootlen > 0) ? rootlen : path.length() + 1);
+  }
+  __recorder->record(dir_id, name, mask);
+}
+
+
+/** Post a replayed event.
+ * The filters are applied like for events read from the kernel, queue
+ * overflows resynchronize the watched trees like in process_queue().
+ * @param dirpath path of the watch the event occured on
+ * @param rootlen length of the prefix of dirpath which is stripped to
+ * form relative paths, including the trailing slash
+ * @param name name of the file, empty for events on the watch itself
+ * @param mask event mask
+ */
+void
+FileAlterationMonitor::replay_event(const std::string &dirpath, size_t rootlen,
+				    const char *name, unsigned int mask)
+{
+#ifdef HAVE_INOTIFY
+  unsigned int dir_id = intern_dir(dirpath);
+  account_event(dir_id, name, mask);
+  if (mask & IN_Q_OVERFLOW) {
+    ++__num_overflows;
+    post_event(dir_id, name, mask);
+    resync();
+    return;
+  }
+
+  if ( (name[0] != 0) && ! (mask & IN_ISDIR) && ! __filter.empty() ) {
+    const char *relpath = NULL;
+    if (__filter.needs_path()) {
+      if (rootlen < dirpath.length()) {
+	__relpath.assign(dirpath, rootlen, std::string::npos);
+	__relpath.append(1, '/').append(name);
+      } else {
+	__relpath.assign(name);
+      }
+      relpath = __relpath.c_str();
+    }
+    if (! __filter.matches(name, relpath)) {
+      ++__stats.num_filtered;
+      return;
+    }
+  }
+  post_event(dir_id, name, mask);
+#endif
+}
+
+
+/** Add a filter.
+ * Filters are applied to path names that triggered an event. All
+ * pathnames are checked against this regex and if any does not match
+ * the event is not posted to listeners.
+ * An example regular expression is
+ * @code
+ * ^[^.].*\\.lua$
+ * @endcode
+ * This regular expression matches to all files that does not start with
+ * a dot and have an .lua ending. Simple expressions like this one are
+ * compiled into string comparisons, see FamPathFilter.
+ * @param regex regular expression to add
+ */
+void
+FileAlterationMonitor::add_filter(const char *regex)
+{
+  __filter.add_required_regex(regex);
+}
+
+
+/** Add an include filter.
+ * If include filters have been added an event is only posted if the
+ * file matches at least one of them.
+ * @param pattern glob pattern, matched against the file name, or against
+ * the path relative to the watched directory if it contains a slash
+ */
+void
+FileAlterationMonitor::add_include_filter(const char *pattern)
+{
+  __filter.add_include(pattern);
+}
+
+
+/** Add an exclude filter.
+ * Events for files matching any exclude filter are not posted.
+ * @param pattern glob pattern, matched against the file name, or against
+ * the path relative to the watched directory if it contains a slash
+ */
+void
+FileAlterationMonitor::add_exclude_filter(const char *pattern)
+{
+  __filter.add_exclude(pattern);
+}
+
+
+/** Add a listener.
+ * The listener receives all events this monitor watches for. That are
+ * modifications, moves, creation and deletion, and any other events
+ * requested by listeners added with an explicit mask. It does not make
+ * the kernel report additional events, as reporting every access to the
+ * watched files would flood a monitor watching a whole tree.
+ * @param listener listener to add
+ */
+void
+FileAlterationMonitor::add_listener(FamListener *listener)
+{
+  __listeners.push_back(ListenerInfo());
+  ListenerInfo &li = __listeners.back();
+  li.listener = listener;
+  li.mask     = FamListener::FAM_ALL_EVENTS;
+  li.routed   = false;
+}
+
+
+/** Add a listener for specific events.
+ * The listener only receives events that have any of the bits in mask
+ * set and, for events on files, whose file passes the given filter in
+ * addition to the filters of this monitor. Overflow, ignore and unmount
+ * events are always delivered. This way listeners interested in
+ * different files can share a single monitor, which then should have no
+ * filters of its own. Listeners with all events and no filter receive
+ * batches as they are, for the others each event is checked against
+ * their mask and filter.
+ *
+ * Events in the mask which are not watched for yet, for example
+ * FamListener::FAM_ATTRIB, FamListener::FAM_CLOSE_WRITE or
+ * FamListener::FAM_OPEN, are added to all existing and future watches of
+ * this monitor. Watches are never narrowed again when the listener is
+ * removed, the extra events are then just not delivered to it anymore.
+ * @param listener listener to add
+ * @param mask events the listener is interested in, FamListener::FAM_*
+ * constants, FamListener::FAM_ALL_EVENTS for all
+ * @param filter filter files must pass, it is copied, NULL to pass all
+ */
+void
+FileAlterationMonitor::add_listener(FamListener *listener, unsigned int mask,
+				    const FamPathFilter *filter)
+{
+  __listeners.push_back(ListenerInfo());
+  ListenerInfo &li = __listeners.back();
+  li.listener = listener;
+  li.mask     = mask & FamListener::FAM_ALL_EVENTS;
+  if (filter)  li.filter = *filter;
+  li.routed   = (li.mask != FamListener::FAM_ALL_EVENTS) || ! li.filter.empty();
+
+#ifdef HAVE_INOTIFY
+  uint32_t watch_mask = __watch_mask | fam_inotify_mask(li.mask);
+  if (watch_mask == __watch_mask)  return;
+  __watch_mask = watch_mask;
+
+  // the reactor adds to the mask of existing kernel watches
+  for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+    const WatchInfo &info = __inotify_watches[i];
+    if (info.wd < 0)  continue;
+    int wd = __reactor->add_watch(info.path.c_str(), __watch_mask, this);
+    if ( (wd >= 0) && (wd != info.wd) && (find_watch(wd) == NULL) ) {
+      // the directory has been replaced in the meantime, the old watch
+      // goes away with an ignore event, do not hold on to the new one
+      __reactor->rm_watch(wd, this);
+    }
+  }
+#endif
+}
+
+
+/** Remove a listener.
+ * @param listener listener to remove
+ */
+void
+FileAlterationMonitor::remove_listener(FamListener *listener)
+{
+  __lit = __listeners.begin();
+  while (__lit != __listeners.end()) {
+    if (__lit->listener == listener) {
+      __lit = __listeners.erase(__lit);
+    } else {
+      ++__lit;
+    }
+  }
+}
+
+
+/** Set quiet period for event coalescing.
+ * If a quiet period is set, events for a file are not posted
+ * immediately. Instead they are merged until no further event has been
+ * received for the file for the given time. Then a single event is posted
+ * which describes the net effect:
+ * - FAM_MODIFY | FAM_CONTENT_CHANGED if the file existed before and still
+ *   exists, e.g. after a series of modifications,
+ * - FAM_CREATE | FAM_CONTENT_CHANGED if it has been created or replaced by
+ *   renaming a temporary file over it (inotify does not tell these apart),
+ * - FAM_DELETE if it has been removed,
+ * - nothing at all if it has been created and removed again, as is
+ *   typical for temporary files.
+ * Events for directories and on watches themselves are never delayed.
+ * The timer is driven by process_events(), which waits no longer than
+ * until the next merged event is due if called with a timeout.
+ * @param quiet_period_ms quiet period in milliseconds, 0 to disable
+ * coalescing (the default)
+ */
+void
+FileAlterationMonitor::set_quiet_period(unsigned int quiet_period_ms)
+{
+  __quiet_period_ms = quiet_period_ms;
+  if (__quiet_period_ms == 0)  flush_coalesced(true);
+}
+
+
+/** Enable or disable content hashing.
+ * With content hashing the monitor keeps a fingerprint consisting of
+ * size, modification time and a 64 bit FNV-1a hash of the content of
+ * every file in the watched directories which passes the filters.
+ * Events for files whose content did not actually change, e.g. when an
+ * editor rewrites an unchanged buffer or a checkout writes identical
+ * files, are suppressed. Fingerprints are taken when enabling hashing
+ * and when watching directories, afterwards only files for which
+ * events are received are examined again. A file is only read if its
+ * size did not change and its modification time does not allow for a
+ * decision. Combine with set_quiet_period() to hash a file only once
+ * per burst of events.
+ * @param enabled true to enable content hashing, false to disable it
+ * and drop all fingerprints
+ */
+void
+FileAlterationMonitor::set_content_hashing(bool enabled)
+{
+  if (enabled && ! __content_hashing) {
+    __content_hashing = true;
+    for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+      if (__inotify_watches[i].wd >= 0)  fingerprint_dir(__inotify_watches[i]);
+    }
+  } else if (! enabled) {
+    __content_hashing = false;
+    __fingerprints.clear();
+  }
+}
+
+
+/** Get path of a file relative to the watched root.
+ * @param info watch the file resides in
+ * @param name name of the file
+ * @return relative path, valid until the next call
+ */
+const char *
+FileAlterationMonitor::relative_path(const WatchInfo &info, const char *name)
+{
+  if (info.rootlen < info.path.length()) {
+    __relpath.assign(info.path, info.rootlen, std::string::npos);
+    __relpath.append(1, '/').append(name);
+  } else {
+    __relpath.assign(name);
+  }
+  return __relpath.c_str();
+}
+
+
+/** Intern a directory path.
+ * Paths of watches are stored once and referenced by id from events, so
+ * that events do not need to carry copies of them.
+ * @param path path to intern
+ * @return id of the path, the same for equal paths
+ */
+unsigned int
+FileAlterationMonitor::intern_dir(const std::string &path)
+{
+  std::map<std::string, unsigned int>::iterator d = __dir_ids.find(path);
+  if (d != __dir_ids.end())  return d->second;
+
+  unsigned int dir_id = __dir_paths.size();
+  __dir_paths.push_back(path);
+  __dir_ids[path] = dir_id;
+  return dir_id;
+}
+
+
+/** Get interned directory path.
+ * @param dir_id id of the path, e.g. from FamEvent::dir_id
+ * @return path, valid for the lifetime of this monitor, empty string for
+ * unknown ids
+ */
+const char *
+FileAlterationMonitor::dir_path(unsigned int dir_id) const
+{
+  return (dir_id < __dir_paths.size()) ? __dir_paths[dir_id].c_str() : "";
+}
+
+
+/** Check if events for a name are wanted on a watch.
+ * @param info watch
+ * @param name name of the file or directory
+ * @return true if the watch is recursive or the name has been requested
+ * with watch_file() or watch_files()
+ */
+bool
+FileAlterationMonitor::name_watched(const WatchInfo &info, const char *name)
+{
+  return info.recursive || (info.names.find(name) != info.names.end()) ||
+    file_watched(info, name);
+}
+
+
+/** Check if a file has been watched explicitly.
+ * @param info watch of the parent directory
+ * @param name name of the file
+ * @return true if the file has been added with watch_file()
+ */
+bool
+FileAlterationMonitor::file_watched(const WatchInfo &info, const char *name)
+{
+  return ! info.file_names.empty() && (info.file_names.find(name) != info.file_names.end());
+}
+
+
+/** Take fingerprints of all files of a watched directory.
+ * Only files passing the filters are considered.
+ * @param info watched directory
+ */
+void
+FileAlterationMonitor::fingerprint_dir(const WatchInfo &info)
+{
+#ifdef HAVE_INOTIFY
+  DIR *d = opendir(info.path.c_str());
+  if (d == NULL)  return;
+
+  struct dirent *de;
+  while ( (de = readdir(d)) != NULL ) {
+    if ( (de->d_type != DT_REG) && (de->d_type != DT_UNKNOWN) && (de->d_type != DT_LNK) ) {
+      continue;
+    }
+    if ( (strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0) )  continue;
+    if (! name_watched(info, de->d_name))  continue;
+    if (! __filter.empty() && ! file_watched(info, de->d_name) &&
+	! __filter.matches(de->d_name,
+			   __filter.needs_path() ? relative_path(info, de->d_name) : NULL))
+    {
+      continue;
+    }
+    __fingerprint_path.assign(info.path).append(1, '/').append(de->d_name);
+    content_changed(__fingerprint_path, IN_CREATE);
+  }
+  closedir(d);
+#endif
+}
+
+
+/** Check if the content of a file has changed and update its fingerprint.
+ * @param path full path of the file
+ * @param mask mask of the event that occured for the file
+ * @return true if the content has changed or the file is new or gone,
+ * false if the content is the same as on the previous check
+ */
+bool
+FileAlterationMonitor::content_changed(const std::string &path, unsigned int mask)
+{
+#ifdef HAVE_INOTIFY
+  if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+    __fingerprints.erase(path);
+    return true;
+  }
+
+  struct stat st;
+  if ( (stat(path.c_str(), &st) != 0) || ! S_ISREG(st.st_mode) ) {
+    __fingerprints.erase(path);
+    return true;
+  }
+
+  std::map<std::string, Fingerprint>::iterator f = __fingerprints.find(path);
+  bool known = (f != __fingerprints.end());
+  if (known && (f->second.size != st.st_size))  {
+    // size differs, no need to compare the content, but hash for later
+    known = false;
+  }
+
+  if (known && (f->second.mtime_sec == st.st_mtim.tv_sec) &&
+      (f->second.mtime_nsec == st.st_mtim.tv_nsec) &&
+      (time(NULL) > st.st_mtim.tv_sec + 1))
+  {
+    // same size and modification time, and the fingerprint has not been
+    // taken in the same time granule as the last modification
+    return false;
+  }
+
+  uint64_t hash = 14695981039346656037ULL;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    __fingerprints.erase(path);
+    return true;
+  }
+  unsigned char buf[65536];
+  ssize_t bytes;
+  while ((bytes = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < bytes; ++i) {
+      hash = (hash ^ buf[i]) * 1099511628211ULL;
+    }
+  }
+  close(fd);
+
+  bool changed = ! known || (f->second.hash != hash);
+
+  Fingerprint &fp = (f != __fingerprints.end()) ? f->second : __fingerprints[path];
+  fp.size       = st.st_size;
+  fp.mtime_sec  = st.st_mtim.tv_sec;
+  fp.mtime_nsec = st.st_mtim.tv_nsec;
+  fp.hash       = hash;
+
+  return changed;
+#else
+  return true;
+#endif
+}
+
+
+/** Get pollable file descriptor.
+ * The descriptor becomes readable whenever events are pending for this
+ * monitor, be it from inotify or events read by another monitor. It can
+ * be added to an external poll(), select() or epoll loop, which then calls
+ * dispatch_events() once it is readable. Do not read from it.
+ *
+ * Merged events and polled paths are driven by time rather than by the
+ * descriptor, next_timeout() tells when dispatch_events() must be called
+ * at the latest even if the descriptor did not become readable.
+ * @return epoll file descriptor, -1 if not available
+ */
+int
+FileAlterationMonitor::fd() const
+{
+  return __epoll_fd;
+}
+
+
+/** Dispatch ready events.
+ * Reads and processes all pending events and calls the listeners without
+ * ever blocking. Call this when fd() is readable or the time returned by
+ * next_timeout() has passed.
+ */
+void
+FileAlterationMonitor::dispatch_events()
+{
+  process_events(0);
+}
+
+
+/** Get time until events must be dispatched.
+ * @return time in milliseconds after which dispatch_events() must be
+ * called even if fd() did not become readable, 0 if it should be called
+ * right away, -1 if there is nothing to wait for
+ */
+int
+FileAlterationMonitor::next_timeout()
+{
+  if (has_queued_events())  return 0;
+
+  int wait  = coalesce_wait();
+  int pwait = __poller->wait_time();
+  if ( (pwait >= 0) && ((wait < 0) || (pwait < wait)) )  wait = pwait;
+  int rwait = __player ? __player->wait_time() : -1;
+  if ( (rwait >= 0) && ((wait < 0) || (rwait < wait)) )  wait = rwait;
+  return wait;
+}
+
+
+/** Process events.
+ * Call this when you want file events to be processed.
+ * @param timeout timeout in milliseconds to wait for an event, 0 to just check
+ * and no wait, -1 to wait forever until an event is received
+ */
+void
+FileAlterationMonitor::process_events(int timeout)
+{
+#ifdef HAVE_INOTIFY
+  // Check for inotify events
+  pollfd ipfd[2];
+  // in threaded mode the reader thread reads, we only wait for its wakeup
+  ipfd[0].fd = __reader_running ? -1 : __reactor->fd();
+  ipfd[0].events = POLLIN;
+  ipfd[0].revents = 0;
+  ipfd[1].fd = __wakeup_fd;
+  ipfd[1].events = POLLIN;
+  ipfd[1].revents = 0;
+
+  long long start = fam_now_ms();
+  bool dispatched = false, active = false;
+  while (true) {
+    if (consume_interrupt()) {
+      // the wakeup of an interrupt issued before we started to wait has
+      // not been read, do not let it cut short the next call
+      fam_drain(__wakeup_fd);
+      break;
+    }
+
+    // another monitor might already have read events for us
+    bool queued = has_queued_events();
+    int wait = 0;
+    // events that were all suppressed leave nothing to wait for either
+    if (! queued && ! dispatched && ! (active && __pending.empty())) {
+      wait = timeout;
+      if (timeout > 0) {
+	long long left = start + timeout - fam_now_ms();
+	wait = (left > 0) ? (int)left : 0;
+      }
+      int cwait = coalesce_wait();
+      if ( (cwait >= 0) && ((wait < 0) || (cwait < wait)) )  wait = cwait;
+      int pwait = __poller->wait_time();
+      if ( (pwait >= 0) && ((wait < 0) || (pwait < wait)) )  wait = pwait;
+      int rwait = __player ? __player->wait_time() : -1;
+      if ( (rwait >= 0) && ((wait < 0) || (rwait < wait)) )  wait = rwait;
+    }
+
+    int prv = poll(ipfd, 2, wait);
+    if ( prv == -1 ) {
+      if ( errno != EINTR ) {
+#ifndef USE_ROS
+	LibLogger::log_error("FileAlterationMonitor",
+			     "inotify poll failed: %s (%i)",
+			     strerror(errno), errno);
+#else
+	printf("FileAlterationMonitor: inotify poll failed: %s (%i)\n",
+	       strerror(errno), errno);
+#endif
+      }
+      break;
+    }
+
+    if ( ipfd[1].revents & POLLIN ) {
+      // reset the wakeup counter, queued events are picked up below
+      fam_drain(__wakeup_fd);
+      if (consume_interrupt())  return;
+    }
+
+    // Our fd has an event, we can read
+    if ( ipfd[0].revents & POLLERR ) {
+      //LibLogger::log_error("FileAlterationMonitor", "inotify poll error");
+    } else if ( ipfd[0].revents & POLLIN ) {
+      __reactor->read_events(this);
+    }
+
+    bool polled = __poller->poll();
+    if (__player && __player->play())  polled = true;
+    bool processed = process_queue() || polled;
+    if (processed)  active = true;
+    flush_coalesced(false);
+    if (dispatch_batch())  dispatched = true;
+
+    if (! processed && ! queued && (prv <= 0)) {
+      // nothing happened, stop if done or the timeout has been reached,
+      // but keep waiting for merged events that are not yet due
+      if (dispatched || (timeout == 0))  break;
+      if (active && __pending.empty())   break;
+      if ((timeout > 0) && (fam_now_ms() - start >= timeout))  break;
+    }
+  }
+#else
+  //LibLogger::log_error("FileAlterationMonitor",
+  //		       "inotify support not available, but "
+  //		       "process_events() was called. Ignoring.");
+#endif
+}
+
+
+/** Process queued events.
+ * Applies the filters to all queued events, adds the events that passed
+ * to the current batch and updates watches for created and deleted
+ * directories.
+ * @return true if any events were queued, false otherwise
+ */
+bool
+FileAlterationMonitor::process_queue()
+{
+#ifdef HAVE_INOTIFY
+  pthread_mutex_lock(&__queue_mutex);
+  __queue_proc.swap(__queue);
+  pthread_mutex_unlock(&__queue_mutex);
+  if (__ring)  drain_ring();
+
+  if (__queue_proc.empty())  return false;
+
+  bool overflow = false;
+  size_t i = 0;
+  while (i < __queue_proc.size()) {
+    struct inotify_event *event = (struct inotify_event *) &__queue_proc[i];
+
+    WatchInfo *watch = find_watch(event->wd);
+    if ( (watch == NULL) && ! (event->mask & IN_Q_OVERFLOW) ) {
+      // the watch has been removed while events for it were queued
+      i += sizeof(struct inotify_event) + event->len;
+      continue;
+    }
+    account_event(watch ? watch->dir_id : 0, (event->len > 0) ? event->name : "",
+		  event->mask);
+
+    bool valid = true;
+    if ( (event->len > 0) && watch && ! name_watched(*watch, event->name) ) {
+      valid = false;
+    } else if ( (event->len > 0) && watch && file_watched(*watch, event->name) ) {
+      // explicitly watched files are not subject to filters
+      valid = true;
+    } else if (! (event->mask & IN_ISDIR) && (event->len > 0) && ! __filter.empty()) {
+      const char *relpath = NULL;
+      if (__filter.needs_path() && watch) {
+	relpath = relative_path(*watch, event->name);
+      }
+      valid = __filter.matches(event->name, relpath);
+      //if (! valid) LibLogger::log_debug("FileAlterationMonitor", "Filtered %s", event->name);
+    }
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      overflow = true;
+      ++__num_overflows;
+    }
+
+    if (! valid) {
+      ++__stats.num_filtered;
+    } else {
+      unsigned int dir_id = 0;
+      if (watch) {
+	dir_id = watch->dir_id;
+
+	// keep the snapshot used for resynchronization up to date
+	if ( (event->len > 0) && ! (event->mask & IN_ISDIR) ) {
+	  if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+	    watch->files.insert(event->name);
+	  } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+	    watch->files.erase(event->name);
+	  }
+	}
+      }
+      post_event(dir_id, (event->len > 0) ? event->name : "", event->mask);
+    }
+
+    if ( (event->mask & IN_MOVED_FROM) && (event->mask & IN_ISDIR) && (event->len > 0) &&
+	 watch && watch->recursive )
+    {
+      // the kernel watches follow the directory to wherever it has been
+      // moved, stop watching it, it is watched again if it was moved to
+      // another place in the tree
+      unwatch_tree(watch->path + "/" + event->name, false);
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO) && event->len > 0) {
+      // Check if it is a directory, if it is, watch it. Directories moved
+      // into the tree bring their files along without any events for them.
+      if (  (event->mask & IN_ISDIR) && (event->name[0] != '.') &&
+	    watch && watch->recursive )
+      {
+	// watch_tree() may grow the watch table, watch is invalid afterwards
+	std::string fp = watch->path + "/" + event->name;
+	size_t rootlen = watch->rootlen;
+	watch = NULL;
+	/*
+	LibLogger::log_debug("FileAlterationMonitor",
+			     "Directory %s has been created, "
+			     "adding to watch list", event->name);
+	*/
+	try {
+	  watch_tree(fp.c_str(), rootlen, (event->mask & IN_MOVED_TO) != 0);
+	} catch (Exception &e) {
+	  //LibLogger::log_warn("FileAlterationMonitor", "Adding watch for %s failed, ignoring.", fp.c_str());
+	  //LibLogger::log_warn("FileAlterationMonitor", e);
+	}
+      }
+    }
+
+    if (event->mask & IN_DELETE_SELF) {
+      //LibLogger::log_debug("FileAlterationMonitor", "Watched %s has been deleted", event->name);
+      if ( (watch = find_watch(event->wd)) != NULL ) {
+	drop_watch(*watch, true);
+      }
+    } else if (event->mask & IN_MOVE_SELF) {
+      // directories in a tree are dropped when the parent reports them
+      // moved, only the root of a tree or a file's parent gets here
+      if ( ((watch = find_watch(event->wd)) != NULL) &&
+	   (watch->rootlen == watch->path.length() + 1) )
+      {
+	unwatch_tree(watch->path, false);
+      }
+    } else if (event->mask & IN_IGNORED) {
+      // the kernel has removed the watch, e.g. the file system was unmounted
+      if ( (watch = find_watch(event->wd)) != NULL ) {
+	drop_watch(*watch, false);
+      }
+    }
+
+    i += sizeof(struct inotify_event) + event->len;
+  }
+  __queue_proc.clear();
+
+  if (overflow) {
+    resync();
+  } else {
+    __last_sync = time(NULL);
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+/** Post an event that passed the filters.
+ * Events which change the content of a file are merged if coalescing
+ * is enabled, or dropped if content hashing shows that the file did not
+ * change. All other events, e.g. on attributes or opening a file, are
+ * added to the current batch right away.
+ * @param dir_id interned path of the watch the event occured on
+ * @param name name of the file, empty for events on the watch itself
+ * @param mask event mask
+ */
+void
+FileAlterationMonitor::post_event(unsigned int dir_id, const char *name,
+				  unsigned int mask)
+{
+#ifdef HAVE_INOTIFY
+  const uint32_t content = IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE;
+
+  ++__stats.num_posted;
+  if ( (name[0] == 0) || (mask & IN_ISDIR) || ! (mask & content) ) {
+    batch_event(dir_id, name, mask);
+  } else if (__quiet_period_ms > 0) {
+    coalesce_event(dir_id, name, mask);
+  } else if (__content_hashing) {
+    __fingerprint_path.assign(__dir_paths[dir_id]).append(1, '/').append(name);
+    if (content_changed(__fingerprint_path, mask)) {
+      batch_event(dir_id, name, mask);
+    }
+  } else {
+    batch_event(dir_id, name, mask);
+  }
+#endif
+}
+
+
+/** Resynchronize after events have been lost.
+ * Called after the kernel event queue overflowed. All watched directories
+ * are listed again and compared to the snapshot of files kept per watch.
+ * Create and delete events are posted for files that appeared or vanished,
+ * modify events for files that have been modified since the last
+ * consistent state. Directories that appeared are watched and their files
+ * reported, watches of directories that vanished are removed.
+ */
+void
+FileAlterationMonitor::resync()
+{
+#ifdef HAVE_INOTIFY
+  ++__num_rescans;
+
+  std::set<std::string> watched_dirs;
+  std::vector<int> wds;
+  for (size_t i = 0; i < __inotify_watches.size(); ++i) {
+    if (__inotify_watches[i].wd < 0)  continue;
+    watched_dirs.insert(__inotify_watches[i].path);
+    wds.push_back(__inotify_watches[i].wd);
+  }
+
+  // mtime has a granularity of one second on some file systems
+  time_t since = __last_sync - 1;
+  __last_sync = time(NULL);
+
+  for (size_t w = 0; w < wds.size(); ++w) {
+    WatchInfo *watch = find_watch(wds[w]);
+    if (watch == NULL)  continue;
+    WatchInfo &info = *watch;
+    std::set<std::string>::iterator f;
+
+    DIR *d = opendir(info.path.c_str());
+    if (d == NULL) {
+      for (f = info.files.begin(); f != info.files.end(); ++f) {
+	post_event(info.dir_id, f->c_str(), IN_DELETE);
+      }
+      std::string::size_type slash = info.path.rfind('/');
+      if (slash != std::string::npos) {
+	post_event(intern_dir(info.path.substr(0, slash)), info.path.c_str() + slash + 1,
+		   IN_DELETE | IN_ISDIR);
+      }
+      drop_watch(info, true);
+      continue;
+    }
+
+    std::set<std::string> current;
+    std::vector<std::string> new_dirs;
+    struct dirent *de;
+    while ( (de = readdir(d)) != NULL ) {
+      if ( (strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0) )  continue;
+
+      struct stat st;
+      bool have_stat = false;
+      bool is_dir = (de->d_type == DT_DIR);
+      if ( (de->d_type == DT_UNKNOWN) || (de->d_type == DT_LNK) ) {
+	have_stat = (fstatat(dirfd(d), de->d_name, &st, 0) == 0);
+	is_dir = have_stat && S_ISDIR(st.st_mode);
+      }
+
+      if (! name_watched(info, de->d_name)) {
+	continue;
+      } else if (is_dir) {
+	if ( (de->d_name[0] != '.') && info.recursive &&
+	     (watched_dirs.find(info.path + "/" + de->d_name) == watched_dirs.end()) )
+	{
+	  new_dirs.push_back(de->d_name);
+	}
+      } else if (__filter.empty() || file_watched(info, de->d_name) ||
+		 __filter.matches(de->d_name, __filter.needs_path()
+				  ? relative_path(info, de->d_name) : NULL))
+      {
+	current.insert(de->d_name);
+	if (info.files.find(de->d_name) == info.files.end()) {
+	  post_event(info.dir_id, de->d_name, IN_CREATE);
+	} else if ( (have_stat || (fstatat(dirfd(d), de->d_name, &st, 0) == 0)) &&
+		    (st.st_mtime >= since) )
+	{
+	  post_event(info.dir_id, de->d_name, IN_MODIFY);
+	}
+      }
+    }
+    closedir(d);
+
+    for (f = info.files.begin(); f != info.files.end(); ++f) {
+      if (current.find(*f) == current.end()) {
+	post_event(info.dir_id, f->c_str(), IN_DELETE);
+      }
+    }
+    info.files.swap(current);
+
+    std::string path = info.path;
+    size_t rootlen = info.rootlen;
+    unsigned int dir_id = info.dir_id;
+    for (size_t i = 0; i < new_dirs.size(); ++i) {
+      post_event(dir_id, new_dirs[i].c_str(), IN_CREATE | IN_ISDIR);
+      try {
+	watch_tree((path + "/" + new_dirs[i]).c_str(), rootlen, true);
+      } catch (Exception &e) {
+	//LibLogger::log_warn("FileAlterationMonitor", "Adding watch for %s failed, ignoring.", new_dirs[i].c_str());
+      }
+    }
+  }
+#endif
+}
+
+
+/** Get number of overflows.
+ * @return number of kernel event queue overflows this monitor has seen
+ */
+unsigned int
+FileAlterationMonitor::num_overflows() const
+{
+  return __num_overflows;
+}
+
+
+/** Get number of resynchronizations.
+ * @return number of times the watched trees have been rescanned after
+ * events had been lost
+ */
+unsigned int
+FileAlterationMonitor::num_rescans() const
+{
+  return __num_rescans;
+}
+
+
+/** Get statistics.
+ * Call from the thread processing events. Limits are read from /proc
+ * on every call, so do not call this for every event.
+ * @return snapshot of the statistics since the last reset
+ */
+FamStats
+FileAlterationMonitor::stats() const
+{
+  FamStats s = __stats;
+  s.seconds     = (fam_now_us() - __stats_start_us) / 1000000.;
+  s.num_pending = __pending.size();
+
+  __reactor->read_stats(s.read_bytes, s.max_pending_bytes);
+  s.pending_bytes      = __reactor->pending_bytes();
+  s.num_kernel_watches = __reactor->num_watches();
+  s.num_watches        = __num_inotify_watches;
+  s.num_polled_dirs    = __poller->num_dirs();
+  s.num_polled_files   = __poller->num_entries();
+  s.queue_depth        = queue_depth();
+  s.num_dropped        = num_dropped();
+
+  s.max_queued_events = s.max_user_watches = 0;
+  FILE *f;
+  if ( (f = fopen("/proc/sys/fs/inotify/max_queued_events", "r")) != NULL ) {
+    if (fscanf(f, "%u", &s.max_queued_events) != 1)  s.max_queued_events = 0;
+    fclose(f);
+  }
+  if ( (f = fopen("/proc/sys/fs/inotify/max_user_watches", "r")) != NULL ) {
+    if (fscanf(f, "%u", &s.max_user_watches) != 1)  s.max_user_watches = 0;
+    fclose(f);
+  }
+  return s;
+}
+
+
+/** Reset statistics.
+ * Clears all counters and histograms, including the process-wide read
+ * statistics shared with other monitors.
+ */
+void
+FileAlterationMonitor::reset_stats()
+{
+  __stats = FamStats();
+  __reactor->reset_read_stats();
+  __stats_start_us = fam_now_us();
+}
+
+
+/** Add an event to the current batch.
+ * @param dir_id interned path of the watch the event occured on
+ * @param name name of the file, empty for events on the watch itself
+ * @param mask event mask
+ */
+void
+FileAlterationMonitor::batch_event(unsigned int dir_id, const char *name,
+				   unsigned int mask)
+{
+  // the watch path is interned, only the full path is assembled in the
+  // arena as "watch_path/name\0", which stops allocating once it has
+  // grown to the size of a typical batch, pointers are resolved once it
+  // has stopped growing
+  FamEvent fe;
+  fe.dir_id = dir_id;
+  fe.mask   = mask;
+  __batch.push_back(fe);
+  const std::string &watch_path = __dir_paths[dir_id];
+  __batch_offsets.push_back(__batch_strings.length());
+  __batch_strings.append(watch_path);
+  if (name[0] != 0) {
+    __batch_strings.append(1, '/');
+    __batch_offsets.push_back(__batch_strings.length());
+    __batch_strings.append(name);
+  } else {
+    __batch_offsets.push_back(__batch_strings.length());
+  }
+  __batch_strings.append(1, '\0');
+}
+
+
+/** Post the current batch to all listeners.
+ * @return true if any events were posted, false if the batch was empty
+ */
+bool
+FileAlterationMonitor::dispatch_batch()
+{
+  if (__batch.empty())  return false;
+
+  const char *strings = __batch_strings.c_str();
+  for (size_t b = 0; b < __batch.size(); ++b) {
+    __batch[b].watch_path = __dir_paths[__batch[b].dir_id].c_str();
+    __batch[b].path       = strings + __batch_offsets[2 * b];
+    __batch[b].name       = strings + __batch_offsets[2 * b + 1];
+  }
+  // roots are looked up once per event, only if a filter needs them
+  __batch_rootlens.assign(__batch.size(), (size_t)-1);
+  long long start_us = fam_now_us();
+  for (__lit = __listeners.begin(); __lit != __listeners.end(); ++__lit) {
+    if (! __lit->routed) {
+      __lit->listener->fam_events(&__batch[0], __batch.size());
+      continue;
+    }
+
+    __lit->events.clear();
+    for (size_t b = 0; b < __batch.size(); ++b) {
+      if (route_event(*__lit, b))  __lit->events.push_back(__batch[b]);
+    }
+    if (! __lit->events.empty()) {
+      __lit->listener->fam_events(&__lit->events[0], __lit->events.size());
+    }
+  }
+  __stats.dispatch_us.add(fam_now_us() - start_us);
+  __stats.batch_size.add(__batch.size());
+  __stats.num_delivered += __batch.size();
+  __batch.clear();
+  __batch_offsets.clear();
+  __batch_strings.clear();
+  return true;
+}
+
+
+/** Check if an event is routed to a listener.
+ * @param li listener
+ * @param b index of the event in the current batch
+ * @return true if the listener wants the event
+ */
+bool
+FileAlterationMonitor::route_event(const ListenerInfo &li, size_t b)
+{
+  const FamEvent &event = __batch[b];
+  const unsigned int always = FamListener::FAM_Q_OVERFLOW | FamListener::FAM_IGNORED |
+    FamListener::FAM_UNMOUNT;
+  if (event.mask & always)  return true;
+  if (! (event.mask & li.mask))  return false;
+  if (li.filter.empty() || (event.name[0] == 0) || (event.mask & FamListener::FAM_ISDIR)) {
+    return true;
+  }
+
+  const char *relpath = NULL;
+  if (li.filter.needs_path()) {
+    if (__batch_rootlens[b] == (size_t)-1)  __batch_rootlens[b] = root_length(event.path);
+    relpath = event.path + __batch_rootlens[b];
+  }
+  return li.filter.matches(event.name, relpath);
+}
+
+
+/** Get length of the watched root of a path.
+ * @param path path of a file or directory
+ * @return length of the longest watched root containing the path,
+ * including the trailing slash, 0 if the path is not below any root
+ */
+size_t
+FileAlterationMonitor::root_length(const char *path) const
+{
+  size_t rootlen = 0;
+  for (size_t r = 0; r < __roots.size(); ++r) {
+    const std::string &root = __roots[r];
+    if ( (root.length() >= rootlen) &&
+	 (strncmp(path, root.c_str(), root.length()) == 0) &&
+	 (path[root.length()] == '/') )
+    {
+      rootlen = root.length() + 1;
+    }
+  }
+  return rootlen;
+}
+
+
+/** Merge an event into the pending events of its file.
+ * @param dir_id interned path of the watch the event occured on
+ * @param name name of the file
+ * @param mask event mask
+ */
+void
+FileAlterationMonitor::coalesce_event(unsigned int dir_id, const char *name,
+				      unsigned int mask)
+{
+  __coalesce_key.assign(__dir_paths[dir_id]).append(1, '/').append(name);
+  std::map<std::string, PendingEvent>::iterator p = __pending.find(__coalesce_key);
+  if (p == __pending.end()) {
+    PendingEvent pe;
+    pe.dir_id = dir_id;
+    pe.existed = ! (mask & (IN_CREATE | IN_MOVED_TO));
+    pe.exists  = pe.existed;
+    p = __pending.insert(std::make_pair(__coalesce_key, pe)).first;
+  }
+
+  if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+    p->second.exists = false;
+  } else if (mask & (IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE)) {
+    p->second.exists = true;
+  }
+  p->second.last_ms = fam_now_ms();
+}
+
+
+/** Post merged events whose quiet period has expired.
+ * @param force true to post all merged events regardless of their age
+ */
+void
+FileAlterationMonitor::flush_coalesced(bool force)
+{
+  if (__pending.empty())  return;
+
+  long long now = fam_now_ms();
+  std::map<std::string, PendingEvent>::iterator p = __pending.begin();
+  while (p != __pending.end()) {
+    if (force || (now - p->second.last_ms >= (long long)__quiet_period_ms)) {
+      unsigned int mask = 0;
+      if (p->second.exists) {
+	if (! __content_hashing || content_changed(p->first, IN_MODIFY)) {
+	  mask = (p->second.existed ? FamListener::FAM_MODIFY : FamListener::FAM_CREATE)
+	    | FamListener::FAM_CONTENT_CHANGED;
+	}
+      } else {
+	if (__content_hashing)  content_changed(p->first, IN_DELETE);
+	if (p->second.existed)  mask = FamListener::FAM_DELETE;
+      }
+      if (mask != 0) {
+	unsigned int dir_id = p->second.dir_id;
+	batch_event(dir_id, p->first.c_str() + __dir_paths[dir_id].length() + 1, mask);
+      }
+      __pending.erase(p++);
+    } else {
+      ++p;
+    }
+  }
+}
+
+
+/** Get time until the next merged event is due.
+ * @return time in milliseconds, -1 if no events are pending
+ */
+int
+FileAlterationMonitor::coalesce_wait()
+{
+  if (__pending.empty())  return -1;
+
+  long long now = fam_now_ms();
+  long long next = -1;
+  std::map<std::string, PendingEvent>::iterator p;
+  for (p = __pending.begin(); p != __pending.end(); ++p) {
+    long long due = p->second.last_ms + __quiet_period_ms - now;
+    if ((next < 0) || (due < next))  next = due;
+  }
+  return (next > 0) ? (int)next : 0;
+}
+
+
+/** Interrupt a running process_events().
+ * This method will interrupt e.g. a running inifinetly blocking call of
+ * process_events(). It may be called from any thread. Events already
+ * read are still processed and dispatched, process_events() returns
+ * instead of waiting for more. If process_events() is not running the
+ * interrupt is kept and the next call returns right away, so that an
+ * interrupt issued just before a thread enters process_events() for
+ * shutdown is not lost. Several interrupts before process_events()
+ * notices them count as one.
+ */
+void
+FileAlterationMonitor::interrupt()
+{
+  if (__interruptible) {
+    __sync_fetch_and_or(&__interrupted, 1);
+    fam_signal(__wakeup_fd);
+  } else {
+    throw Exception("Currently not interruptible");
+  }
+}
+
+
+/** Check if process_events() can be interrupted.
+ * This is the case unless the kernel did not provide the eventfd used
+ * for waking up process_events().
+ * @return true if interrupt() may be called, false if it would throw
+ */
+bool
+FileAlterationMonitor::interruptible() const
+{
+  return __interruptible;
+}
+
+
+/** Consume a pending interrupt.
+ * @return true if interrupt() has been called since the last time this
+ * returned true
+ */
+bool
+FileAlterationMonitor::consume_interrupt()
+{
+  return __sync_bool_compare_and_swap(&__interrupted, 1, 0);
+}
+
+
+/** Queue an event for processing.
+ * Called by the FamReactor for events on watches of this monitor.
+ * @param event inotify event to copy into the queue
+ */
+void
+FileAlterationMonitor::queue_event(const struct inotify_event *event)
+{
+#ifdef HAVE_INOTIFY
+  const char *e = (const char *)event;
+  pthread_mutex_lock(&__queue_mutex);
+  if (__ring) {
+    // the reactor serializes all producers, dropped events are
+    // detected by the consumer
+    __ring->push(event, fam_now_us());
+  } else {
+    __queue.insert(__queue.end(), e, e + sizeof(struct inotify_event) + event->len);
+  }
+  pthread_mutex_unlock(&__queue_mutex);
+#endif
+}
+
+
+/** Check if events are queued.
+ * @return true if events are waiting to be processed
+ */
+bool
+FileAlterationMonitor::has_queued_events()
+{
+  pthread_mutex_lock(&__queue_mutex);
+  bool rv = ! __queue.empty() || (__ring && (__ring->size() > 0));
+  pthread_mutex_unlock(&__queue_mutex);
+  return rv;
+}
+
+
+/** Wake up a blocking process_events().
+ * Called by the FamReactor after events have been queued for this
+ * monitor while another monitor was reading.
+ */
+void
+FileAlterationMonitor::wakeup()
+{
+  if (__interruptible)  fam_signal(__wakeup_fd);
+}
+
+
+/** Start reader thread.
+ * By default inotify is read by whichever thread calls process_events(),
+ * right before the listeners are called. A listener which takes long
+ * delays reading, which can cause the kernel queue to overflow. In
+ * threaded mode a dedicated thread drains inotify as soon as events
+ * arrive and passes them through a bounded lock-free queue. Listeners are
+ * still called from the thread calling process_events() or
+ * dispatch_events(), which is woken up through fd() when events arrive.
+ * If the queue runs full events are dropped and the monitor resynchronizes
+ * just like after a kernel queue overflow.
+ * @param queue_capacity maximum number of queued events
+ */
+void
+FileAlterationMonitor::start_reader_thread(unsigned int queue_capacity)
+{
+#ifdef HAVE_INOTIFY
+  if (__reader_running)  return;
+
+  if ( (__reader_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+    throw Exception("Failed to create reader thread wakeup descriptor");
+  }
+  FamEventRing *ring = new FamEventRing(queue_capacity);
+  pthread_mutex_lock(&__queue_mutex);
+  __ring = ring;
+  pthread_mutex_unlock(&__queue_mutex);
+  __dropped_seen   = 0;
+  __reader_running = true;
+
+  if (pthread_create(&__reader, NULL, FileAlterationMonitor::reader_thread, this) != 0) {
+    __reader_running = false;
+    pthread_mutex_lock(&__queue_mutex);
+    __ring = NULL;
+    pthread_mutex_unlock(&__queue_mutex);
+    delete ring;
+    close(__reader_wakeup_fd);
+    throw Exception("Failed to start reader thread");
+  }
+
+  // the descriptor must no longer signal unread inotify events
+  if (__epoll_fd != -1) {
+    epoll_ctl(__epoll_fd, EPOLL_CTL_DEL, __reactor->fd(), NULL);
+  }
+#else
+  throw Exception("inotify support not available");
+#endif
+}
+
+
+/** Stop reader thread.
+ * Events already queued are processed with the next call to
+ * process_events(). Does nothing if the reader thread is not running.
+ */
+void
+FileAlterationMonitor::stop_reader_thread()
+{
+#ifdef HAVE_INOTIFY
+  if (! __reader_running)  return;
+
+  __reader_running = false;
+  fam_signal(__reader_wakeup_fd);
+  pthread_join(__reader, NULL);
+  close(__reader_wakeup_fd);
+
+  if (__epoll_fd != -1) {
+    struct epoll_event ev;
+    ev.events  = EPOLLIN;
+    ev.data.fd = __reactor->fd();
+    epoll_ctl(__epoll_fd, EPOLL_CTL_ADD, __reactor->fd(), &ev);
+  }
+
+  // producers see the pointer under the mutex, no push after this
+  pthread_mutex_lock(&__queue_mutex);
+  FamEventRing *ring = __ring;
+  __ring = NULL;
+  pthread_mutex_unlock(&__queue_mutex);
+
+  std::vector<char> remaining;
+  const struct inotify_event *event;
+  while ( (event = ring->front(NULL)) != NULL ) {
+    const char *e = (const char *)event;
+    remaining.insert(remaining.end(), e, e + sizeof(struct inotify_event) + event->len);
+    ring->pop();
+  }
+  // events dropped since the last drain_ring() call need a resync as well
+  unsigned long dropped = ring->num_dropped();
+  if (dropped != __dropped_seen) {
+    struct inotify_event overflow;
+    memset(&overflow, 0, sizeof(overflow));
+    overflow.wd   = -1;
+    overflow.mask = IN_Q_OVERFLOW;
+    const char *e = (const char *)&overflow;
+    remaining.insert(remaining.end(), e, e + sizeof(overflow));
+  }
+  __dropped_total += dropped;
+  __dropped_seen   = 0;
+  delete ring;
+
+  pthread_mutex_lock(&__queue_mutex);
+  __queue.insert(__queue.begin(), remaining.begin(), remaining.end());
+  pthread_mutex_unlock(&__queue_mutex);
+#endif
+}
+
+
+/** Check if the reader thread is running.
+ * @return true if in threaded mode
+ */
+bool
+FileAlterationMonitor::reader_thread_running() const
+{
+  return __reader_running;
+}
+
+
+/** Get queue depth.
+ * @return number of events currently waiting in the reader thread queue
+ */
+unsigned int
+FileAlterationMonitor::queue_depth() const
+{
+  return __ring ? __ring->size() : 0;
+}
+
+
+/** Get maximum queue depth.
+ * @return maximum number of events that have been waiting in the reader
+ * thread queue at once
+ */
+unsigned int
+FileAlterationMonitor::max_queue_depth() const
+{
+  return __ring ? __ring->max_size() : 0;
+}
+
+
+/** Get number of dropped events.
+ * @return number of events dropped because the reader thread queue was
+ * full, including those of reader threads that have been stopped
+ */
+unsigned long
+FileAlterationMonitor::num_dropped() const
+{
+  return __dropped_total + (__ring ? __ring->num_dropped() : 0);
+}
+
+
+/** Get average dispatch lag.
+ * @return average time in microseconds between the reader thread reading
+ * an event and its dispatch
+ */
+unsigned int
+FileAlterationMonitor::dispatch_lag_us() const
+{
+  return (__lag_count > 0) ? (unsigned int)(__lag_sum_us / __lag_count) : 0;
+}
+
+
+/** Get maximum dispatch lag.
+ * @return maximum time in microseconds between the reader thread reading
+ * an event and its dispatch
+ */
+unsigned int
+FileAlterationMonitor::max_dispatch_lag_us() const
+{
+  return (unsigned int)__lag_max_us;
+}
+
+
+/** Reader thread entry point.
+ * @param arg monitor
+ * @return always NULL
+ */
+void *
+FileAlterationMonitor::reader_thread(void *arg)
+{
+  ((FileAlterationMonitor *)arg)->read_loop();
+  return NULL;
+}
+
+
+/** Read inotify until the reader thread is stopped. */
+void
+FileAlterationMonitor::read_loop()
+{
+#ifdef HAVE_INOTIFY
+  pollfd ipfd[2];
+  ipfd[0].fd = __reactor->fd();
+  ipfd[0].events = POLLIN;
+  ipfd[1].fd = __reader_wakeup_fd;
+  ipfd[1].events = POLLIN;
+
+  while (__reader_running) {
+    ipfd[0].revents = ipfd[1].revents = 0;
+    if (poll(ipfd, 2, -1) == -1) {
+      if (errno == EINTR)  continue;
+      break;
+    }
+    if (ipfd[0].revents & POLLIN) {
+      // no reader to exclude, we need the wakeup ourselves
+      __reactor->read_events(NULL);
+    }
+  }
+#endif
+}
+
+
+/** Move events from the reader thread queue to the processing queue.
+ * If events have been dropped an overflow event is added so that the
+ * watched trees are resynchronized.
+ */
+void
+FileAlterationMonitor::drain_ring()
+{
+#ifdef HAVE_INOTIFY
+  long long now = fam_now_us();
+  long long stamp;
+  const struct inotify_event *event;
+  while ( (event = __ring->front(&stamp)) != NULL ) {
+    const char *e = (const char *)event;
+    __queue_proc.insert(__queue_proc.end(), e, e + sizeof(struct inotify_event) + event->len);
+    __ring->pop();
+
+    long long lag = now - stamp;
+    __lag_sum_us += lag;
+    ++__lag_count;
+    if (lag > __lag_max_us)  __lag_max_us = lag;
+  }
+
+  unsigned long dropped = __ring->num_dropped();
+  if (dropped != __dropped_seen) {
+    __dropped_seen = dropped;
+    struct inotify_event overflow;
+    memset(&overflow, 0, sizeof(overflow));
+    overflow.wd   = -1;
+    overflow.mask = IN_Q_OVERFLOW;
+    const char *e = (const char *)&overflow;
+    __queue_proc.insert(__queue_proc.end(), e, e + sizeof(overflow));
+  }
+#endif
+}
+
+
+/** @class FamListener <utils/system/fam.h>
+ * File Alteration Monitor Listener.
+ * Listener called by FileAlterationMonitor for events.
+ * @author Tim Niemueller
+ *
+ * @fn FamListener::fam_event(const char *filename, unsigned int mask)
+ * Event has been raised.
+ * @param filename name of the file that triggered the event
+ * @param mask mask indicating the event. Currently inotify event flags
+ * are used, see inotify.h.
+ *
+ */
+
+/** Virtual empty destructor. */
+FamListener::~FamListener()
+{
+}
+
+
+/** Batch of events has been raised.
+ * This is called once for all events that passed the filters in one
+ * processing cycle of the monitor, i.e. for all events read at once.
+ * Override it to make one decision per burst of events instead of one
+ * per event. The default implementation calls fam_event() for each event.
+ * @param events array of events, valid only during the call
+ * @param num_events number of events in the array, at least one
+ */
+void
+FamListener::fam_events(const FamEvent *events, unsigned int num_events)
+{
+  for (unsigned int i = 0; i < num_events; ++i) {
+    // events on the watch itself have no name, pass the watched path
+    fam_event(events[i].name[0] != 0 ? events[i].name : events[i].path, events[i].mask);
+  }
 }
 
 } // end of namespace fawkes
@@ -0,0 +1,411 @@
+
+/***************************************************************************
+ *  fam_filter.cpp - Compiled path filter for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 13:40:05 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/fam_filter.h>
+
+#ifndef USE_ROS
+#  include <core/exception.h>
+#else
+#  include <ros/common.h>
+#  if ROS_VERSION_MAJOR > 1 || ROS_VERSION_MAJOR == 1 && ROS_VERSION_MINOR >= 2
+#    include <ros/exception.h>
+#  else
+#    include <ros/exceptions.h>
+#  endif
+using ros::Exception;
+#endif
+
+#include <fnmatch.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace fawkes {
+
+/** @class FamPathFilter <utils/system/fam_filter.h>
+ * Compiled path filter.
+ * Filters decide which file events are posted to listeners. Each rule is
+ * compiled once when it is added. Glob and regular expression rules
+ * which merely test for a literal prefix, suffix or file name are turned
+ * into plain string comparisons, fnmatch() is used for other globs and
+ * regexec() only for regular expressions that cannot be simplified.
+ * Rules are kept ordered by cost so that cheap rules decide first.
+ *
+ * There are three kinds of rules:
+ * - required regular expressions, each of which must match the file
+ *   name (this is what FileAlterationMonitor::add_filter() used to do),
+ * - include rules, at least one of which must match if any exist,
+ * - exclude rules, none of which may match.
+ *
+ * Glob patterns that contain a slash, e.g. "tests/test_?.lua", are
+ * matched against the path relative to the watched directory, patterns
+ * without a slash against the file name only. A pattern consisting of a
+ * directory path followed by a slash and two asterisks matches
+ * everything below that directory.
+ * @author Tim Niemueller
+ */
+
+/// @cond INTERNALS
+static bool
+is_glob_special(char c)
+{
+  return (c == '*') || (c == '?') || (c == '[') || (c == '\\');
+}
+
+static bool
+is_glob_literal(const char *s, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    if (is_glob_special(s[i]))  return false;
+  }
+  return true;
+}
+
+/* Parse a regular expression fragment consisting only of literal
+ * characters and escaped special characters. */
+static bool
+parse_regex_literal(const char *s, size_t len, std::string &literal)
+{
+  literal.clear();
+  for (size_t i = 0; i < len; ++i) {
+    if (s[i] == '\\') {
+      if (++i == len)  return false;
+      if ( isalnum((unsigned char)s[i]) )  return false; // \w, \b etc.
+      literal += s[i];
+    } else if (strchr(".[]()*+?{}|^$", s[i]) != NULL) {
+      return false;
+    } else {
+      literal += s[i];
+    }
+  }
+  return true;
+}
+
+static bool
+ends_with(const char *s, const std::string &suffix)
+{
+  size_t len = strlen(s);
+  return (len >= suffix.length()) &&
+    (memcmp(s + len - suffix.length(), suffix.data(), suffix.length()) == 0);
+}
+/// @endcond
+
+
+/** Constructor. */
+FamPathFilter::FamPathFilter()
+{
+  __needs_path = false;
+}
+
+
+/** Copy constructor.
+ * @param other filter to copy
+ */
+FamPathFilter::FamPathFilter(const FamPathFilter &other)
+{
+  __needs_path = other.__needs_path;
+  copy_rules(__required, other.__required);
+  copy_rules(__includes, other.__includes);
+  copy_rules(__excludes, other.__excludes);
+}
+
+
+/** Destructor. */
+FamPathFilter::~FamPathFilter()
+{
+  clear();
+}
+
+
+/** Assignment operator.
+ * @param other filter to copy
+ * @return reference to this instance
+ */
+FamPathFilter &
+FamPathFilter::operator=(const FamPathFilter &other)
+{
+  if (this != &other) {
+    clear();
+    __needs_path = other.__needs_path;
+    copy_rules(__required, other.__required);
+    copy_rules(__includes, other.__includes);
+    copy_rules(__excludes, other.__excludes);
+  }
+  return *this;
+}
+
+
+/** Add required regular expression.
+ * The file name of an event must match every required regular expression.
+ * @param regex POSIX extended regular expression
+ */
+void
+FamPathFilter::add_required_regex(const char *regex)
+{
+  __required.push_back(compile_regex(regex));
+}
+
+
+/** Add include rule.
+ * If any include rules exist a path must match at least one of them.
+ * @param pattern glob pattern or regular expression
+ * @param is_regex true if pattern is a POSIX extended regular expression
+ */
+void
+FamPathFilter::add_include(const char *pattern, bool is_regex)
+{
+  Rule r = is_regex ? compile_regex(pattern) : compile_glob(pattern);
+  __needs_path = __needs_path || r.on_path;
+  insert_sorted(__includes, r);
+}
+
+
+/** Add exclude rule.
+ * A path that matches any exclude rule is filtered.
+ * @param pattern glob pattern or regular expression
+ * @param is_regex true if pattern is a POSIX extended regular expression
+ */
+void
+FamPathFilter::add_exclude(const char *pattern, bool is_regex)
+{
+  Rule r = is_regex ? compile_regex(pattern) : compile_glob(pattern);
+  __needs_path = __needs_path || r.on_path;
+  insert_sorted(__excludes, r);
+}
+
+
+/** Remove all rules. */
+void
+FamPathFilter::clear()
+{
+  free_rules(__required);
+  free_rules(__includes);
+  free_rules(__excludes);
+  __needs_path = false;
+}
+
+
+/** Check if filter has no rules.
+ * @return true if the filter has no rules and thus matches everything
+ */
+bool
+FamPathFilter::empty() const
+{
+  return __required.empty() && __includes.empty() && __excludes.empty();
+}
+
+
+/** Check if any rule needs the relative path.
+ * If this returns false matches() may be called with a NULL relative path.
+ * @return true if rules are matched against the relative path
+ */
+bool
+FamPathFilter::needs_path() const
+{
+  return __needs_path;
+}
+
+
+/** Check if a file passes the filter.
+ * @param name file name
+ * @param relpath path relative to the watched directory, may be NULL if
+ * needs_path() returns false
+ * @return true if the file passes the filter, false if it is filtered
+ */
+bool
+FamPathFilter::matches(const char *name, const char *relpath) const
+{
+  if (relpath == NULL)  relpath = name;
+
+  for (size_t i = 0; i < __required.size(); ++i) {
+    if (! match_rule(__required[i], name, relpath))  return false;
+  }
+  if (! __includes.empty() && ! match_any(__includes, name, relpath)) {
+    return false;
+  }
+  return ! match_any(__excludes, name, relpath);
+}
+
+
+FamPathFilter::Rule
+FamPathFilter::compile_glob(const char *pattern)
+{
+  Rule r;
+  r.kind      = GLOB;
+  r.no_hidden = false;
+  r.regex     = NULL;
+
+  while (*pattern == '/')  ++pattern;
+  r.on_path = (strchr(pattern, '/') != NULL);
+  r.pattern = pattern;
+
+  size_t len = r.pattern.length();
+  if (r.on_path) {
+    if ( (len > 3) && (r.pattern.compare(len - 3, 3, "/**") == 0) &&
+	 is_glob_literal(pattern, len - 3) )
+    {
+      r.kind = PREFIX;
+      r.pattern.erase(len - 2);
+    } else if (is_glob_literal(pattern, len)) {
+      r.kind = EXACT;
+    }
+  } else if (is_glob_literal(pattern, len)) {
+    r.kind = EXACT;
+  } else if ( (len > 0) && (pattern[0] == '*') && is_glob_literal(pattern + 1, len - 1) ) {
+    r.kind = SUFFIX;
+    r.pattern.erase(0, 1);
+  } else if ( (len > 0) && (pattern[len - 1] == '*') && is_glob_literal(pattern, len - 1) ) {
+    r.kind = PREFIX;
+    r.pattern.erase(len - 1);
+  }
+
+  return r;
+}
+
+
+FamPathFilter::Rule
+FamPathFilter::compile_regex(const char *regex)
+{
+  Rule r;
+  r.kind      = REGEX;
+  r.on_path   = false;
+  r.no_hidden = false;
+  r.regex     = NULL;
+  r.pattern   = regex;
+
+  // Recognize the common forms "\.ext$", "^[^.].*\.ext$", "^prefix"
+  // and "^name$" and turn them into string comparisons
+  const char *s = regex;
+  bool anchored = false;
+  if (*s == '^') {
+    anchored = true;
+    ++s;
+    if (strncmp(s, "[^.].*", 6) == 0) {
+      r.no_hidden = true;
+      anchored = false;
+      s += 6;
+    }
+  }
+  size_t len = strlen(s);
+  bool at_end = (len > 0) && (s[len - 1] == '$') && ((len < 2) || (s[len - 2] != '\\'));
+  if (at_end)  --len;
+
+  std::string literal;
+  if (parse_regex_literal(s, len, literal) && ! literal.empty()) {
+    if (anchored && at_end) {
+      r.kind = EXACT;
+    } else if (anchored) {
+      r.kind = PREFIX;
+    } else if (at_end) {
+      r.kind = SUFFIX;
+    }
+  }
+
+  if (r.kind != REGEX) {
+    r.pattern = literal;
+  } else {
+    r.no_hidden = false;
+    int regerr = 0;
+    r.regex = (regex_t *)malloc(sizeof(regex_t));
+    if ( (regerr = regcomp(r.regex, regex, REG_EXTENDED | REG_NOSUB)) != 0 ) {
+      char errtmp[1024];
+      regerror(regerr, r.regex, errtmp, sizeof(errtmp));
+      free(r.regex);
+      throw Exception(std::string("Failed to compile lua file regex: ") + errtmp);
+    }
+  }
+
+  return r;
+}
+
+
+bool
+FamPathFilter::match_rule(const Rule &rule, const char *name, const char *relpath)
+{
+  if (rule.no_hidden && (name[0] == '.'))  return false;
+
+  const char *s = rule.on_path ? relpath : name;
+  switch (rule.kind) {
+  case EXACT:
+    return rule.pattern == s;
+  case PREFIX:
+    return strncmp(s, rule.pattern.c_str(), rule.pattern.length()) == 0;
+  case SUFFIX:
+    // "[^.]" needs a character of its own before ".*literal"
+    return ends_with(s, rule.pattern) &&
+      (! rule.no_hidden || (strlen(s) > rule.pattern.length()));
+  case GLOB:
+    return fnmatch(rule.pattern.c_str(), s, rule.on_path ? FNM_PATHNAME : 0) == 0;
+  case REGEX:
+    return regexec(rule.regex, s, 0, NULL, 0) == 0;
+  }
+  return false;
+}
+
+
+bool
+FamPathFilter::match_any(const std::vector<Rule> &rules,
+			 const char *name, const char *relpath)
+{
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (match_rule(rules[i], name, relpath))  return true;
+  }
+  return false;
+}
+
+
+void
+FamPathFilter::insert_sorted(std::vector<Rule> &rules, const Rule &rule)
+{
+  std::vector<Rule>::iterator i = rules.begin();
+  while ( (i != rules.end()) && (i->kind <= rule.kind) )  ++i;
+  rules.insert(i, rule);
+}
+
+
+void
+FamPathFilter::free_rules(std::vector<Rule> &rules)
+{
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (rules[i].regex) {
+      regfree(rules[i].regex);
+      free(rules[i].regex);
+    }
+  }
+  rules.clear();
+}
+
+
+void
+FamPathFilter::copy_rules(std::vector<Rule> &to, const std::vector<Rule> &from)
+{
+  for (size_t i = 0; i < from.size(); ++i) {
+    Rule r = from[i];
+    if (r.kind == REGEX) {
+      r.regex = (regex_t *)malloc(sizeof(regex_t));
+      regcomp(r.regex, from[i].pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+    }
+    to.push_back(r);
+  }
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,527 @@
+
+/***************************************************************************
+ *  fam_poller.cpp - Stat polling backend for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 16:05:48 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/fam_poller.h>
+#include <lua_utils/fam.h>
+
+#ifndef USE_ROS
+#  include <core/exception.h>
+#else
+#  include <ros/common.h>
+#  if ROS_VERSION_MAJOR > 1 || ROS_VERSION_MAJOR == 1 && ROS_VERSION_MINOR >= 2
+#    include <ros/exception.h>
+#  else
+#    include <ros/exceptions.h>
+#  endif
+using ros::Exception;
+#endif
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace fawkes {
+
+/// @cond INTERNALS
+static long long
+fam_poller_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+/// @endcond
+
+/** @class FamPoller <utils/system/fam_poller.h>
+ * Stat polling backend.
+ * Some file systems, most notably NFS, never generate inotify events for
+ * modifications made by other hosts. For such paths the
+ * FileAlterationMonitor falls back to this poller. It keeps an index of
+ * the size and modification time of every file passing the filter and of
+ * the modification time of every directory. Directories are only listed
+ * again if their modification time changed, otherwise just the known
+ * files are stat'ed.
+ *
+ * Polling happens in rounds, one round every poll interval. A round is
+ * split into slices, each poll() call scans directories round-robin until
+ * the time budget is exhausted and continues with the next directory on
+ * the next call. Detected changes are posted as create, modify and delete
+ * events to the monitor, just like inotify events.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param client monitor to post events to
+ * @param filter filter files must pass to be indexed, the reference must
+ * stay valid for the lifetime of the poller
+ */
+FamPoller::FamPoller(FileAlterationMonitor *client, const FamPathFilter &filter)
+  : __client(client), __filter(filter)
+{
+  __next         = 0;
+  __in_round     = false;
+  __round_due_ms = 0;
+  __posted       = false;
+  __interval_ms  = 1000;
+  __budget_us    = 2000;
+}
+
+
+/** Poll a directory tree.
+ * The tree is indexed immediately, changes are reported from the next
+ * round on.
+ * @param dirpath path of the directory
+ * @param rootlen length of the prefix of dirpath which is stripped to
+ * form relative paths, including the trailing slash
+ */
+void
+FamPoller::add_dir(const char *dirpath, size_t rootlen)
+{
+  struct stat st;
+  if ( (stat(dirpath, &st) != 0) || ! S_ISDIR(st.st_mode) ) {
+    throw Exception(std::string("Failed to open dir ") + dirpath);
+  }
+  index_tree(dirpath, rootlen, true, false);
+}
+
+
+/** Poll a single file.
+ * @param filepath path of the file
+ */
+void
+FamPoller::add_file(const char *filepath)
+{
+  struct stat st;
+  if (stat(filepath, &st) != 0) {
+    throw Exception(std::string("Cannot add watch for file ") + filepath);
+  }
+
+  Node node;
+  node.path            = filepath;
+  node.rootlen         = 0;
+  node.is_dir          = false;
+  node.is_root         = true;
+  node.mtime_sec       = 0;
+  node.mtime_nsec      = 0;
+  node.exists          = true;
+  node.self.size       = st.st_size;
+  node.self.mtime_sec  = st.st_mtim.tv_sec;
+  node.self.mtime_nsec = st.st_mtim.tv_nsec;
+  __nodes.push_back(node);
+}
+
+
+/** Stop polling a directory tree.
+ * The directory and everything below it is removed from the index
+ * without posting events.
+ * @param dirpath path of the directory as passed to add_dir()
+ * @return true if the directory was polled, false otherwise
+ */
+bool
+FamPoller::remove_dir(const char *dirpath)
+{
+  size_t num_nodes = __nodes.size();
+  remove_tree(dirpath, false);
+  return __nodes.size() < num_nodes;
+}
+
+
+/** Stop polling a single file.
+ * @param filepath path of the file as passed to add_file()
+ * @return true if the file was polled, false otherwise
+ */
+bool
+FamPoller::remove_file(const char *filepath)
+{
+  for (size_t i = 0; i < __nodes.size(); ++i) {
+    if (! __nodes[i].is_dir && (__nodes[i].path == filepath)) {
+      if (i < __next)  --__next;
+      __nodes.erase(__nodes.begin() + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/** Set poll interval.
+ * @param interval_ms time in milliseconds between the starts of two
+ * consecutive rounds over all polled paths
+ */
+void
+FamPoller::set_interval(unsigned int interval_ms)
+{
+  __interval_ms = interval_ms;
+}
+
+
+/** Set time budget.
+ * @param budget_us time in microseconds a single call to poll() may spend
+ * scanning before it yields, at least one directory is always scanned
+ */
+void
+FamPoller::set_budget(unsigned int budget_us)
+{
+  __budget_us = budget_us;
+}
+
+
+/** Check if anything is polled.
+ * @return true if no paths are polled
+ */
+bool
+FamPoller::empty() const
+{
+  return __nodes.empty();
+}
+
+
+/** Get number of polled directories.
+ * @return number of polled directories
+ */
+unsigned int
+FamPoller::num_dirs() const
+{
+  unsigned int rv = 0;
+  for (size_t i = 0; i < __nodes.size(); ++i) {
+    if (__nodes[i].is_dir)  ++rv;
+  }
+  return rv;
+}
+
+
+/** Get number of indexed files.
+ * @return number of files in the index
+ */
+unsigned int
+FamPoller::num_entries() const
+{
+  unsigned int rv = 0;
+  for (size_t i = 0; i < __nodes.size(); ++i) {
+    rv += __nodes[i].is_dir ? __nodes[i].files.size() : 1;
+  }
+  return rv;
+}
+
+
+/** Get time until the next slice is due.
+ * @return time in milliseconds until poll() has work to do, 0 if a round
+ * is in progress, -1 if nothing is polled
+ */
+int
+FamPoller::wait_time() const
+{
+  if (__nodes.empty())  return -1;
+  if (__in_round)       return 0;
+  long long left = __round_due_ms - fam_poller_now_us() / 1000;
+  return (left > 0) ? (int)left : 0;
+}
+
+
+/** Poll the next slice.
+ * Starts a new round if the poll interval has passed and scans paths
+ * until the time budget is exhausted or the round is complete.
+ * @return true if any events have been posted
+ */
+bool
+FamPoller::poll()
+{
+  if (__nodes.empty())  return false;
+
+  long long now = fam_poller_now_us();
+  if (! __in_round) {
+    if (now / 1000 < __round_due_ms)  return false;
+    __in_round     = true;
+    __next         = 0;
+    __round_due_ms = now / 1000 + __interval_ms;
+  }
+
+  __posted = false;
+  long long deadline = now + __budget_us;
+  while (__next < __nodes.size()) {
+    size_t n = __next++;
+    if (! __nodes[n].is_dir) {
+      scan_file(n);
+    } else if (! scan_dir(n, true)) {
+      // directory is gone, the parent reports it when it notices
+      std::string path = __nodes[n].path;
+      bool is_root = __nodes[n].is_root;
+      remove_tree(path, true);
+      if (is_root)  post(path, "", FamListener::FAM_DELETE_SELF);
+    }
+    if (fam_poller_now_us() >= deadline)  break;
+  }
+  if (__next >= __nodes.size())  __in_round = false;
+
+  return __posted;
+}
+
+
+void
+FamPoller::index_tree(const std::string &dirpath, size_t rootlen, bool is_root, bool post)
+{
+  Node node;
+  node.path       = dirpath;
+  node.rootlen    = rootlen;
+  node.is_dir     = true;
+  node.is_root    = is_root;
+  node.mtime_sec  = 0;
+  node.mtime_nsec = 0;
+  node.exists     = true;
+  __nodes.push_back(node);
+  scan_dir(__nodes.size() - 1, post);
+}
+
+
+bool
+FamPoller::passes(const Node &node, const char *name)
+{
+  if (__filter.empty())  return true;
+
+  const char *relpath = NULL;
+  if (__filter.needs_path()) {
+    if (node.rootlen < node.path.length()) {
+      __relpath.assign(node.path, node.rootlen, std::string::npos);
+      __relpath.append(1, '/').append(name);
+    } else {
+      __relpath.assign(name);
+    }
+    relpath = __relpath.c_str();
+  }
+  return __filter.matches(name, relpath);
+}
+
+
+void
+FamPoller::post(const std::string &watch_path, const char *name, unsigned int mask)
+{
+  unsigned int dir_id = __client->intern_dir(watch_path);
+  __client->account_event(dir_id, name, mask);
+  __client->post_event(dir_id, name, mask);
+  __posted = true;
+}
+
+
+/* Scan one directory and update its index. New subdirectories are
+ * indexed right away, with events if post is true. Returns false if the
+ * directory cannot be opened anymore. */
+bool
+FamPoller::scan_dir(size_t n, bool post)
+{
+  int fd = open(__nodes[n].path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)  return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  std::vector<std::string> new_dirs, gone_dirs;
+  std::map<std::string, Entry>::iterator f;
+  struct stat fst;
+  {
+    Node &node = __nodes[n];
+
+    // The directory only needs to be listed if entries have been added or
+    // removed, which changes its modification time. Be conservative if it
+    // was modified within the time granule of some file systems.
+    bool list = (node.mtime_sec != st.st_mtim.tv_sec) ||
+      (node.mtime_nsec != st.st_mtim.tv_nsec) ||
+      (time(NULL) <= st.st_mtim.tv_sec + 1);
+    node.mtime_sec  = st.st_mtim.tv_sec;
+    node.mtime_nsec = st.st_mtim.tv_nsec;
+
+    if (list) {
+      int lfd = dup(fd);
+      DIR *d = (lfd >= 0) ? fdopendir(lfd) : NULL;
+      if (d == NULL) {
+	if (lfd >= 0)  close(lfd);
+	close(fd);
+	return false;
+      }
+
+      std::set<std::string> seen_files, seen_dirs;
+      struct dirent *de;
+      while ( (de = readdir(d)) != NULL ) {
+	if ( (strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0) )  continue;
+
+	bool have_stat = false;
+	bool is_dir = (de->d_type == DT_DIR);
+	if ( (de->d_type == DT_UNKNOWN) || (de->d_type == DT_LNK) ) {
+	  have_stat = (fstatat(fd, de->d_name, &fst, 0) == 0);
+	  is_dir = have_stat && S_ISDIR(fst.st_mode);
+	}
+
+	if (is_dir) {
+	  if (de->d_name[0] == '.')  continue;
+	  seen_dirs.insert(de->d_name);
+	  if (node.subdirs.find(de->d_name) == node.subdirs.end()) {
+	    new_dirs.push_back(de->d_name);
+	  }
+	} else if (passes(node, de->d_name)) {
+	  if (! have_stat && (fstatat(fd, de->d_name, &fst, 0) != 0))  continue;
+	  seen_files.insert(de->d_name);
+	  if ( (f = node.files.find(de->d_name)) == node.files.end() ) {
+	    Entry &e = node.files[de->d_name];
+	    e.size       = fst.st_size;
+	    e.mtime_sec  = fst.st_mtim.tv_sec;
+	    e.mtime_nsec = fst.st_mtim.tv_nsec;
+	    if (post)  this->post(node.path, de->d_name, FamListener::FAM_CREATE);
+	  } else if ( (f->second.size != fst.st_size) ||
+		      (f->second.mtime_sec != fst.st_mtim.tv_sec) ||
+		      (f->second.mtime_nsec != fst.st_mtim.tv_nsec) )
+	  {
+	    f->second.size       = fst.st_size;
+	    f->second.mtime_sec  = fst.st_mtim.tv_sec;
+	    f->second.mtime_nsec = fst.st_mtim.tv_nsec;
+	    if (post)  this->post(node.path, de->d_name, FamListener::FAM_MODIFY);
+	  }
+	}
+      }
+      closedir(d);
+
+      f = node.files.begin();
+      while (f != node.files.end()) {
+	if (seen_files.find(f->first) == seen_files.end()) {
+	  if (post)  this->post(node.path, f->first.c_str(), FamListener::FAM_DELETE);
+	  node.files.erase(f++);
+	} else {
+	  ++f;
+	}
+      }
+      std::set<std::string>::iterator s;
+      for (s = node.subdirs.begin(); s != node.subdirs.end(); ++s) {
+	if (seen_dirs.find(*s) == seen_dirs.end())  gone_dirs.push_back(*s);
+      }
+      node.subdirs.swap(seen_dirs);
+
+    } else {
+      f = node.files.begin();
+      while (f != node.files.end()) {
+	if (fstatat(fd, f->first.c_str(), &fst, 0) != 0) {
+	  if (post)  this->post(node.path, f->first.c_str(), FamListener::FAM_DELETE);
+	  node.files.erase(f++);
+	  continue;
+	}
+	if ( (f->second.size != fst.st_size) ||
+	     (f->second.mtime_sec != fst.st_mtim.tv_sec) ||
+	     (f->second.mtime_nsec != fst.st_mtim.tv_nsec) )
+	{
+	  f->second.size       = fst.st_size;
+	  f->second.mtime_sec  = fst.st_mtim.tv_sec;
+	  f->second.mtime_nsec = fst.st_mtim.tv_nsec;
+	  if (post)  this->post(node.path, f->first.c_str(), FamListener::FAM_MODIFY);
+	}
+	++f;
+      }
+    }
+  }
+  close(fd);
+
+  // the node reference is invalid once nodes are added or removed
+  std::string path = __nodes[n].path;
+  size_t rootlen = __nodes[n].rootlen;
+  for (size_t i = 0; i < gone_dirs.size(); ++i) {
+    remove_tree(path + "/" + gone_dirs[i], post);
+    if (post)  this->post(path, gone_dirs[i].c_str(), FamListener::FAM_DELETE | FamListener::FAM_ISDIR);
+  }
+  for (size_t i = 0; i < new_dirs.size(); ++i) {
+    if (post)  this->post(path, new_dirs[i].c_str(), FamListener::FAM_CREATE | FamListener::FAM_ISDIR);
+    index_tree(path + "/" + new_dirs[i], rootlen, false, post);
+  }
+
+  return true;
+}
+
+
+void
+FamPoller::scan_file(size_t n)
+{
+  // like file watches on inotify, events are reported as events on the
+  // file name in its parent directory, and the file is still polled after
+  // it has been deleted so that it being created again is noticed
+  Node &node = __nodes[n];
+  std::string::size_type slash = node.path.rfind('/');
+  std::string dir  = (slash != std::string::npos) ? node.path.substr(0, slash) : ".";
+  const char *name = node.path.c_str() + ((slash != std::string::npos) ? slash + 1 : 0);
+
+  struct stat st;
+  if (stat(node.path.c_str(), &st) != 0) {
+    if (node.exists) {
+      node.exists = false;
+      post(dir, name, FamListener::FAM_DELETE);
+    }
+    return;
+  }
+
+  if (! node.exists) {
+    node.exists          = true;
+    node.self.size       = st.st_size;
+    node.self.mtime_sec  = st.st_mtim.tv_sec;
+    node.self.mtime_nsec = st.st_mtim.tv_nsec;
+    post(dir, name, FamListener::FAM_CREATE);
+  } else if ( (node.self.size != st.st_size) ||
+	      (node.self.mtime_sec != st.st_mtim.tv_sec) ||
+	      (node.self.mtime_nsec != st.st_mtim.tv_nsec) )
+  {
+    node.self.size       = st.st_size;
+    node.self.mtime_sec  = st.st_mtim.tv_sec;
+    node.self.mtime_nsec = st.st_mtim.tv_nsec;
+    post(dir, name, FamListener::FAM_MODIFY);
+  }
+}
+
+
+/* Remove a directory and all directories below it from the index,
+ * posting delete events for their files if post is true. */
+void
+FamPoller::remove_tree(const std::string &dirpath, bool post)
+{
+  for (size_t i = __nodes.size(); i-- > 0; ) {
+    const std::string &p = __nodes[i].path;
+    if ( ! __nodes[i].is_dir ||
+	 (p.compare(0, dirpath.length(), dirpath) != 0) ||
+	 ((p.length() > dirpath.length()) && (p[dirpath.length()] != '/')) )
+    {
+      continue;
+    }
+
+    if (post) {
+      std::map<std::string, Entry>::iterator f;
+      for (f = __nodes[i].files.begin(); f != __nodes[i].files.end(); ++f) {
+	this->post(__nodes[i].path, f->first.c_str(), FamListener::FAM_DELETE);
+      }
+      std::string::size_type slash = p.rfind('/');
+      if ( (p.length() > dirpath.length()) && (slash != std::string::npos) ) {
+	this->post(p.substr(0, slash), p.c_str() + slash + 1,
+		   FamListener::FAM_DELETE | FamListener::FAM_ISDIR);
+      }
+    }
+    if (i < __next)  --__next;
+    __nodes.erase(__nodes.begin() + i);
+  }
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,416 @@
+
+/***************************************************************************
+ *  fam_reactor.cpp - Process-wide inotify reactor for FileAlterationMonitor
+ *
+ *  Created: Sat Oct 17 10:12:31 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/fam_reactor.h>
+#include <lua_utils/fam.h>
+
+#ifndef USE_ROS
+#  include <core/exception.h>
+#else
+#  include <ros/common.h>
+#  if ROS_VERSION_MAJOR > 1 || ROS_VERSION_MAJOR == 1 && ROS_VERSION_MINOR >= 2
+#    include <ros/exception.h>
+#  else
+#    include <ros/exceptions.h>
+#  endif
+using ros::Exception;
+#endif
+
+#ifdef HAVE_INOTIFY
+#  include <sys/inotify.h>
+#  include <sys/ioctl.h>
+#  include <unistd.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+namespace fawkes {
+
+/** @class FamReactor <utils/system/fam_reactor.h>
+ * Process-wide inotify reactor.
+ * All FileAlterationMonitor instances of a process share a single inotify
+ * file descriptor provided by this reactor. Watches are reference counted
+ * by the monitors using them. Since the kernel identifies watches by inode
+ * and returns the same watch descriptor when adding a watch for an inode
+ * that is already watched, watches for the same directory reached by
+ * different monitors (or different paths) are deduplicated automatically.
+ * Whichever monitor reads the inotify descriptor demultiplexes the events
+ * to the pending queues of all monitors interested in the respective
+ * watch and wakes them up.
+ *
+ * The reactor is created on the first call to instance() and destroyed
+ * once the last monitor has called release().
+ *
+ * The read buffer starts at room for 1024 events and grows up to
+ * MAX_BUFSIZE bytes whenever more data is pending in the kernel queue
+ * than fits into it. If the kernel queue overflows nevertheless the
+ * overflow event is queued for all clients, which then resynchronize.
+ * @author Tim Niemueller
+ */
+
+FamReactor *    FamReactor::__instance = NULL;
+unsigned int    FamReactor::__refcount = 0;
+pthread_mutex_t FamReactor::__instance_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Get reactor instance.
+ * Creates the reactor if it does not exist, yet. Every call must be
+ * matched by a call to release().
+ * @return process-wide reactor instance
+ */
+FamReactor *
+FamReactor::instance()
+{
+  pthread_mutex_lock(&__instance_mutex);
+  if ( __instance == NULL ) {
+    try {
+      __instance = new FamReactor();
+    } catch (Exception &e) {
+      pthread_mutex_unlock(&__instance_mutex);
+      throw;
+    }
+  }
+  ++__refcount;
+  FamReactor *rv = __instance;
+  pthread_mutex_unlock(&__instance_mutex);
+  return rv;
+}
+
+
+/** Release reactor instance.
+ * Once the last reference has been released the reactor is destroyed
+ * and the inotify file descriptor is closed.
+ */
+void
+FamReactor::release()
+{
+  pthread_mutex_lock(&__instance_mutex);
+  if ( (__refcount > 0) && (--__refcount == 0) ) {
+    delete __instance;
+    __instance = NULL;
+  }
+  pthread_mutex_unlock(&__instance_mutex);
+}
+
+
+/** Constructor.
+ * Opens the inotify context.
+ */
+FamReactor::FamReactor()
+{
+  pthread_mutex_init(&__mutex, NULL);
+
+  __inotify_fd = -1;
+  __inotify_buf = NULL;
+  __inotify_bufsize = 0;
+  __num_overflows = 0;
+  __max_pending = 0;
+
+#ifdef HAVE_INOTIFY
+  // non-blocking, several monitors may poll and read concurrently
+  if ( (__inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+    pthread_mutex_destroy(&__mutex);
+    throw Exception("Failed to initialize inotify");
+  }
+
+  // from http://www.linuxjournal.com/article/8478
+  __inotify_bufsize = 1024 * (sizeof(struct inotify_event) + 16);
+  __inotify_buf     = (char *)malloc(__inotify_bufsize);
+#endif
+}
+
+
+/** Destructor. */
+FamReactor::~FamReactor()
+{
+#ifdef HAVE_INOTIFY
+  for (__wit = __watches.begin(); __wit != __watches.end(); ++__wit) {
+    inotify_rm_watch(__inotify_fd, __wit->first);
+  }
+  close(__inotify_fd);
+  if ( __inotify_buf ) {
+    free(__inotify_buf);
+    __inotify_buf = NULL;
+  }
+#endif
+  pthread_mutex_destroy(&__mutex);
+}
+
+
+/** Add a watch.
+ * If the inode referenced by the path is already watched only the client
+ * is added to the existing watch, widening its mask if necessary.
+ * @param path path of directory or file to watch
+ * @param mask inotify event mask
+ * @param client monitor to deliver events for this watch to
+ * @return watch descriptor, -1 if the watch could not be added
+ */
+int
+FamReactor::add_watch(const char *path, uint32_t mask,
+		      FileAlterationMonitor *client)
+{
+#ifdef HAVE_INOTIFY
+  pthread_mutex_lock(&__mutex);
+  // IN_MASK_ADD so that we never narrow the mask of a watch shared
+  // with another client
+  int wd = inotify_add_watch(__inotify_fd, path, mask | IN_MASK_ADD);
+  if ( wd >= 0 ) {
+    if ( (__wit = __watches.find(wd)) == __watches.end() ) {
+      Watch w;
+      w.mask = 0;
+      __wit = __watches.insert(std::make_pair(wd, w)).first;
+    }
+    Watch &w = __wit->second;
+    w.mask |= mask;
+    if (std::find(w.clients.begin(), w.clients.end(), client) == w.clients.end()) {
+      w.clients.push_back(client);
+    }
+  }
+  pthread_mutex_unlock(&__mutex);
+  return wd;
+#else
+  return -1;
+#endif
+}
+
+
+/** Remove a client from a watch.
+ * The kernel watch is removed once no client references it anymore.
+ * @param wd watch descriptor
+ * @param client client to remove
+ */
+void
+FamReactor::rm_watch(int wd, FileAlterationMonitor *client)
+{
+#ifdef HAVE_INOTIFY
+  pthread_mutex_lock(&__mutex);
+  if ( (__wit = __watches.find(wd)) != __watches.end() ) {
+    __wit->second.clients.remove(client);
+    if ( __wit->second.clients.empty() ) {
+      inotify_rm_watch(__inotify_fd, wd);
+      __watches.erase(__wit);
+    }
+  }
+  pthread_mutex_unlock(&__mutex);
+#endif
+}
+
+
+/** Remove a client from all watches.
+ * After this returns the reactor will not call the client anymore.
+ * @param client client to remove
+ */
+void
+FamReactor::remove_client(FileAlterationMonitor *client)
+{
+#ifdef HAVE_INOTIFY
+  pthread_mutex_lock(&__mutex);
+  __wit = __watches.begin();
+  while ( __wit != __watches.end() ) {
+    __wit->second.clients.remove(client);
+    if ( __wit->second.clients.empty() ) {
+      inotify_rm_watch(__inotify_fd, __wit->first);
+      __watches.erase(__wit++);
+    } else {
+      ++__wit;
+    }
+  }
+  pthread_mutex_unlock(&__mutex);
+#endif
+}
+
+
+/** Get inotify file descriptor.
+ * @return inotify file descriptor, suitable for poll()
+ */
+int
+FamReactor::fd() const
+{
+  return __inotify_fd;
+}
+
+
+/** Get number of kernel watches.
+ * @return number of inotify watches currently held
+ */
+unsigned int
+FamReactor::num_watches()
+{
+  pthread_mutex_lock(&__mutex);
+  unsigned int rv = __watches.size();
+  pthread_mutex_unlock(&__mutex);
+  return rv;
+}
+
+
+/** Get number of queue overflows.
+ * @return number of times the kernel event queue overflowed
+ */
+unsigned int
+FamReactor::num_overflows()
+{
+  pthread_mutex_lock(&__mutex);
+  unsigned int rv = __num_overflows;
+  pthread_mutex_unlock(&__mutex);
+  return rv;
+}
+
+
+/** Get current read buffer size.
+ * @return size of the read buffer in bytes
+ */
+size_t
+FamReactor::read_buffer_size()
+{
+  pthread_mutex_lock(&__mutex);
+  size_t rv = __inotify_bufsize;
+  pthread_mutex_unlock(&__mutex);
+  return rv;
+}
+
+
+/** Get number of bytes pending in the kernel queue.
+ * @return number of bytes of events waiting to be read
+ */
+unsigned int
+FamReactor::pending_bytes()
+{
+  int pending = 0;
+#ifdef HAVE_INOTIFY
+  if (ioctl(__inotify_fd, FIONREAD, &pending) != 0)  pending = 0;
+#endif
+  return pending;
+}
+
+
+/** Get read statistics.
+ * @param read_bytes upon return contains the histogram of bytes per read
+ * @param max_pending upon return contains the largest number of bytes
+ * found pending in the kernel queue before a read
+ */
+void
+FamReactor::read_stats(Log2Histogram &read_bytes, unsigned int &max_pending)
+{
+  pthread_mutex_lock(&__mutex);
+  read_bytes  = __read_bytes;
+  max_pending = __max_pending;
+  pthread_mutex_unlock(&__mutex);
+}
+
+
+/** Reset read statistics. */
+void
+FamReactor::reset_read_stats()
+{
+  pthread_mutex_lock(&__mutex);
+  __read_bytes.reset();
+  __max_pending = 0;
+  pthread_mutex_unlock(&__mutex);
+}
+
+
+/** Read and demultiplex pending events.
+ * Reads all events currently available on the inotify descriptor and
+ * queues them with every client of the respective watch. Clients other
+ * than the reader are woken up afterwards. Returns immediately if no
+ * events are pending.
+ * @param reader monitor which is reading, it is not woken up
+ */
+void
+FamReactor::read_events(FileAlterationMonitor *reader)
+{
+#ifdef HAVE_INOTIFY
+  std::list<FileAlterationMonitor *> wakeup, overflowed;
+  std::list<FileAlterationMonitor *>::iterator c;
+
+  pthread_mutex_lock(&__mutex);
+  ssize_t bytes;
+  while (true) {
+    int pending = 0;
+    if (ioctl(__inotify_fd, FIONREAD, &pending) != 0)  pending = 0;
+    if ((unsigned int)pending > __max_pending)  __max_pending = pending;
+    if ( ((size_t)pending > __inotify_bufsize) && (__inotify_bufsize < MAX_BUFSIZE) ) {
+      size_t newsize = __inotify_bufsize * 2;
+      while ((newsize < (size_t)pending) && (newsize < MAX_BUFSIZE))  newsize *= 2;
+      if (newsize > MAX_BUFSIZE)  newsize = MAX_BUFSIZE;
+      char *newbuf = (char *)realloc(__inotify_buf, newsize);
+      if (newbuf) {
+	__inotify_buf     = newbuf;
+	__inotify_bufsize = newsize;
+      }
+    }
+
+    if ((bytes = read(__inotify_fd, __inotify_buf, __inotify_bufsize)) <= 0)  break;
+    __read_bytes.add(bytes);
+
+    ssize_t i = 0;
+    while (i < bytes) {
+      struct inotify_event *event = (struct inotify_event *) &__inotify_buf[i];
+
+      if ( event->mask & IN_Q_OVERFLOW ) {
+	// events have been lost, every client must resynchronize
+	++__num_overflows;
+	for (__wit = __watches.begin(); __wit != __watches.end(); ++__wit) {
+	  for (c = __wit->second.clients.begin(); c != __wit->second.clients.end(); ++c) {
+	    if (std::find(overflowed.begin(), overflowed.end(), *c) == overflowed.end()) {
+	      overflowed.push_back(*c);
+	    }
+	  }
+	}
+	for (c = overflowed.begin(); c != overflowed.end(); ++c) {
+	  (*c)->queue_event(event);
+	  if ( (*c != reader) &&
+	       (std::find(wakeup.begin(), wakeup.end(), *c) == wakeup.end()) )
+	  {
+	    wakeup.push_back(*c);
+	  }
+	}
+	overflowed.clear();
+      } else if ( (__wit = __watches.find(event->wd)) != __watches.end() ) {
+	for (c = __wit->second.clients.begin(); c != __wit->second.clients.end(); ++c) {
+	  (*c)->queue_event(event);
+	  if ( (*c != reader) &&
+	       (std::find(wakeup.begin(), wakeup.end(), *c) == wakeup.end()) )
+	  {
+	    wakeup.push_back(*c);
+	  }
+	}
+
+	if ( event->mask & IN_IGNORED ) {
+	  // watch has been removed by the kernel
+	  __watches.erase(__wit);
+	}
+      }
+
+      i += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  for (c = wakeup.begin(); c != wakeup.end(); ++c) {
+    (*c)->wakeup();
+  }
+  pthread_mutex_unlock(&__mutex);
+#endif
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,367 @@
+
+/***************************************************************************
+ *  fam_record.cpp - Record and replay of FileAlterationMonitor event streams
+ *
+ *  Created: Sat Oct 17 19:22:14 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/fam_record.h>
+#include <lua_utils/fam.h>
+
+#ifndef USE_ROS
+#  include <core/exception.h>
+#  include <utils/logging/liblogger.h>
+#else
+#  include <ros/common.h>
+#  if ROS_VERSION_MAJOR > 1 || ROS_VERSION_MAJOR == 1 && ROS_VERSION_MINOR >= 2
+#    include <ros/exception.h>
+#  else
+#    include <ros/exceptions.h>
+#  endif
+using ros::Exception;
+#endif
+
+#include <climits>
+#include <ctime>
+#include <cstring>
+#include <cstdio>
+
+namespace fawkes {
+
+/// @cond INTERNALS
+static const char FAM_RECORD_MAGIC[] = "FAMREC1\n";
+
+static long long
+fam_record_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+/// @endcond
+
+/** @class FamEventRecorder <utils/system/fam_record.h>
+ * Event stream recorder.
+ * Writes the raw events seen by a FileAlterationMonitor, before any
+ * filtering, coalescing or content hashing, to a file, so that the
+ * stream can be fed into a monitor again later with FamEventPlayer.
+ *
+ * The file starts with the line "FAMREC1" followed by records. Numbers
+ * are stored as unsigned LEB128 variable length integers. A record
+ * starting with 'D' defines a directory by its id, the length of the
+ * prefix that is stripped to form relative paths, the length of the
+ * path and the path itself. It is written before the first event on
+ * that directory. A record starting with 'E' is an event, with the time
+ * in microseconds since the previous event, the directory id, the event
+ * mask, the length of the name and the name itself.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param filename name of the file to write, it is truncated
+ */
+FamEventRecorder::FamEventRecorder(const char *filename)
+{
+  if ( (__file = fopen(filename, "wb")) == NULL ) {
+    throw Exception(std::string("Failed to open event recording ") + filename);
+  }
+  fwrite(FAM_RECORD_MAGIC, 1, sizeof(FAM_RECORD_MAGIC) - 1, __file);
+  __last_us    = fam_record_now_us();
+  __num_events = 0;
+}
+
+
+/** Destructor.
+ * Flushes and closes the file.
+ */
+FamEventRecorder::~FamEventRecorder()
+{
+  fclose(__file);
+}
+
+
+/** Check if a directory has been recorded.
+ * @param dir_id id of the directory
+ * @return true if record_dir() has been called for the directory
+ */
+bool
+FamEventRecorder::knows_dir(unsigned int dir_id) const
+{
+  return (dir_id < __dirs.size()) && __dirs[dir_id];
+}
+
+
+/** Record a directory.
+ * @param dir_id id of the directory, as used for record()
+ * @param path path of the directory
+ * @param rootlen length of the prefix of path which is stripped to form
+ * relative paths, including the trailing slash
+ */
+void
+FamEventRecorder::record_dir(unsigned int dir_id, const std::string &path, size_t rootlen)
+{
+  if (dir_id >= __dirs.size())  __dirs.resize(dir_id + 1, false);
+  __dirs[dir_id] = true;
+
+  fputc('D', __file);
+  write_varint(dir_id);
+  write_varint(rootlen);
+  write_varint(path.length());
+  fwrite(path.data(), 1, path.length(), __file);
+}
+
+
+/** Record an event.
+ * @param dir_id id of the directory, recorded before with record_dir()
+ * @param name file name, empty for events on the watch itself
+ * @param mask event mask
+ */
+void
+FamEventRecorder::record(unsigned int dir_id, const char *name, unsigned int mask)
+{
+  long long now = fam_record_now_us();
+  size_t namelen = strlen(name);
+
+  fputc('E', __file);
+  write_varint((now > __last_us) ? now - __last_us : 0);
+  write_varint(dir_id);
+  write_varint(mask);
+  write_varint(namelen);
+  fwrite(name, 1, namelen, __file);
+
+  __last_us = now;
+  ++__num_events;
+}
+
+
+/** Get number of recorded events.
+ * @return number of events recorded so far
+ */
+unsigned long
+FamEventRecorder::num_events() const
+{
+  return __num_events;
+}
+
+
+void
+FamEventRecorder::write_varint(unsigned long long value)
+{
+  do {
+    unsigned char c = value & 0x7F;
+    value >>= 7;
+    if (value)  c |= 0x80;
+    fputc(c, __file);
+  } while (value);
+}
+
+
+
+/** @class FamEventPlayer <utils/system/fam_record.h>
+ * Event stream player.
+ * Reads a stream written by FamEventRecorder and posts the events to a
+ * FileAlterationMonitor as if they had just been read from the kernel.
+ * The filters of the monitor are applied to the replayed events, then
+ * they are coalesced, hashed and dispatched as usual. Watches are not
+ * touched and replay is independent of the current file system state,
+ * except for queue overflows. Those resynchronize the watched trees of
+ * the monitor like live ones, so that overflow handling can be
+ * reproduced.
+ *
+ * Events are replayed with their original timing scaled by the speed
+ * factor, a speed of 2 replays twice as fast, a speed of 0 or less as
+ * fast as possible. Like the FamPoller the player is driven from the
+ * monitor's event loop, at most MAX_EVENTS_PER_CALL events are posted
+ * per call so that large streams are dispatched in reasonable batches.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param client monitor to post events to
+ * @param filename name of the file written by FamEventRecorder
+ * @param speed replay speed factor
+ */
+FamEventPlayer::FamEventPlayer(FileAlterationMonitor *client, const char *filename,
+			       double speed)
+  : __client(client)
+{
+  if ( (__file = fopen(filename, "rb")) == NULL ) {
+    throw Exception(std::string("Failed to open event recording ") + filename);
+  }
+  char magic[sizeof(FAM_RECORD_MAGIC) - 1];
+  if ( (fread(magic, 1, sizeof(magic), __file) != sizeof(magic)) ||
+       (memcmp(magic, FAM_RECORD_MAGIC, sizeof(magic)) != 0) )
+  {
+    fclose(__file);
+    throw Exception(std::string("Not an event recording: ") + filename);
+  }
+
+  __speed      = speed;
+  __start_us   = fam_record_now_us();
+  __next_us    = 0;
+  __num_events = 0;
+  __have_next  = read_next();
+}
+
+
+/** Destructor. */
+FamEventPlayer::~FamEventPlayer()
+{
+  fclose(__file);
+}
+
+
+/** Check if all events have been replayed.
+ * @return true if the end of the recording has been reached
+ */
+bool
+FamEventPlayer::finished() const
+{
+  return ! __have_next;
+}
+
+
+/** Get time until the next event is due.
+ * @return time in milliseconds until play() has work to do, 0 if events
+ * are due, -1 if the recording has been replayed completely
+ */
+int
+FamEventPlayer::wait_time() const
+{
+  if (! __have_next)   return -1;
+  if (__speed <= 0.)   return 0;
+  long long left = __start_us + (long long)(__next_us / __speed) - fam_record_now_us();
+  return (left > 0) ? (int)((left + 999) / 1000) : 0;
+}
+
+
+/** Replay due events.
+ * @return true if any events have been posted
+ */
+bool
+FamEventPlayer::play()
+{
+  long long elapsed = fam_record_now_us() - __start_us;
+  unsigned int posted = 0;
+  while ( __have_next && (posted < MAX_EVENTS_PER_CALL) &&
+	  ((__speed <= 0.) || ((long long)(__next_us / __speed) <= elapsed)) )
+  {
+    __client->replay_event(__dir_paths[__next_dir], __dir_rootlens[__next_dir],
+			   __next_name.c_str(), __next_mask);
+    ++posted;
+    ++__num_events;
+    __have_next = read_next();
+  }
+  return posted > 0;
+}
+
+
+/** Get number of replayed events.
+ * @return number of events replayed so far
+ */
+unsigned long
+FamEventPlayer::num_events() const
+{
+  return __num_events;
+}
+
+
+bool
+FamEventPlayer::read_varint(unsigned long long &value)
+{
+  value = 0;
+  int c;
+  unsigned int shift = 0;
+  do {
+    if ( ((c = fgetc(__file)) == EOF) || (shift > 63) )  return false;
+    value |= (unsigned long long)(c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return true;
+}
+
+
+/* Log that the recording is corrupt. Returns false so that playback
+ * stops at this point. */
+bool
+FamEventPlayer::corrupt(const char *what)
+{
+#ifndef USE_ROS
+  LibLogger::log_error("FamEventPlayer", "Corrupt recording (%s), "
+		       "stopping playback after %lu events", what, __num_events);
+#else
+  printf("FamEventPlayer: Corrupt recording (%s), stopping playback after %lu events\n",
+	 what, __num_events);
+#endif
+  return false;
+}
+
+
+/* Read records up to and including the next event. Returns false at the
+ * end of the file or if the file is truncated or corrupt. Lengths and ids
+ * are checked before anything is allocated for them, a damaged file must
+ * not make us allocate gigabytes. */
+bool
+FamEventPlayer::read_next()
+{
+  unsigned long long id, rootlen, delta, mask, len;
+  std::string path;
+  int type;
+  while ( (type = fgetc(__file)) != EOF ) {
+    if (type == 'D') {
+      if (! read_varint(id) || ! read_varint(rootlen) || ! read_varint(len))  return false;
+      if (id >= MAX_DIRS)       return corrupt("directory id out of range");
+      if (len >= PATH_MAX)      return corrupt("directory path too long");
+      if (rootlen > len + 1)    return corrupt("root longer than directory path");
+      path.resize(len);
+      if ( (len > 0) && (fread(&path[0], 1, len, __file) != len) )  return false;
+      if (id >= __dir_paths.size()) {
+	__dir_paths.resize(id + 1);
+	__dir_rootlens.resize(id + 1, 0);
+	__dir_defined.resize(id + 1, false);
+      }
+      __dir_paths[id]    = path;
+      __dir_rootlens[id] = rootlen;
+      __dir_defined[id]  = true;
+
+    } else if (type == 'E') {
+      if ( ! read_varint(delta) || ! read_varint(id) || ! read_varint(mask) ||
+	   ! read_varint(len) )
+      {
+	return false;
+      }
+      if ((id >= __dir_defined.size()) || ! __dir_defined[id]) {
+	return corrupt("event on undefined directory");
+      }
+      if (len > NAME_MAX)       return corrupt("file name too long");
+      if (mask > 0xFFFFFFFFULL) return corrupt("event mask out of range");
+      __next_name.resize(len);
+      if ( (len > 0) && (fread(&__next_name[0], 1, len, __file) != len) )  return false;
+      __next_us  += delta;
+      __next_dir  = id;
+      __next_mask = mask;
+      return true;
+
+    } else {
+      return corrupt("unknown record type");
+    }
+  }
+  return false;
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,178 @@
+
+/***************************************************************************
+ *  fam_ring.cpp - Bounded event queue for the FileAlterationMonitor reader
+ *
+ *  Created: Sat Oct 17 18:22:10 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/fam_ring.h>
+
+#ifdef HAVE_INOTIFY
+#  include <sys/inotify.h>
+#endif
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+namespace fawkes {
+
+/** @class FamEventRing <utils/system/fam_ring.h>
+ * Bounded single-producer single-consumer event queue.
+ * Used by the FileAlterationMonitor in threaded mode to pass events from
+ * the reader thread to the thread dispatching them to listeners. Each
+ * slot holds one inotify event including the longest possible file name
+ * and the time it was queued. Neither side ever blocks or takes a lock,
+ * the head is only written by the producer and the tail only by the
+ * consumer. If the queue is full the event is dropped and counted, the
+ * consumer must then resynchronize.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param capacity maximum number of queued events
+ */
+FamEventRing::FamEventRing(size_t capacity)
+{
+  __capacity  = (capacity > 0) ? capacity : 1;
+#ifdef HAVE_INOTIFY
+  __slot_size = sizeof(struct inotify_event) + NAME_MAX + 1;
+#else
+  __slot_size = 16 + NAME_MAX + 1;
+#endif
+  __slots     = (char *)malloc(__capacity * __slot_size);
+  __stamps    = (long long *)malloc(__capacity * sizeof(long long));
+  __head      = 0;
+  __tail      = 0;
+  __max_size  = 0;
+  __dropped   = 0;
+}
+
+
+/** Destructor. */
+FamEventRing::~FamEventRing()
+{
+  free(__slots);
+  free(__stamps);
+}
+
+
+/** Queue an event.
+ * May only be called by the producer.
+ * @param event event to queue
+ * @param stamp_us time the event has been read in microseconds
+ * @return true if the event was queued, false if it has been dropped
+ * because the queue is full
+ */
+bool
+FamEventRing::push(const struct inotify_event *event, long long stamp_us)
+{
+#ifdef HAVE_INOTIFY
+  size_t head = __head;
+  size_t size = head - __tail;
+  size_t len  = sizeof(struct inotify_event) + event->len;
+  if ( (size >= __capacity) || (len > __slot_size) ) {
+    __sync_fetch_and_add(&__dropped, 1);
+    return false;
+  }
+
+  size_t slot = head % __capacity;
+  memcpy(__slots + slot * __slot_size, event, len);
+  __stamps[slot] = stamp_us;
+  // publish the slot before moving the head
+  __sync_synchronize();
+  __head = head + 1;
+
+  if (size + 1 > __max_size)  __max_size = size + 1;
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+/** Get oldest event.
+ * May only be called by the consumer.
+ * @param stamp_us upon return contains the time the event was queued
+ * @return oldest event, NULL if the queue is empty, valid until pop()
+ */
+const struct inotify_event *
+FamEventRing::front(long long *stamp_us)
+{
+  size_t tail = __tail;
+  if (tail == __head)  return NULL;
+  // read the slot only after seeing the head
+  __sync_synchronize();
+
+  size_t slot = tail % __capacity;
+  if (stamp_us)  *stamp_us = __stamps[slot];
+  return (const struct inotify_event *)(__slots + slot * __slot_size);
+}
+
+
+/** Remove oldest event.
+ * May only be called by the consumer after front() returned an event.
+ */
+void
+FamEventRing::pop()
+{
+  // done with the slot before handing it back to the producer
+  __sync_synchronize();
+  __tail = __tail + 1;
+}
+
+
+/** Get number of queued events.
+ * @return number of queued events
+ */
+size_t
+FamEventRing::size() const
+{
+  return __head - __tail;
+}
+
+
+/** Get capacity.
+ * @return maximum number of queued events
+ */
+size_t
+FamEventRing::capacity() const
+{
+  return __capacity;
+}
+
+
+/** Get high water mark.
+ * @return maximum number of events that have been queued at once
+ */
+size_t
+FamEventRing::max_size() const
+{
+  return __max_size;
+}
+
+
+/** Get number of dropped events.
+ * @return number of events dropped because the queue was full
+ */
+unsigned long
+FamEventRing::num_dropped() const
+{
+  return __dropped;
+}
+
+} // end of namespace fawkes
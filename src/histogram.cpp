@@ -0,0 +1,108 @@
+
+/***************************************************************************
+ *  histogram.cpp - Histogram with power of two buckets
+ *
+ *  Created: Sat Oct 17 20:48:37 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/histogram.h>
+
+namespace fawkes {
+
+/** @class Log2Histogram <utils/misc/histogram.h>
+ * Histogram with power of two buckets.
+ * Adding a value is a handful of instructions, so histograms can be kept
+ * on hot paths. Resolution is a factor of two, which is enough to tell
+ * whether reads, batches, listener calls or lock hold times are getting
+ * out of hand. The last bucket is open-ended and takes all values that
+ * do not fit the buckets before it.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param num_buckets number of buckets, at least two
+ */
+Log2Histogram::Log2Histogram(unsigned int num_buckets)
+  : buckets(num_buckets < 2 ? 2 : num_buckets, 0)
+{
+  reset();
+}
+
+
+/** Add a value.
+ * @param value value to add
+ */
+void
+Log2Histogram::add(unsigned long value)
+{
+  const unsigned int last = buckets.size() - 1;
+  unsigned int b = 0;
+  for (unsigned long v = value; (v != 0) && (b < last); v >>= 1)  ++b;
+  ++buckets[b];
+  ++count;
+  sum += value;
+  if (value > max)  max = value;
+}
+
+
+/** Remove all values. */
+void
+Log2Histogram::reset()
+{
+  buckets.assign(buckets.size(), 0);
+  count = 0;
+  sum   = 0;
+  max   = 0;
+}
+
+
+/** Get mean value.
+ * @return mean of all values, 0 if there are none
+ */
+double
+Log2Histogram::mean() const
+{
+  return (count > 0) ? (double)sum / count : 0.;
+}
+
+
+/** Get approximate percentile.
+ * @param p percentile as fraction, e.g. 0.99
+ * @return upper bound of the bucket the percentile falls into, but at
+ * most the largest value
+ */
+unsigned long
+Log2Histogram::percentile(double p) const
+{
+  if (count == 0)  return 0;
+
+  unsigned long rank = (unsigned long)(p * count);
+  if (rank >= count)  rank = count - 1;
+  const unsigned int last = buckets.size() - 1;
+  unsigned long seen = 0;
+  for (unsigned int i = 0; i < last; ++i) {
+    seen += buckets[i];
+    if (seen > rank) {
+      unsigned long upper = (i == 0) ? 0 : (1UL << i) - 1;
+      return (upper > max) ? max : upper;
+    }
+  }
+  return max;
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,146 @@
+
+/***************************************************************************
+ *  mutex.cpp - Mutex and scoped locker for builds without Fawkes core
+ *
+ *  Created: Sun Oct 18 10:12:31 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+#include <lua_utils/mutex.h>
+
+namespace fawkes {
+#if 0 /* just to make Emacs auto-indent happy */
+}
+#endif
+
+/** @class Mutex <lua_utils/mutex.h>
+ * Mutex.
+ * Stands in for the Fawkes mutex in builds without the Fawkes core
+ * libraries. A recursive mutex may be locked again by the thread holding
+ * it, e.g. when Lua code run by the context calls back into it, and must
+ * be unlocked as often. A normal mutex is adaptive where available, it
+ * spins for a short while before putting a waiting thread to sleep, which
+ * suits locks that are held only for short operations.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param type mutex type
+ */
+Mutex::Mutex(Type type)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if (type == RECURSIVE) {
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+  } else {
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+  }
+  pthread_mutex_init(&__mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+
+/** Destructor. */
+Mutex::~Mutex()
+{
+  pthread_mutex_destroy(&__mutex);
+}
+
+
+/** Lock mutex.
+ * Blocks until the mutex is available. A recursive mutex returns
+ * immediately if the calling thread already holds it.
+ */
+void
+Mutex::lock()
+{
+  pthread_mutex_lock(&__mutex);
+}
+
+
+/** Try to lock mutex.
+ * @return true if the mutex has been locked, false if another thread
+ * holds it
+ */
+bool
+Mutex::try_lock()
+{
+  return (pthread_mutex_trylock(&__mutex) == 0);
+}
+
+
+/** Unlock mutex.
+ * Must be called by the thread holding the mutex, once for each lock.
+ */
+void
+Mutex::unlock()
+{
+  pthread_mutex_unlock(&__mutex);
+}
+
+
+
+/** @class MutexLocker <lua_utils/mutex.h>
+ * Scoped mutex lock.
+ * Locks the mutex on construction and unlocks it when it goes out of
+ * scope, so that a sequence of operations is run under the lock even if
+ * one of them throws.
+ * @author Tim Niemueller
+ */
+
+/** Constructor.
+ * @param mutex mutex to lock
+ * @param initially_lock true to lock the mutex right away
+ */
+MutexLocker::MutexLocker(Mutex *mutex, bool initially_lock)
+{
+  __mutex  = mutex;
+  __locked = initially_lock;
+  if (__locked)  __mutex->lock();
+}
+
+
+/** Destructor.
+ * Unlocks the mutex if it is locked by this locker.
+ */
+MutexLocker::~MutexLocker()
+{
+  if (__locked)  __mutex->unlock();
+}
+
+
+/** Lock the mutex again after unlock(). */
+void
+MutexLocker::relock()
+{
+  __mutex->lock();
+  __locked = true;
+}
+
+
+/** Unlock the mutex before the locker goes out of scope. */
+void
+MutexLocker::unlock()
+{
+  __locked = false;
+  __mutex->unlock();
+}
+
+} // end of namespace fawkes
@@ -0,0 +1,135 @@
+
+/***************************************************************************
+ *  fam_overlap_check.cpp - Check watching overlapping directory trees
+ *
+ *  Created: Sun Oct 18 10:02:37 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Watches a tree, then watches and unwatches a directory inside it,
+ * for example a package directory containing a script that watches its
+ * own subdirectory, and checks that events in the tree still arrive,
+ * both in the subdirectory and elsewhere. Relative paths seen by
+ * filters must stay relative to the outer tree. Exits with status 0 if
+ * all checks passed, 1 otherwise.
+ */
+
+#include <lua_utils/fam.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <set>
+
+using namespace fawkes;
+
+static std::string base;
+
+class EventCollector : public FamListener
+{
+ public:
+  virtual void fam_event(const char *filename, unsigned int mask) {}
+
+  virtual void fam_events(const FamEvent *events, unsigned int num_events)
+  {
+    for (unsigned int i = 0; i < num_events; ++i) {
+      if ( (events[i].mask & (FAM_CREATE | FAM_MODIFY)) &&
+	   (base.compare(0, base.length(), events[i].path, base.length()) == 0) )
+      {
+	files.insert(events[i].path + base.length() + 1);
+      }
+    }
+  }
+
+  std::set<std::string> files;
+};
+
+static int failed = 0;
+
+static void
+touch(const char *relpath)
+{
+  int fd = open((base + "/" + relpath).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if ((fd == -1) || (write(fd, "x", 1) != 1)) {
+    perror(relpath);
+  }
+  if (fd != -1)  close(fd);
+}
+
+static void
+expect(FileAlterationMonitor &fam, EventCollector &c, const char *relpath, bool wanted,
+       const char *what)
+{
+  c.files.clear();
+  touch(relpath);
+  for (int i = 0; i < 5; ++i)  fam.process_events(20);
+  bool seen = (c.files.find(relpath) != c.files.end());
+  printf("%-4s %s: %s %s\n", (seen == wanted) ? "ok" : "FAIL", what, relpath,
+	 seen ? "reported" : "not reported");
+  if (seen != wanted)  failed = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  char tmpl[] = "/tmp/fam_overlap_check.XXXXXX";
+  if (mkdtemp(tmpl) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  base = tmpl;
+  mkdir((base + "/pkg").c_str(), 0755);
+  mkdir((base + "/pkg/scripts").c_str(), 0755);
+  mkdir((base + "/pkg/scripts/sub").c_str(), 0755);
+
+  try {
+    FileAlterationMonitor fam;
+    EventCollector c;
+    fam.add_listener(&c);
+    // the filter sees paths relative to the outer tree
+    fam.add_include_filter("pkg/**");
+
+    fam.watch_dir(tmpl);
+    expect(fam, c, "pkg/scripts/a.lua", true, "tree");
+
+    fam.watch_dir((base + "/pkg/scripts").c_str());
+    expect(fam, c, "pkg/scripts/b.lua", true, "tree and subdir");
+
+    fam.unwatch_dir((base + "/pkg/scripts").c_str());
+    expect(fam, c, "pkg/scripts/c.lua", true, "subdir unwatched");
+    expect(fam, c, "pkg/scripts/sub/d.lua", true, "subdir unwatched, nested");
+    expect(fam, c, "pkg/e.lua", true, "subdir unwatched, elsewhere");
+
+    fam.watch_dir(tmpl);
+    fam.unwatch_dir(tmpl);
+    expect(fam, c, "pkg/f.lua", true, "tree watched twice, unwatched once");
+
+    fam.unwatch_dir(tmpl);
+    expect(fam, c, "pkg/g.lua", false, "tree unwatched");
+  } catch (std::exception &e) {
+    printf("FAIL %s\n", e.what());
+    failed = 1;
+  }
+
+  if (system((std::string("rm -rf ") + tmpl).c_str()) != 0) {
+    fprintf(stderr, "Failed to remove %s\n", tmpl);
+  }
+  return failed;
+}
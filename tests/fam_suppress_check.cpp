@@ -0,0 +1,124 @@
+
+/***************************************************************************
+ *  fam_suppress_check.cpp - Check process_events() with suppressed events
+ *
+ *  Created: Sun Oct 18 15:12:40 2026
+ *  Copyright  2006-2010  Tim Niemueller [www.niemueller.de]
+ *
+ ****************************************************************************/
+
+/*  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  Read the full text in the LICENSE.GPL file in the doc directory.
+ */
+
+/* Rewrites a watched file with unchanged content while content hashing
+ * is enabled and checks that process_events() with a timeout returns as
+ * soon as the events have been processed, even though all of them were
+ * suppressed, and that no event is reported. A changed file must still
+ * be reported. Exits with status 0 if all checks passed, 1 otherwise.
+ */
+
+#include <lua_utils/fam.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace fawkes;
+
+/* Longer than any run of the loop, shorter than the timeout given. */
+static const double MAX_RETURN_MS = 1000.;
+static const int    TIMEOUT_MS    = 3000;
+
+class EventCounter : public FamListener
+{
+ public:
+  EventCounter() : num_events(0) {}
+  virtual void fam_event(const char *filename, unsigned int mask) { ++num_events; }
+
+  unsigned int num_events;
+};
+
+static int failed = 0;
+
+static double
+now_ms()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static void
+write_file(const std::string &path, const char *content)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if ((fd == -1) || (write(fd, content, strlen(content)) != (ssize_t)strlen(content))) {
+    perror(path.c_str());
+  }
+  if (fd != -1)  close(fd);
+}
+
+static void
+check(bool ok, const char *what)
+{
+  printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+  if (! ok)  failed = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  char tmpl[] = "/tmp/fam_suppress_check.XXXXXX";
+  if (mkdtemp(tmpl) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::string file = std::string(tmpl) + "/a.lua";
+  write_file(file, "return 1\n");
+
+  try {
+    FileAlterationMonitor fam;
+    EventCounter c;
+    fam.add_listener(&c);
+    fam.set_content_hashing(true);
+    fam.watch_dir(tmpl);
+    fam.process_events(0);
+
+    write_file(file, "return 1\n");
+    double start = now_ms();
+    fam.process_events(TIMEOUT_MS);
+    double ms = now_ms() - start;
+    printf("     unchanged file: returned after %.1f ms\n", ms);
+    check(ms < MAX_RETURN_MS, "unchanged file, returns once events are processed");
+    check(c.num_events == 0, "unchanged file, not reported");
+
+    write_file(file, "return 2\n");
+    start = now_ms();
+    fam.process_events(TIMEOUT_MS);
+    ms = now_ms() - start;
+    printf("     changed file: returned after %.1f ms\n", ms);
+    check(ms < MAX_RETURN_MS, "changed file, returns once events are dispatched");
+    check(c.num_events > 0, "changed file, reported");
+  } catch (std::exception &e) {
+    printf("FAIL %s\n", e.what());
+    failed = 1;
+  }
+
+  unlink(file.c_str());
+  rmdir(tmpl);
+  return failed;
+}